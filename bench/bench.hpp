@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <malloc.h>
+
+// Shared helpers for the micro-benchmarks: global allocation counters,
+// a wall-clock timer, and a generator for synthetic hub configurations.
+//
+// Each benchmark is a single translation unit, so the replacement
+// operators below are defined exactly once per executable.
+
+namespace bench {
+
+	inline uint64_t allocations = 0;
+
+	// Bytes currently allocated through operator new, and the high-water
+	// mark, which may be reset between measurements
+	inline uint64_t live_bytes = 0;
+	inline uint64_t peak_bytes = 0;
+
+	inline void reset_peak() {
+		peak_bytes = live_bytes;
+	}
+
+	class Timer {
+
+		public:
+
+			Timer()
+				: _start { std::chrono::steady_clock::now() }
+			{}
+
+			double seconds() const {
+				return std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+			}
+
+		private:
+			std::chrono::steady_clock::time_point _start;
+	};
+
+	// A configuration with one [Interface] and n_peers [Peer] blocks,
+	// shaped like the configuration of a hub with many spokes
+	inline std::string hub_config(uint64_t n_peers, bool preshared_keys = false) {
+		std::string cfg;
+
+		cfg.reserve(n_peers * 200 + 256);
+
+		cfg += "[Interface]\n";
+		cfg += "# Hub\n";
+		cfg += "PrivateKey = APmSX97Yww7WyHrQGG3u7oUJAKRazSyXVu9lD+A3aW8=\n";
+		cfg += "Address = 10.0.0.1/8, fc00:aaaa:aaaa:aa01::1/64\n";
+		cfg += "ListenPort = 51820\n";
+		cfg += "DNS = 10.0.0.2, 10.0.0.3\n";
+		cfg += "\n";
+
+		for(uint64_t i = 0; i < n_peers; i++) {
+			char buf[256];
+
+			unsigned a = (i >> 16) & 0xff, b = (i >> 8) & 0xff, c = i & 0xff;
+
+			cfg += "[Peer]\n";
+			snprintf(buf, sizeof(buf), "PublicKey = kMIIVxitU3/1AnAGwdL5KazDQ9%016llxA=\n", (unsigned long long) i);
+			cfg += buf;
+			if(preshared_keys) {
+				cfg += "PresharedKey = KIst3pK+YVHmM5k7NbNULKd2px9vaRsFi/y4E7NDWDQ=\n";
+			}
+			snprintf(buf, sizeof(buf), "AllowedIPs = 10.%u.%u.%u/32, fc00:%x:%x::%x/128 # spoke %llu\n",
+				a, b, c, a, b, c, (unsigned long long) i);
+			cfg += buf;
+			snprintf(buf, sizeof(buf), "Endpoint = 203.0.%u.%u:51820\n", b, c);
+			cfg += buf;
+			cfg += "PersistentKeepalive = 25\n";
+			cfg += "\n";
+		}
+
+		return cfg;
+	}
+
+	inline uint64_t count_lines(std::string const & s) {
+		uint64_t n = 0;
+		for(char c : s) {
+			n += c == '\n';
+		}
+		return n;
+	}
+
+};
+
+// The replacement operators are paired with malloc/free, which GCC
+// flags once they are inlined into the benchmarks
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void * operator new(std::size_t size) {
+	bench::allocations++;
+
+	if(void * p = std::malloc(size ? size : 1)) {
+		bench::live_bytes += malloc_usable_size(p);
+		if(bench::live_bytes > bench::peak_bytes) {
+			bench::peak_bytes = bench::live_bytes;
+		}
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept {
+	bench::live_bytes -= malloc_usable_size(p);
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept {
+	bench::live_bytes -= malloc_usable_size(p);
+	std::free(p);
+}
+
+// std::pmr::new_delete_resource() allocates through the aligned forms
+void * operator new(std::size_t size, std::align_val_t align) {
+	bench::allocations++;
+
+	size_t alignment = size_t(align);
+
+	if(void * p = std::aligned_alloc(alignment, (size / alignment + 1) * alignment)) {
+		bench::live_bytes += malloc_usable_size(p);
+		if(bench::live_bytes > bench::peak_bytes) {
+			bench::peak_bytes = bench::live_bytes;
+		}
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p, std::align_val_t) noexcept {
+	bench::live_bytes -= malloc_usable_size(p);
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t, std::align_val_t) noexcept {
+	bench::live_bytes -= malloc_usable_size(p);
+	std::free(p);
+}
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "bench.hpp"
+
+#include "wg2nd.hpp"
+
+#include <regex>
+#include <vector>
+
+// The std::regex classification which preceded parse_cidr
+namespace legacy {
+
+	bool _is_default_route(std::string const & cidr) {
+		static std::regex ipv4_wildcard("0(\\.0){0,3}\\/0");
+		static std::regex ipv6_wildcard("(0{0,4}:){0,7}0{0,4}\\/0{1,4}");
+
+		return std::regex_match(cidr, ipv4_wildcard) or std::regex_match(cidr, ipv6_wildcard);
+	}
+
+	bool _is_ipv4_route(std::string const & cidr) {
+		static std::regex ipv4("\\d{1,3}(\\.\\d{1,3}){0,3}(\\/\\d{1,2})?");
+
+		return std::regex_match(cidr, ipv4);
+	}
+
+};
+
+int main(int argc, char ** argv) {
+	uint64_t n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 50000;
+
+	std::vector<std::string> cidrs;
+	cidrs.reserve(n);
+
+	for(uint64_t i = 0; i < n; i++) {
+		char buf[64];
+
+		if(i % 2) {
+			snprintf(buf, sizeof(buf), "10.%u.%u.%u/32",
+				(unsigned) (i >> 16) & 0xff, (unsigned) (i >> 8) & 0xff, (unsigned) i & 0xff);
+		} else {
+			snprintf(buf, sizeof(buf), "fc00:%x:%x::%x/128",
+				(unsigned) (i >> 16) & 0xff, (unsigned) (i >> 8) & 0xff, (unsigned) i & 0xff);
+		}
+
+		cidrs.emplace_back(buf);
+	}
+
+	cidrs[n / 2] = "0.0.0.0/0";
+
+	printf("cidr: %llu prefixes\n", (unsigned long long) n);
+
+	uint64_t ipv4 = 0, defaults = 0;
+
+	{
+		bench::Timer timer;
+
+		for(std::string const & cidr : cidrs) {
+			ipv4 += legacy::_is_ipv4_route(cidr);
+			defaults += legacy::_is_default_route(cidr);
+		}
+
+		double elapsed = timer.seconds();
+		printf("%-16s %10.1f ns/prefix\n", "std::regex", elapsed / n * 1e9);
+	}
+
+	{
+		bench::Timer timer;
+
+		for(std::string const & cidr : cidrs) {
+			std::optional<wg2nd::Cidr> prefix = wg2nd::parse_cidr(cidr);
+			ipv4 -= prefix->is_ipv4();
+			defaults -= prefix->is_default_route();
+		}
+
+		double elapsed = timer.seconds();
+		printf("%-16s %10.1f ns/prefix\n", "parse_cidr", elapsed / n * 1e9);
+	}
+
+	// Both classifications must agree
+	if(ipv4 != 0 or defaults != 0) {
+		fprintf(stderr, "classifications differ\n");
+		return 1;
+	}
+
+	// Overlap detection, with a peer for each prefix
+	std::vector<wg2nd::Cidr> prefixes;
+	prefixes.reserve(n);
+
+	for(std::string const & cidr : cidrs) {
+		prefixes.push_back(*wg2nd::parse_cidr(cidr));
+	}
+
+	{
+		bench::Timer timer;
+
+		wg2nd::AllowedIPsTrie trie;
+		for(wg2nd::Cidr const & prefix : prefixes) {
+			trie.add_peer("peer", std::span { &prefix, 1 });
+		}
+
+		double elapsed = timer.seconds();
+		printf("%-16s %10.1f ns/prefix\n", "AllowedIPsTrie", elapsed / n * 1e9);
+
+		if(trie.n_conflicts() != 0) {
+			fprintf(stderr, "disjoint prefixes conflict\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
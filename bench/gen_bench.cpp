@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "bench.hpp"
+
+#include <thread>
+
+#include "wg2nd.hpp"
+
+static void run(char const * name, wg2nd::Config const & cfg, int iterations, wg2nd::GenerateOptions const & options) {
+	double best = 1e300;
+	uint64_t allocs = 0;
+	size_t size = 0;
+
+	for(int i = 0; i < iterations; i++) {
+		uint64_t before = bench::allocations;
+		bench::Timer timer;
+
+		wg2nd::SystemdConfig systemd = wg2nd::gen_systemd_config(cfg, "/etc/systemd/network/", {},
+			wg2nd::ActivationPolicy::MANUAL, options);
+
+		double elapsed = timer.seconds();
+		allocs = bench::allocations - before;
+
+		if(elapsed < best) {
+			best = elapsed;
+		}
+
+		size = systemd.netdev.contents.size() + systemd.network.contents.size();
+	}
+
+	printf("%-10s %8.1f ms %10.1f MB/s %10llu allocations\n",
+		name, best * 1e3, size / best / 1e6, (unsigned long long) allocs);
+}
+
+int main(int argc, char ** argv) {
+	uint64_t n_peers = argc > 1 ? strtoull(argv[1], nullptr, 10) : 500000;
+	int iterations = 5;
+
+	std::string input = bench::hub_config(n_peers, true);
+	wg2nd::Config cfg = wg2nd::parse_config("wg", std::string_view { input });
+
+	wg2nd::SystemdConfig systemd = wg2nd::gen_systemd_config(cfg, "/etc/systemd/network/", {});
+
+	printf("generate: %llu peers, netdev %.1f MB, network %.1f MB, %u hardware threads\n",
+		(unsigned long long) n_peers, systemd.netdev.contents.size() / 1e6, systemd.network.contents.size() / 1e6,
+		std::thread::hardware_concurrency());
+
+	for(unsigned threads : { 1, 2, 4, 8 }) {
+		char name[32];
+		snprintf(name, sizeof(name), "threads=%u", threads);
+
+		run(name, cfg, iterations, wg2nd::GenerateOptions { .threads = threads });
+	}
+
+	return 0;
+}
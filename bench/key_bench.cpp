@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "bench.hpp"
+
+#include "crypto/pubkey.hpp"
+
+#include <array>
+#include <vector>
+
+// Public key derivation through the Montgomery ladder against the
+// fixed-base table of curve25519_generate_public, one key at a time, and
+// in batches through each backend of curve25519_generate_public_batch
+int main(int argc, char ** argv) {
+	uint64_t n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000;
+
+	std::vector<std::array<uint8_t, 32>> secrets(n);
+
+	uint64_t state = 0x9e3779b97f4a7c15;
+	for(std::array<uint8_t, 32> & secret : secrets) {
+		for(uint8_t & byte : secret) {
+			state = state * 6364136223846793005 + 1442695040888963407;
+			byte = uint8_t(state >> 56);
+		}
+	}
+
+	printf("keys: %llu\n", (unsigned long long) n);
+
+	uint8_t const basepoint[32] = { 9 };
+	uint8_t ladder_acc = 0, fixed_base_acc = 0;
+	bool batches_agree = true;
+
+	{
+		bench::Timer timer;
+
+		for(std::array<uint8_t, 32> const & secret : secrets) {
+			uint8_t pub[32];
+			curve25519(pub, secret.data(), basepoint);
+			ladder_acc ^= pub[0];
+		}
+
+		double elapsed = timer.seconds();
+		printf("%-16s %10.1f us/key\n", "ladder", elapsed / n * 1e6);
+	}
+
+	{
+		bench::Timer timer;
+
+		for(std::array<uint8_t, 32> const & secret : secrets) {
+			uint8_t pub[32];
+			curve25519_generate_public(pub, secret.data());
+			fixed_base_acc ^= pub[0];
+		}
+
+		double elapsed = timer.seconds();
+		printf("%-16s %10.1f us/key\n", "fixed-base", elapsed / n * 1e6);
+	}
+
+	struct {
+		char const * name;
+		curve25519_backend backend;
+	} const backends[] = {
+		{ "batch", CURVE25519_BACKEND_SCALAR },
+		{ "batch-avx512ifma", CURVE25519_BACKEND_AVX512IFMA },
+	};
+
+	for(auto const & [name, backend] : backends) {
+		std::vector<std::array<uint8_t, 32>> pubs(n);
+
+		bench::Timer timer;
+
+		int ret = curve25519_generate_public_batch_backend(backend,
+			reinterpret_cast<uint8_t (*)[32]>(pubs.data()),
+			reinterpret_cast<uint8_t const (*)[32]>(secrets.data()),
+			n
+		);
+
+		double elapsed = timer.seconds();
+
+		if(ret != 0) {
+			printf("%-16s %10s\n", name, "unsupported");
+			continue;
+		}
+
+		printf("%-16s %10.1f us/key\n", name, elapsed / n * 1e6);
+
+		uint8_t acc = 0;
+		for(std::array<uint8_t, 32> const & pub : pubs) {
+			acc ^= pub[0];
+		}
+
+		batches_agree = batches_agree and acc == fixed_base_acc;
+	}
+
+	// Every derivation must agree
+	if(ladder_acc != fixed_base_acc or !batches_agree) {
+		fprintf(stderr, "public keys differ\n");
+		return 1;
+	}
+
+	return 0;
+}
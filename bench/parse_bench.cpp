@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "bench.hpp"
+
+#include "wg2nd.hpp"
+
+#include <sstream>
+#include <regex>
+
+// The getline-based parser which preceded the tokenizer, kept verbatim
+// (minus the validation which does not affect the hot path) as a baseline
+namespace legacy {
+
+	struct Cidr {
+		std::string route;
+		bool is_default_route;
+		bool is_ipv4;
+	};
+
+	struct Peer {
+		std::string endpoint;
+		std::string public_key;
+		std::vector<Cidr> allowed_ips;
+		std::string persistent_keepalive;
+		std::string preshared_key;
+	};
+
+	struct Config {
+		std::string private_key;
+		std::vector<std::string> addresses;
+		std::vector<std::string> DNS;
+		std::string listen_port;
+		std::vector<Peer> peers;
+	};
+
+	bool _is_default_route(std::string const & cidr) {
+		static std::regex ipv4_wildcard("0(\\.0){0,3}\\/0");
+		static std::regex ipv6_wildcard("(0{0,4}:){0,7}0{0,4}\\/0{1,4}");
+
+		return std::regex_match(cidr, ipv4_wildcard) or std::regex_match(cidr, ipv6_wildcard);
+	}
+
+	bool _is_ipv4_route(std::string const & cidr) {
+		static std::regex ipv4("\\d{1,3}(\\.\\d{1,3}){0,3}(\\/\\d{1,2})?");
+
+		return std::regex_match(cidr, ipv4);
+	}
+
+	Config parse_config(std::istream & stream) {
+		Config cfg;
+		std::string line;
+
+		while (std::getline(stream, line)) {
+			{
+				size_t i = 0, j = 0;
+				for(; i < line.size(); i++) {
+					if(line[i] != ' ' and line[i] != '\t' and line[i] != '\r') {
+						line[j] = line[i];
+						j++;
+					}
+				}
+				line.erase(j);
+			}
+
+			size_t comment_start = line.find('#');
+			if(comment_start != std::string::npos) {
+				line.erase(comment_start);
+			}
+
+			if (line.empty()) {
+				continue;
+			}
+
+			if (line == "[Interface]") {
+				continue;
+			} else if (line == "[Peer]") {
+				cfg.peers.emplace_back();
+				continue;
+			}
+
+			size_t pos = line.find('=');
+			std::string key = line.substr(0, pos);
+			std::string value = line.substr(pos + 1);
+
+			if (key == "PrivateKey") {
+				cfg.private_key = value;
+			} else if (key == "DNS") {
+				std::istringstream dnsStream(value);
+				std::string dnsIp;
+				while (std::getline(dnsStream, dnsIp, ',')) {
+					cfg.DNS.push_back(dnsIp);
+				}
+			} else if (key == "Address") {
+				std::istringstream addressStream(value);
+				std::string address;
+				while (std::getline(addressStream, address, ',')) {
+					cfg.addresses.push_back(address);
+				}
+			} else if (key == "ListenPort") {
+				cfg.listen_port = value;
+			} else if (key == "Endpoint") {
+				cfg.peers.back().endpoint = value;
+			} else if (key == "AllowedIPs") {
+				std::istringstream allowedIpsStream(value);
+				std::string allowedIp;
+
+				while (std::getline(allowedIpsStream, allowedIp, ',')) {
+					cfg.peers.back().allowed_ips.push_back(Cidr {
+						.route = allowedIp,
+						.is_default_route = _is_default_route(allowedIp),
+						.is_ipv4 = _is_ipv4_route(allowedIp),
+					});
+				}
+			} else if (key == "PublicKey") {
+				cfg.peers.back().public_key = value;
+			} else if (key == "PersistentKeepalive") {
+				cfg.peers.back().persistent_keepalive = value;
+			} else if (key == "PresharedKey") {
+				cfg.peers.back().preshared_key = value;
+			}
+		}
+
+		return cfg;
+	}
+
+};
+
+template<typename F>
+static void run(char const * name, std::string const & input, uint64_t lines, int iterations, F && parse) {
+	double best = 1e300;
+	uint64_t allocs = 0;
+	uint64_t peak = 0;
+
+	for(int i = 0; i < iterations; i++) {
+		uint64_t before = bench::allocations;
+		uint64_t live = bench::live_bytes;
+		bench::reset_peak();
+		bench::Timer timer;
+
+		size_t n_peers = parse();
+
+		double elapsed = timer.seconds();
+		allocs = bench::allocations - before;
+		peak = bench::peak_bytes - live;
+
+		if(elapsed < best) {
+			best = elapsed;
+		}
+
+		if(n_peers == 0) {
+			fprintf(stderr, "%s: parsed no peers\n", name);
+			exit(1);
+		}
+	}
+
+	printf("%-10s %10.1f MB/s %8.2f allocations/line %10.1f MB peak heap\n",
+		name, input.size() / best / 1e6, (double) allocs / lines, peak / 1e6);
+}
+
+int main(int argc, char ** argv) {
+	uint64_t n_peers = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000;
+	int iterations = 5;
+
+	std::string input = bench::hub_config(n_peers);
+	uint64_t lines = bench::count_lines(input);
+
+	printf("parse: %llu peers, %llu lines, %.1f MB\n",
+		(unsigned long long) n_peers, (unsigned long long) lines, input.size() / 1e6);
+
+	run("getline", input, lines, iterations, [&] {
+		std::istringstream stream { input };
+		return legacy::parse_config(stream).peers.size();
+	});
+
+	run("tokenizer", input, lines, iterations, [&] {
+		return wg2nd::parse_config("wg", std::string_view { input }).peers.size();
+	});
+
+	for(unsigned threads : { 1, 2, 4, 8, 16 }) {
+		char name[32];
+		snprintf(name, sizeof(name), "threads=%u", threads);
+
+		run(name, input, lines, iterations, [&] {
+			return wg2nd::parse_config("wg", std::string_view { input }, wg2nd::ParseOptions { .threads = threads }).peers.size();
+		});
+	}
+
+	run("streaming", input, lines, iterations, [&] {
+		size_t n = 0;
+
+		wg2nd::parse_config_streaming("wg", std::string_view { input }, wg2nd::ParseCallbacks {
+			.on_interface = [](wg2nd::Interface &&) {},
+			.on_peer = [&n](wg2nd::Peer &&) { n++; },
+		});
+
+		return n;
+	});
+
+	return 0;
+}
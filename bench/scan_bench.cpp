@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "bench.hpp"
+
+#include "scanner.hpp"
+#include "tokenizer.hpp"
+
+#include <vector>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace wg2nd;
+
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// The scalar line splitting which preceded the block scanner
+static uint64_t tokenize_scalar(std::string_view input) {
+	uint64_t tokens = 0;
+	size_t pos = 0;
+
+	while(pos < input.size()) {
+		size_t eol = input.find('\n', pos);
+		if(eol == std::string_view::npos) {
+			eol = input.size();
+		}
+
+		std::string_view line = input.substr(pos, eol - pos);
+		pos = eol + 1;
+
+		size_t comment = line.find('#');
+		if(comment != std::string_view::npos) {
+			line = line.substr(0, comment);
+		}
+
+		line = _trim(line);
+		if(line.empty()) {
+			continue;
+		}
+
+		size_t equals = line.find('=');
+		if(equals != std::string_view::npos) {
+			tokens += _trim(line.substr(0, equals)).size() + _trim(line.substr(equals + 1)).size() != 0;
+		} else {
+			tokens++;
+		}
+	}
+
+	return tokens;
+}
+
+int main(int argc, char ** argv) {
+	uint64_t megabytes = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100;
+
+	std::string input = bench::hub_config(megabytes * 1000000 / 190);
+
+	printf("scan: %.1f MB synthetic configuration\n", input.size() / 1e6);
+
+	std::vector<std::pair<char const *, ScanBlocksFn>> scanners = {
+		{ "scalar", scan_blocks_scalar },
+	};
+
+#if defined(__SSE2__)
+	scanners.push_back({ "sse2", scan_blocks_sse2 });
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_has_avx2()) {
+		scanners.push_back({ "avx2", scan_blocks_avx2 });
+	}
+#endif
+
+	{
+		uint64_t start = cycles();
+		bench::Timer timer;
+
+		uint64_t tokens = tokenize_scalar(input);
+
+		uint64_t elapsed = cycles() - start;
+		printf("%-24s %8.3f bytes/cycle %8.1f MB/s (%llu tokens)\n", "tokenizer (memchr)",
+			(double) input.size() / elapsed, input.size() / timer.seconds() / 1e6, (unsigned long long) tokens);
+	}
+
+	for(auto [name, scan] : scanners) {
+		// Block classification alone
+		uint64_t start = cycles();
+		uint64_t newlines = 0;
+
+		for(size_t i = 0; i + 32 * SCAN_BLOCK_SIZE <= input.size(); i += 32 * SCAN_BLOCK_SIZE) {
+			ScanMasks masks[32];
+			scan(input.data() + i, 32, masks);
+			for(ScanMasks const & m : masks) {
+				newlines += std::popcount(m.newline);
+			}
+		}
+
+		uint64_t elapsed = cycles() - start;
+
+		printf("%-24s %8.3f bytes/cycle (%llu lines)\n", (std::string("scan_blocks_") + name).c_str(),
+			(double) input.size() / elapsed, (unsigned long long) newlines);
+
+		// Complete tokenization
+		start = cycles();
+		bench::Timer timer;
+
+		ConfigTokenizer tokenizer { input, scan };
+		ConfigTokenizer::Token token;
+		uint64_t tokens = 0;
+
+		while(tokenizer.next(token)) {
+			tokens++;
+		}
+
+		elapsed = cycles() - start;
+
+		printf("%-24s %8.3f bytes/cycle %8.1f MB/s (%llu tokens)\n", (std::string("tokenizer (") + name + ")").c_str(),
+			(double) input.size() / elapsed, input.size() / timer.seconds() / 1e6, (unsigned long long) tokens);
+	}
+
+	return 0;
+}
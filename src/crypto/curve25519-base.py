@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0 OR MIT
+#
+# Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+#
+# Generate curve25519-base.h, the multiples of the edwards25519 basepoint
+# used by the fixed-base scalar multiplication in curve25519-hacl64-base.h:
+#
+#   curve25519_base_multiples[i][j] = (j + 1) * 256^i * B
+#
+# Each is written in affine precomputed form (y + x, y - x, 2 * d * x * y),
+# with each coordinate in the radix 2^51 representation of curve25519-hacl64.h.
+#
+# Usage: python3 curve25519-base.py > curve25519-base.h
+
+P = 2**255 - 19
+D = -121665 * pow(121666, -1, P) % P
+
+# The basepoint, which maps to u = 9 on curve25519
+B_Y = 4 * pow(5, -1, P) % P
+B_X = 15112221349535400772501151409588531511454012693041857206046113283949847762202
+
+
+def add(p, q):
+	(x1, y1), (x2, y2) = p, q
+	t = D * x1 * x2 * y1 * y2 % P
+	x3 = (x1 * y2 + y1 * x2) * pow(1 + t, -1, P) % P
+	y3 = (y1 * y2 + x1 * x2) * pow(1 - t, -1, P) % P
+	return (x3, y3)
+
+
+def limbs(n):
+	return [(n >> (51 * i)) & (2**51 - 1) for i in range(5)]
+
+
+def fe(n):
+	return '{ ' + ', '.join('0x%013xULL' % limb for limb in limbs(n)) + ' }'
+
+
+def main():
+	assert (B_Y * B_Y - B_X * B_X - 1 - D * B_X * B_X * B_Y * B_Y) % P == 0
+	assert (1 + B_Y) * pow(1 - B_Y, -1, P) % P == 9
+
+	print('// SPDX-License-Identifier: GPL-2.0 OR MIT')
+	print('/*')
+	print(' * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>')
+	print(' *')
+	print(' * Generated by curve25519-base.py, do not edit.')
+	print(' *')
+	print(' * curve25519_base_multiples[i][j] = (j + 1) * 256^i * B for the edwards25519')
+	print(' * basepoint B, as (y + x, y - x, 2 * d * x * y) in radix 2^51.')
+	print(' */')
+	print()
+	print('static const u64 curve25519_base_multiples[32][8][3][5] = {')
+
+	base = (B_X, B_Y)
+
+	for i in range(32):
+		print('\t{')
+
+		point = base
+		for j in range(8):
+			x, y = point
+			print('\t\t{')
+			print('\t\t\t%s,' % fe((y + x) % P))
+			print('\t\t\t%s,' % fe((y - x) % P))
+			print('\t\t\t%s,' % fe(2 * D * x * y % P))
+			print('\t\t},')
+			point = add(point, base)
+
+		print('\t},')
+
+		# 256 * base, from 8 doublings
+		for _ in range(8):
+			base = add(base, base)
+
+	print('};')
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ *
+ * Fixed-base scalar multiplication for curve25519_generate_public, built on
+ * the field arithmetic of curve25519-hacl64.h.
+ *
+ * The product is computed on the birationally equivalent twisted Edwards
+ * curve, edwards25519, from a table of multiples of its basepoint
+ * (curve25519-base.h), and mapped back to the Montgomery u-coordinate
+ * with u = (1 + y) / (1 - y). The scalar is recoded into 64 signed radix-16
+ * digits, each of which selects a multiple from the table by scanning
+ * every entry, so the memory accessed does not depend on the secret.
+ * This takes 64 additions and 4 doublings rather than the 255 ladder
+ * steps of curve25519_generic.
+ */
+
+#include "curve25519-base.h"
+
+/*
+ * fmul and fsquare overflow unless the product of the largest limbs of their
+ * inputs is below about 2^108. The sum of two products (each below 2^52) is
+ * multiplied as it is, while a difference is carried back to 51-bit limbs.
+ */
+
+static __always_inline void fe_add(u64 *out, const u64 *a, const u64 *b)
+{
+	for (int i = 0; i < 5; ++i)
+		out[i] = a[i] + b[i];
+}
+
+/* a - b, for limbs of b below 2^54 */
+static __always_inline void fe_sub(u64 *out, const u64 *a, const u64 *b)
+{
+	/* 8p, so that no limb underflows */
+	out[0] = a[0] + 0x3fffffffffff68LLU - b[0];
+	for (int i = 1; i < 5; ++i)
+		out[i] = a[i] + 0x3ffffffffffff8LLU - b[i];
+	format_fcontract_first_carry_full(out);
+}
+
+static __always_inline void fe_mul(u64 *out, const u64 *a, const u64 *b)
+{
+	fmul(out, (u64 *)a, (u64 *)b);
+}
+
+static __always_inline void fe_sq(u64 *out, const u64 *a)
+{
+	if (out != a)
+		memcpy(out, a, 5 * sizeof(*a));
+	fsquare_fsquare_times_inplace(out, 1);
+}
+
+/* out = a when move is all ones, unchanged when it is zero */
+static __always_inline void fe_cmov(u64 *out, const u64 *a, u64 move)
+{
+	for (int i = 0; i < 5; ++i)
+		out[i] ^= move & (out[i] ^ a[i]);
+}
+
+/* Extended coordinates: x = X / Z, y = Y / Z, and x * y = T / Z */
+struct ge_p3 {
+	u64 X[5], Y[5], Z[5], T[5];
+};
+
+/* Completed coordinates: x = X / Z and y = Y / T */
+struct ge_p1p1 {
+	u64 X[5], Y[5], Z[5], T[5];
+};
+
+/* An affine multiple of the basepoint, as in curve25519_base_multiples */
+struct ge_precomp {
+	u64 yplusx[5], yminusx[5], xy2d[5];
+};
+
+static __always_inline void ge_p1p1_to_p3(struct ge_p3 *r, const struct ge_p1p1 *p)
+{
+	fe_mul(r->X, p->X, p->T);
+	fe_mul(r->Y, p->Y, p->Z);
+	fe_mul(r->Z, p->Z, p->T);
+	fe_mul(r->T, p->X, p->Y);
+}
+
+/* r = p + q, for affine q */
+static __always_inline void ge_madd(struct ge_p1p1 *r, const struct ge_p3 *p, const struct ge_precomp *q)
+{
+	u64 a[5], b[5], c[5], d[5];
+
+	fe_add(a, p->Y, p->X);
+	fe_sub(b, p->Y, p->X);
+	fe_mul(a, a, q->yplusx);
+	fe_mul(b, b, q->yminusx);
+	fe_mul(c, q->xy2d, p->T);
+	fe_add(d, p->Z, p->Z);
+
+	fe_sub(r->X, a, b);
+	fe_add(r->Y, a, b);
+	fe_add(r->Z, d, c);
+	fe_sub(r->T, d, c);
+}
+
+/* r = 2p, of which T is unused */
+static __always_inline void ge_dbl(struct ge_p1p1 *r, const struct ge_p3 *p)
+{
+	u64 xx[5], yy[5], zz2[5], s[5];
+
+	fe_sq(xx, p->X);
+	fe_sq(yy, p->Y);
+	fe_sq(zz2, p->Z);
+	fe_add(zz2, zz2, zz2);
+	fe_add(s, p->X, p->Y);
+	fe_sq(s, s);
+
+	/* 2Z^2 - (Y^2 - X^2), ordered to keep the subtrahend small */
+	fe_add(r->Y, yy, xx);
+	fe_sub(r->Z, yy, xx);
+	fe_sub(r->X, s, r->Y);
+	fe_add(zz2, zz2, xx);
+	fe_sub(r->T, zz2, yy);
+}
+
+/* The three products of ge_p1p1_to_p3 that a doubling needs */
+static __always_inline void ge_p1p1_to_p2(struct ge_p3 *r, const struct ge_p1p1 *p)
+{
+	fe_mul(r->X, p->X, p->T);
+	fe_mul(r->Y, p->Y, p->Z);
+	fe_mul(r->Z, p->Z, p->T);
+}
+
+static __always_inline u64 u8_eq_mask(u8 a, u8 b)
+{
+	return u64_eq_mask(a, b);
+}
+
+/* t = b * 256^pos * B, for -8 <= b <= 8, in constant time */
+static __always_inline void ge_select(struct ge_precomp *t, int pos, signed char b)
+{
+	u64 negative = (u64)(u8)b >> 7;
+	u8 babs = (u8)(b - (((-negative) & (u64)b) << 1));
+	u64 minus_xy2d[5];
+	u64 move;
+	u64 zero[5] = { 0 };
+
+	/* The identity */
+	memset(t, 0, sizeof(*t));
+	t->yplusx[0] = 1;
+	t->yminusx[0] = 1;
+
+	for (int j = 0; j < 8; ++j) {
+		const u64 (*entry)[5] = curve25519_base_multiples[pos][j];
+		u64 equal = u8_eq_mask(babs, (u8)(j + 1));
+
+		fe_cmov(t->yplusx, entry[0], equal);
+		fe_cmov(t->yminusx, entry[1], equal);
+		fe_cmov(t->xy2d, entry[2], equal);
+	}
+
+	/* -(x, y) = (-x, y), which swaps y + x and y - x */
+	move = 0 - negative;
+	for (int i = 0; i < 5; ++i) {
+		u64 x = move & (t->yplusx[i] ^ t->yminusx[i]);
+		t->yplusx[i] ^= x;
+		t->yminusx[i] ^= x;
+	}
+	fe_sub(minus_xy2d, zero, t->xy2d);
+	fe_cmov(t->xy2d, minus_xy2d, move);
+}
+
+/* The u-coordinate of the product, as the fraction num / den */
+static __always_inline void curve25519_base_fraction(u64 *num, u64 *den,
+						     const u8 secret[CURVE25519_KEY_SIZE])
+{
+	u8 e[32] __aligned(32);
+	signed char digits[64];
+	signed char carry = 0;
+	struct ge_p3 h;
+	struct ge_p1p1 r;
+	struct ge_precomp t;
+
+	memcpy(e, secret, 32);
+	curve25519_clamp_secret(e);
+
+	/* e = sum(digits[i] * 16^i), with -8 <= digits[i] < 8 */
+	for (int i = 0; i < 32; ++i) {
+		digits[2 * i + 0] = e[i] & 15;
+		digits[2 * i + 1] = (e[i] >> 4) & 15;
+	}
+	for (int i = 0; i < 63; ++i) {
+		digits[i] += carry;
+		carry = (digits[i] + 8) >> 4;
+		digits[i] -= carry * 16;
+	}
+	digits[63] += carry;
+
+	memset(&h, 0, sizeof(h));
+	h.Y[0] = 1;
+	h.Z[0] = 1;
+
+	/* The odd digits, which are multiplied by 16 below */
+	for (int i = 1; i < 64; i += 2) {
+		ge_select(&t, i / 2, digits[i]);
+		ge_madd(&r, &h, &t);
+		ge_p1p1_to_p3(&h, &r);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		ge_dbl(&r, &h);
+		ge_p1p1_to_p2(&h, &r);
+	}
+	ge_dbl(&r, &h);
+	ge_p1p1_to_p3(&h, &r);
+
+	for (int i = 0; i < 64; i += 2) {
+		ge_select(&t, i / 2, digits[i]);
+		ge_madd(&r, &h, &t);
+		ge_p1p1_to_p3(&h, &r);
+	}
+
+	/* u = (1 + y) / (1 - y) = (Z + Y) / (Z - Y) */
+	fe_add(num, h.Z, h.Y);
+	fe_sub(den, h.Z, h.Y);
+
+	memzero_explicit(e, sizeof(e));
+	memzero_explicit(digits, sizeof(digits));
+	memzero_explicit(&h, sizeof(h));
+	memzero_explicit(&r, sizeof(r));
+	memzero_explicit(&t, sizeof(t));
+}
+
+static void curve25519_base_generic(u8 mypublic[CURVE25519_KEY_SIZE],
+				    const u8 secret[CURVE25519_KEY_SIZE])
+{
+	u64 num[5], den[5], inv[5];
+
+	curve25519_base_fraction(num, den, secret);
+	crecip(inv, den);
+	fmul(num, num, inv);
+	format_fcontract(mypublic, num);
+
+	memzero_explicit(num, sizeof(num));
+	memzero_explicit(den, sizeof(den));
+	memzero_explicit(inv, sizeof(inv));
+}
+
+/*
+ * The denominators of a block of keys are inverted together with
+ * Montgomery's trick: the inverse of their product is multiplied back
+ * down the running products, so that m keys take one inversion and
+ * 3(m - 1) multiplications rather than m inversions. The denominators are
+ * never zero, as no clamped scalar is a multiple of the basepoint's order.
+ */
+#define CURVE25519_BASE_BATCH 64
+
+static void curve25519_base_batch_generic(u8 (*mypublic)[CURVE25519_KEY_SIZE],
+					  const u8 (*secret)[CURVE25519_KEY_SIZE],
+					  size_t n)
+{
+	u64 num[CURVE25519_BASE_BATCH][5];
+	u64 den[CURVE25519_BASE_BATCH][5];
+	/* products[i] = den[0] * ... * den[i] */
+	u64 products[CURVE25519_BASE_BATCH][5];
+	u64 inv[5], den_inv[5];
+
+	for (size_t begin = 0; begin < n; begin += CURVE25519_BASE_BATCH) {
+		size_t m = n - begin < CURVE25519_BASE_BATCH ? n - begin : CURVE25519_BASE_BATCH;
+
+		/* Every secret is read before any public key is written */
+		for (size_t i = 0; i < m; ++i) {
+			curve25519_base_fraction(num[i], den[i], secret[begin + i]);
+
+			if (i == 0)
+				memcpy(products[0], den[0], sizeof(products[0]));
+			else
+				fmul(products[i], products[i - 1], den[i]);
+		}
+
+		/* inv = 1 / (den[0] * ... * den[i]) at each step */
+		crecip(inv, products[m - 1]);
+
+		for (size_t i = m - 1; i > 0; --i) {
+			fmul(den_inv, inv, products[i - 1]);
+			fmul(inv, inv, den[i]);
+			fmul(num[i], num[i], den_inv);
+			format_fcontract(mypublic[begin + i], num[i]);
+		}
+
+		fmul(num[0], num[0], inv);
+		format_fcontract(mypublic[begin], num[0]);
+	}
+
+	memzero_explicit(num, sizeof(num));
+	memzero_explicit(den, sizeof(den));
+	memzero_explicit(products, sizeof(products));
+	memzero_explicit(inv, sizeof(inv));
+	memzero_explicit(den_inv, sizeof(den_inv));
+}
@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ *
+ * Vectorized public key derivation for curve25519_generate_public_batch,
+ * which runs the Montgomery ladder of eight secrets at once, one in each
+ * 64-bit lane of an AVX-512 register, with the radix 2^51 representation of
+ * curve25519-hacl64.h, as vpmadd52{l,h}uq multiply 52-bit limbs.
+ *
+ * Each lane takes the same sequence of instructions; the bits of the
+ * scalars only select, through masks, which of the ladder's points are
+ * swapped. The functions are compiled for AVX-512 IFMA with the target
+ * attribute, and only called once the CPU is known to support it.
+ */
+
+#include <immintrin.h>
+
+#define __target_avx512ifma __attribute__((target("avx512f,avx512ifma")))
+
+/* The lanes of an AVX-512 register */
+#define CURVE25519_MAX_LANES 8
+
+/* The canonical encoding of sum(l[i] * 2^(51 * i)), for limbs below 2^52 */
+static void curve25519_lanes_pack(u8 out[CURVE25519_KEY_SIZE], u64 l[5])
+{
+	const u64 mask = (1ULL << 51) - 1;
+	u64 q;
+
+	for (int i = 0; i < 4; ++i) {
+		l[i + 1] += l[i] >> 51;
+		l[i] &= mask;
+	}
+	l[0] += 19 * (l[4] >> 51);
+	l[4] &= mask;
+
+	/* q = 1 if the value is at least p, which is then subtracted */
+	q = (l[0] + 19) >> 51;
+	for (int i = 1; i < 5; ++i)
+		q = (l[i] + q) >> 51;
+
+	l[0] += 19 * q;
+	for (int i = 0; i < 4; ++i) {
+		l[i + 1] += l[i] >> 51;
+		l[i] &= mask;
+	}
+	l[4] &= mask;
+
+	put_unaligned_le64(l[0] | l[1] << 51, out);
+	put_unaligned_le64(l[1] >> 13 | l[2] << 38, out + 8);
+	put_unaligned_le64(l[2] >> 26 | l[3] << 25, out + 16);
+	put_unaligned_le64(l[3] >> 39 | l[4] << 12, out + 24);
+}
+
+/* e[word][lane], the clamped scalar of each lane as little-endian words */
+static __always_inline void curve25519_lanes_scalars(u64 (*e)[CURVE25519_MAX_LANES],
+						    const u8 (*secret)[CURVE25519_KEY_SIZE],
+						    int lanes)
+{
+	u8 clamped[CURVE25519_KEY_SIZE];
+
+	for (int lane = 0; lane < lanes; ++lane) {
+		memcpy(clamped, secret[lane], CURVE25519_KEY_SIZE);
+		curve25519_clamp_secret(clamped);
+
+		for (int word = 0; word < 4; ++word)
+			e[word][lane] = get_unaligned_le64(clamped + 8 * word);
+	}
+
+	memzero_explicit(clamped, sizeof(clamped));
+}
+
+/*
+ * AVX-512 IFMA: limb i of lane j is lane j of h[i], below 2^51 (and 2^52,
+ * the width which vpmadd52luq multiplies) once carried. Sums and
+ * differences are carried before they are multiplied.
+ */
+
+static __always_inline __target_avx512ifma void fe8_carry(__m512i h[5])
+{
+	static const int order[6] = { 0, 1, 2, 3, 4, 0 };
+	const __m512i mask = _mm512_set1_epi64((1LL << 51) - 1);
+
+#pragma GCC unroll 6
+	for (int n = 0; n < 6; ++n) {
+		int i = order[n];
+		__m512i c = _mm512_srli_epi64(h[i], 51);
+
+		h[i] = _mm512_and_si512(h[i], mask);
+
+		if (i == 4) {
+			/* 2^255 = 19 */
+			c = _mm512_add_epi64(_mm512_add_epi64(c, _mm512_slli_epi64(c, 1)), _mm512_slli_epi64(c, 4));
+			h[0] = _mm512_add_epi64(h[0], c);
+		} else {
+			h[i + 1] = _mm512_add_epi64(h[i + 1], c);
+		}
+	}
+}
+
+static __always_inline __target_avx512ifma void fe8_add(__m512i h[5], const __m512i f[5], const __m512i g[5])
+{
+	for (int i = 0; i < 5; ++i)
+		h[i] = _mm512_add_epi64(f[i], g[i]);
+	fe8_carry(h);
+}
+
+static __always_inline __target_avx512ifma void fe8_sub(__m512i h[5], const __m512i f[5], const __m512i g[5])
+{
+	/* 2p, so that no limb underflows */
+	for (int i = 0; i < 5; ++i) {
+		__m512i two_p = _mm512_set1_epi64(i == 0 ? 0xfffffffffffdaLL : 0xffffffffffffeLL);
+
+		h[i] = _mm512_sub_epi64(_mm512_add_epi64(f[i], two_p), g[i]);
+	}
+	fe8_carry(h);
+}
+
+/* 19 * x */
+static __always_inline __target_avx512ifma __m512i fe8_mul19(__m512i x)
+{
+	return _mm512_add_epi64(_mm512_add_epi64(x, _mm512_slli_epi64(x, 1)), _mm512_slli_epi64(x, 4));
+}
+
+/*
+ * The products of f[i] and g[j] fall in column i + j (of weight
+ * 2^(51 * (i + j))) for their low 52 bits, and column i + j + 1 for the bits
+ * above, which have twice the weight of that column. Columns k and k + 5 are
+ * summed together, as 2^255 = 19.
+ */
+static __always_inline __target_avx512ifma void fe8_mul(__m512i h[5], const __m512i f[5], const __m512i g[5])
+{
+	__m512i t[5];
+
+#pragma GCC unroll 5
+	for (int k = 0; k < 5; ++k) {
+		__m512i lo = _mm512_setzero_si512(), hi = _mm512_setzero_si512();
+		__m512i lo5 = _mm512_setzero_si512(), hi5 = _mm512_setzero_si512();
+
+#pragma GCC unroll 5
+		for (int i = 0; i < 5; ++i) {
+			int j = k >= i ? k - i : k + 5 - i;
+
+			if (k >= i)
+				lo = _mm512_madd52lo_epu64(lo, f[i], g[j]);
+			else
+				lo5 = _mm512_madd52lo_epu64(lo5, f[i], g[j]);
+		}
+
+#pragma GCC unroll 5
+		for (int i = 0; i < 5; ++i) {
+			/* The products in column k - 1 */
+			int j = k - 1 >= i ? k - 1 - i : k + 4 - i;
+
+			if (k - 1 >= i)
+				hi = _mm512_madd52hi_epu64(hi, f[i], g[j]);
+			else
+				hi5 = _mm512_madd52hi_epu64(hi5, f[i], g[j]);
+		}
+
+		lo = _mm512_add_epi64(lo, _mm512_add_epi64(hi, hi));
+		lo5 = _mm512_add_epi64(lo5, _mm512_add_epi64(hi5, hi5));
+		t[k] = _mm512_add_epi64(lo, fe8_mul19(lo5));
+	}
+
+	fe8_carry(t);
+	for (int i = 0; i < 5; ++i)
+		h[i] = t[i];
+}
+
+static __always_inline __target_avx512ifma void fe8_sq(__m512i h[5], const __m512i f[5])
+{
+	__m512i t[5];
+
+	/* As fe8_mul, with the products of distinct limbs taken once and doubled */
+#pragma GCC unroll 5
+	for (int k = 0; k < 5; ++k) {
+		__m512i lo = _mm512_setzero_si512(), hi = _mm512_setzero_si512();
+		__m512i lo5 = _mm512_setzero_si512(), hi5 = _mm512_setzero_si512();
+		__m512i lo2 = _mm512_setzero_si512(), hi2 = _mm512_setzero_si512();
+		__m512i lo52 = _mm512_setzero_si512(), hi52 = _mm512_setzero_si512();
+
+#pragma GCC unroll 5
+		for (int i = 0; i < 5; ++i) {
+			int j = k >= i ? k - i : k + 5 - i;
+
+			if (j < i)
+				continue;
+			if (k >= i)
+				lo = _mm512_madd52lo_epu64(lo, f[i], f[j]);
+			else
+				lo5 = _mm512_madd52lo_epu64(lo5, f[i], f[j]);
+			if (i != j) {
+				if (k >= i)
+					lo2 = _mm512_madd52lo_epu64(lo2, f[i], f[j]);
+				else
+					lo52 = _mm512_madd52lo_epu64(lo52, f[i], f[j]);
+			}
+		}
+
+#pragma GCC unroll 5
+		for (int i = 0; i < 5; ++i) {
+			int j = k - 1 >= i ? k - 1 - i : k + 4 - i;
+
+			if (j < i)
+				continue;
+			if (k - 1 >= i)
+				hi = _mm512_madd52hi_epu64(hi, f[i], f[j]);
+			else
+				hi5 = _mm512_madd52hi_epu64(hi5, f[i], f[j]);
+			if (i != j) {
+				if (k - 1 >= i)
+					hi2 = _mm512_madd52hi_epu64(hi2, f[i], f[j]);
+				else
+					hi52 = _mm512_madd52hi_epu64(hi52, f[i], f[j]);
+			}
+		}
+
+		lo = _mm512_add_epi64(lo, _mm512_add_epi64(hi, hi));
+		lo5 = _mm512_add_epi64(lo5, _mm512_add_epi64(hi5, hi5));
+		lo2 = _mm512_add_epi64(lo2, _mm512_add_epi64(hi2, hi2));
+		lo52 = _mm512_add_epi64(lo52, _mm512_add_epi64(hi52, hi52));
+		lo = _mm512_add_epi64(lo, lo2);
+		lo5 = _mm512_add_epi64(lo5, lo52);
+		t[k] = _mm512_add_epi64(lo, fe8_mul19(lo5));
+	}
+
+	fe8_carry(t);
+	for (int i = 0; i < 5; ++i)
+		h[i] = t[i];
+}
+
+static __always_inline __target_avx512ifma void fe8_sqn(__m512i h[5], const __m512i f[5], int n)
+{
+	fe8_sq(h, f);
+	for (int i = 1; i < n; ++i)
+		fe8_sq(h, h);
+}
+
+/* f * c, for c below 2^52 */
+static __always_inline __target_avx512ifma void fe8_mul_small(__m512i h[5], const __m512i f[5], u64 c)
+{
+	__m512i cv = _mm512_set1_epi64(c);
+	__m512i t[5];
+
+	for (int k = 0; k < 5; ++k) {
+		__m512i hi = _mm512_madd52hi_epu64(_mm512_setzero_si512(), f[k == 0 ? 4 : k - 1], cv);
+
+		hi = _mm512_add_epi64(hi, hi);
+		t[k] = _mm512_madd52lo_epu64(k == 0 ? fe8_mul19(hi) : hi, f[k], cv);
+	}
+
+	fe8_carry(t);
+	for (int i = 0; i < 5; ++i)
+		h[i] = t[i];
+}
+
+static __always_inline __target_avx512ifma void fe8_cswap(__m512i f[5], __m512i g[5], __m512i mask)
+{
+	for (int i = 0; i < 5; ++i) {
+		__m512i x = _mm512_and_si512(mask, _mm512_xor_si512(f[i], g[i]));
+
+		f[i] = _mm512_xor_si512(f[i], x);
+		g[i] = _mm512_xor_si512(g[i], x);
+	}
+}
+
+static __target_avx512ifma void fe8_invert(__m512i out[5], const __m512i z[5])
+{
+	__m512i t0[5], t1[5], t2[5], t3[5];
+
+	fe8_sq(t0, z);
+	fe8_sqn(t1, t0, 2);
+	fe8_mul(t1, z, t1);
+	fe8_mul(t0, t0, t1);
+	fe8_sq(t2, t0);
+	fe8_mul(t1, t1, t2);
+	fe8_sqn(t2, t1, 5);
+	fe8_mul(t1, t2, t1);
+	fe8_sqn(t2, t1, 10);
+	fe8_mul(t2, t2, t1);
+	fe8_sqn(t3, t2, 20);
+	fe8_mul(t2, t3, t2);
+	fe8_sqn(t2, t2, 10);
+	fe8_mul(t1, t2, t1);
+	fe8_sqn(t2, t1, 50);
+	fe8_mul(t2, t2, t1);
+	fe8_sqn(t3, t2, 100);
+	fe8_mul(t2, t3, t2);
+	fe8_sqn(t2, t2, 50);
+	fe8_mul(t1, t2, t1);
+	fe8_sqn(t1, t1, 5);
+	fe8_mul(out, t1, t0);
+}
+
+/* The public keys of 8 secrets, all of which are read before any is written */
+static __target_avx512ifma void curve25519_base_avx512ifma(u8 (*mypublic)[CURVE25519_KEY_SIZE],
+							   const u8 (*secret)[CURVE25519_KEY_SIZE])
+{
+	u64 e[4][CURVE25519_MAX_LANES] __aligned(64);
+	u64 limbs[5][8] __aligned(64);
+	__m512i x2[5], z2[5], x3[5], z3[5];
+	__m512i a[5], aa[5], b[5], bb[5], c[5], d[5], da[5], cb[5], t[5];
+	__m512i swap = _mm512_setzero_si512();
+	__m512i mask;
+
+	curve25519_lanes_scalars(e, secret, 8);
+
+	for (int i = 0; i < 5; ++i) {
+		x2[i] = _mm512_set1_epi64(i == 0);
+		z2[i] = _mm512_setzero_si512();
+		x3[i] = _mm512_set1_epi64(i == 0 ? 9 : 0);
+		z3[i] = _mm512_set1_epi64(i == 0);
+	}
+
+	for (int pos = 254; pos >= 0; --pos) {
+		__m512i bit = _mm512_and_si512(
+			_mm512_srl_epi64(_mm512_load_si512(e[pos / 64]), _mm_cvtsi32_si128(pos % 64)),
+			_mm512_set1_epi64(1));
+
+		mask = _mm512_sub_epi64(_mm512_setzero_si512(), _mm512_xor_si512(swap, bit));
+		fe8_cswap(x2, x3, mask);
+		fe8_cswap(z2, z3, mask);
+		swap = bit;
+
+		fe8_add(a, x2, z2);
+		fe8_sub(b, x2, z2);
+		fe8_add(c, x3, z3);
+		fe8_sub(d, x3, z3);
+		fe8_sq(aa, a);
+		fe8_sq(bb, b);
+		fe8_mul(da, d, a);
+		fe8_mul(cb, c, b);
+
+		fe8_add(t, da, cb);
+		fe8_sq(x3, t);
+		fe8_sub(t, da, cb);
+		fe8_sq(t, t);
+		fe8_mul_small(z3, t, 9);
+
+		fe8_mul(x2, aa, bb);
+		fe8_sub(t, aa, bb);
+		fe8_mul_small(a, t, 121665);
+		fe8_add(a, a, aa);
+		fe8_mul(z2, t, a);
+	}
+
+	mask = _mm512_sub_epi64(_mm512_setzero_si512(), swap);
+	fe8_cswap(x2, x3, mask);
+	fe8_cswap(z2, z3, mask);
+
+	fe8_invert(z2, z2);
+	fe8_mul(x2, x2, z2);
+
+	for (int i = 0; i < 5; ++i)
+		_mm512_store_si512(limbs[i], x2[i]);
+
+	for (int lane = 0; lane < 8; ++lane) {
+		u64 l[5];
+
+		for (int i = 0; i < 5; ++i)
+			l[i] = limbs[i][lane];
+
+		curve25519_lanes_pack(mypublic[lane], l);
+	}
+
+	memzero_explicit(e, sizeof(e));
+	memzero_explicit(limbs, sizeof(limbs));
+}
+
+/* Run ladder, which derives the public keys of lanes secrets, over n secrets */
+static void curve25519_base_lanes(void (*ladder)(u8 (*)[CURVE25519_KEY_SIZE], const u8 (*)[CURVE25519_KEY_SIZE]),
+				  size_t lanes, u8 (*mypublic)[CURVE25519_KEY_SIZE],
+				  const u8 (*secret)[CURVE25519_KEY_SIZE], size_t n)
+{
+	u8 in[CURVE25519_MAX_LANES][CURVE25519_KEY_SIZE];
+	u8 out[CURVE25519_MAX_LANES][CURVE25519_KEY_SIZE];
+	size_t begin;
+
+	for (begin = 0; begin + lanes <= n; begin += lanes)
+		ladder(mypublic + begin, secret + begin);
+
+	/* The lanes past the last secret derive the key of zero, which is discarded */
+	if (begin < n) {
+		memset(in, 0, sizeof(in));
+		memcpy(in, secret + begin, (n - begin) * CURVE25519_KEY_SIZE);
+		ladder(out, (const u8 (*)[CURVE25519_KEY_SIZE])in);
+		memcpy(mypublic + begin, out, (n - begin) * CURVE25519_KEY_SIZE);
+
+		memzero_explicit(in, sizeof(in));
+	}
+}
@@ -83,15 +83,76 @@ static noinline void memzero_explicit(void *s, size_t count)
 #include "curve25519-fiat32.h"
 #elif __SIZEOF_INT128__
 #include "curve25519-hacl64.h"
+#include "curve25519-hacl64-base.h"
+#define HAVE_CURVE25519_BASE
 #else
 #include "curve25519-fiat32.h"
 #endif
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(__EMSCRIPTEN__)
+#include "curve25519-simd.h"
+#define HAVE_CURVE25519_SIMD
+#endif
+
 void curve25519_generate_public(uint8_t pub[static CURVE25519_KEY_SIZE], const uint8_t secret[static CURVE25519_KEY_SIZE])
 {
+#ifdef HAVE_CURVE25519_BASE
+	curve25519_base_generic(pub, secret);
+#else
 	static const uint8_t basepoint[CURVE25519_KEY_SIZE] __aligned(sizeof(uintptr_t)) = { 9 };
 
 	curve25519(pub, secret, basepoint);
+#endif
+}
+
+static int curve25519_backend_supported(enum curve25519_backend backend)
+{
+	switch (backend) {
+	case CURVE25519_BACKEND_SCALAR:
+		return 1;
+#ifdef HAVE_CURVE25519_SIMD
+	case CURVE25519_BACKEND_AVX512IFMA:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+#endif
+	default:
+		return 0;
+	}
+}
+
+int curve25519_generate_public_batch_backend(enum curve25519_backend backend, uint8_t (*pub)[CURVE25519_KEY_SIZE], const uint8_t (*secret)[CURVE25519_KEY_SIZE], size_t n)
+{
+	if (backend == CURVE25519_BACKEND_AUTO) {
+		if (curve25519_backend_supported(CURVE25519_BACKEND_AVX512IFMA))
+			backend = CURVE25519_BACKEND_AVX512IFMA;
+		else
+			backend = CURVE25519_BACKEND_SCALAR;
+	}
+
+	if (!curve25519_backend_supported(backend))
+		return -1;
+
+	switch (backend) {
+#ifdef HAVE_CURVE25519_SIMD
+	case CURVE25519_BACKEND_AVX512IFMA:
+		curve25519_base_lanes(curve25519_base_avx512ifma, 8, pub, secret, n);
+		break;
+#endif
+	default:
+#ifdef HAVE_CURVE25519_BASE
+		curve25519_base_batch_generic(pub, secret, n);
+#else
+		for (size_t i = 0; i < n; ++i)
+			curve25519_generate_public(pub[i], secret[i]);
+#endif
+		break;
+	}
+
+	return 0;
+}
+
+void curve25519_generate_public_batch(uint8_t (*pub)[CURVE25519_KEY_SIZE], const uint8_t (*secret)[CURVE25519_KEY_SIZE], size_t n)
+{
+	curve25519_generate_public_batch_backend(CURVE25519_BACKEND_AUTO, pub, secret, n);
 }
 
 void curve25519(uint8_t mypublic[static CURVE25519_KEY_SIZE], const uint8_t secret[static CURVE25519_KEY_SIZE], const uint8_t basepoint[static CURVE25519_KEY_SIZE])
@@ -15,6 +15,20 @@ enum curve25519_lengths {
 
 void curve25519(uint8_t mypublic[static CURVE25519_KEY_SIZE], const uint8_t secret[static CURVE25519_KEY_SIZE], const uint8_t basepoint[static CURVE25519_KEY_SIZE]);
 void curve25519_generate_public(uint8_t pub[static CURVE25519_KEY_SIZE], const uint8_t secret[static CURVE25519_KEY_SIZE]);
+/* The public keys of n secrets, which may share their storage, through the fastest backend the CPU supports */
+void curve25519_generate_public_batch(uint8_t (*pub)[CURVE25519_KEY_SIZE], const uint8_t (*secret)[CURVE25519_KEY_SIZE], size_t n);
+
+enum curve25519_backend {
+	/* AVX512IFMA where the CPU supports it, and otherwise SCALAR */
+	CURVE25519_BACKEND_AUTO,
+	/* The fixed-base table, with one field inversion per block of keys */
+	CURVE25519_BACKEND_SCALAR,
+	/* Montgomery ladders in the lanes of vector registers (curve25519-simd.h) */
+	CURVE25519_BACKEND_AVX512IFMA,
+};
+
+/* As curve25519_generate_public_batch, returning -1 if backend is not built or not supported by the CPU */
+int curve25519_generate_public_batch_backend(enum curve25519_backend backend, uint8_t (*pub)[CURVE25519_KEY_SIZE], const uint8_t (*secret)[CURVE25519_KEY_SIZE], size_t n);
 static inline void curve25519_clamp_secret(uint8_t secret[static CURVE25519_KEY_SIZE])
 {
 	secret[0] &= 248;
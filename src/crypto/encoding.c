@@ -8,6 +8,11 @@
 #include <string.h>
 #include "encoding.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_DECODE_BASE64_SSSE3
+#endif
+
 static inline void encode_base64(char dest[static 4], const uint8_t src[static 3])
 {
 	const uint8_t input[] = { (src[0] >> 2) & 63, ((src[0] << 4) | (src[1] >> 4)) & 63, ((src[1] << 2) | (src[2] >> 6)) & 63, src[2] & 63 };
@@ -47,15 +52,74 @@ static inline int decode_base64(const char src[static 4])
 	return val;
 }
 
-bool key_from_base64(uint8_t key[static WG_KEY_LEN], const char *base64)
+#ifdef HAVE_DECODE_BASE64_SSSE3
+/*
+ * Decode 16 characters into the first 12 bytes of dest, returning a mask of
+ * the characters outside the alphabet. Each character is matched against
+ * every range of the alphabet, as in decode_base64, with byte comparisons.
+ */
+static inline __attribute__((target("ssse3"))) int decode_base64_ssse3(uint8_t dest[static 16], __m128i src)
+{
+#define IN_RANGE(lo, hi) _mm_and_si128(_mm_cmpgt_epi8(src, _mm_set1_epi8((lo) - 1)), _mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1), src))
+	const __m128i upper = IN_RANGE('A', 'Z'), lower = IN_RANGE('a', 'z'), digit = IN_RANGE('0', '9');
+	const __m128i plus = _mm_cmpeq_epi8(src, _mm_set1_epi8('+')), slash = _mm_cmpeq_epi8(src, _mm_set1_epi8('/'));
+#undef IN_RANGE
+	__m128i valid, val;
+
+	valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)), slash);
+	val = _mm_or_si128(_mm_or_si128(_mm_and_si128(upper, _mm_sub_epi8(src, _mm_set1_epi8('A'))),
+					_mm_and_si128(lower, _mm_sub_epi8(src, _mm_set1_epi8('a' - 26)))),
+			   _mm_or_si128(_mm_and_si128(digit, _mm_add_epi8(src, _mm_set1_epi8(52 - '0'))),
+					_mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62)),
+						     _mm_and_si128(slash, _mm_set1_epi8(63)))));
+
+	/* a << 18 | b << 12 | c << 6 | d in each 32-bit lane, then its bytes in big-endian order */
+	val = _mm_maddubs_epi16(val, _mm_set1_epi32(0x01400140));
+	val = _mm_madd_epi16(val, _mm_set1_epi32(0x00011000));
+	val = _mm_shuffle_epi8(val, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	_mm_storeu_si128((__m128i *)dest, val);
+
+	return _mm_movemask_epi8(valid) ^ 0xffff;
+}
+
+/*
+ * The 44 characters, which key_from_base64 has checked, are decoded from
+ * three overlapping loads: characters 0, 16 and 28 onward. The trailing '='
+ * becomes 'A', whose zero bits extend the padding bits which must be zero
+ * into a whole byte.
+ */
+static __attribute__((target("ssse3"))) bool key_from_base64_ssse3(uint8_t key[static WG_KEY_LEN], const char *base64)
+{
+	uint8_t out[3][16];
+	__m128i tail = _mm_loadu_si128((const __m128i *)(base64 + 28));
+	unsigned int ret;
+
+	tail = _mm_or_si128(_mm_and_si128(tail, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0)),
+			    _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 'A'));
+
+	ret = decode_base64_ssse3(out[0], _mm_loadu_si128((const __m128i *)base64));
+	ret |= decode_base64_ssse3(out[1], _mm_loadu_si128((const __m128i *)(base64 + 16)));
+	ret |= decode_base64_ssse3(out[2], tail);
+	/* The byte past the key, which holds the padding bits */
+	ret |= out[2][11];
+
+	memcpy(key, out[0], 12);
+	memcpy(key + 12, out[1], 12);
+	memcpy(key + 24, out[2] + 3, 8);
+
+	memset(out, 0, sizeof(out));
+	asm volatile("" : : "r"(out) : "memory");
+
+	return 1 & ((ret - 1) >> 31);
+}
+#endif
+
+static bool key_from_base64_scalar(uint8_t key[static WG_KEY_LEN], const char *base64)
 {
 	unsigned int i;
 	volatile uint8_t ret = 0;
 	int val;
 
-	if (strlen(base64) != WG_KEY_LEN_BASE64 - 1 || base64[WG_KEY_LEN_BASE64 - 2] != '=')
-		return false;
-
 	for (i = 0; i < WG_KEY_LEN / 3; ++i) {
 		val = decode_base64(&base64[i * 4]);
 		ret |= (uint32_t)val >> 31;
@@ -71,6 +135,61 @@ bool key_from_base64(uint8_t key[static WG_KEY_LEN], const char *base64)
 	return 1 & ((ret - 1) >> 8);
 }
 
+static bool base64_backend_supported(enum base64_backend backend)
+{
+	switch (backend) {
+	case BASE64_BACKEND_SCALAR:
+		return true;
+#ifdef HAVE_DECODE_BASE64_SSSE3
+	case BASE64_BACKEND_SSSE3:
+		return __builtin_cpu_supports("ssse3");
+#endif
+	default:
+		return false;
+	}
+}
+
+int key_from_base64_backend(enum base64_backend backend, uint8_t key[static WG_KEY_LEN], const char *base64)
+{
+	if (backend == BASE64_BACKEND_AUTO) {
+		if (base64_backend_supported(BASE64_BACKEND_SSSE3))
+			backend = BASE64_BACKEND_SSSE3;
+		else
+			backend = BASE64_BACKEND_SCALAR;
+	}
+
+	if (!base64_backend_supported(backend))
+		return -1;
+
+	if (strlen(base64) != WG_KEY_LEN_BASE64 - 1 || base64[WG_KEY_LEN_BASE64 - 2] != '=')
+		return 0;
+
+	switch (backend) {
+#ifdef HAVE_DECODE_BASE64_SSSE3
+	case BASE64_BACKEND_SSSE3:
+		return key_from_base64_ssse3(key, base64);
+#endif
+	default:
+		return key_from_base64_scalar(key, base64);
+	}
+}
+
+bool key_from_base64(uint8_t key[static WG_KEY_LEN], const char *base64)
+{
+	return key_from_base64_backend(BASE64_BACKEND_AUTO, key, base64) == 1;
+}
+
+size_t keys_from_base64(uint8_t (*keys)[WG_KEY_LEN], const char *const *base64, bool *valid, size_t n)
+{
+	size_t invalid = 0;
+
+	for (size_t i = 0; i < n; ++i) {
+		valid[i] = key_from_base64(keys[i], base64[i]);
+		invalid += !valid[i];
+	}
+	return invalid;
+}
+
 void key_to_hex(char hex[static WG_KEY_LEN_HEX], const uint8_t key[static WG_KEY_LEN])
 {
 	unsigned int i;
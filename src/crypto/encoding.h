@@ -7,6 +7,7 @@
 #define ENCODING_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef WG_KEY_LEN
@@ -19,6 +20,18 @@
 void key_to_base64(char base64[static WG_KEY_LEN_BASE64], const uint8_t key[static WG_KEY_LEN]);
 bool key_from_base64(uint8_t key[static WG_KEY_LEN], const char *base64);
 
+enum base64_backend {
+	/* SSSE3 where the CPU supports it, and otherwise SCALAR */
+	BASE64_BACKEND_AUTO,
+	BASE64_BACKEND_SCALAR,
+	BASE64_BACKEND_SSSE3,
+};
+
+/* As key_from_base64, returning 1 or 0, or -1 if backend is not built or not supported by the CPU */
+int key_from_base64_backend(enum base64_backend backend, uint8_t key[static WG_KEY_LEN], const char *base64);
+/* Decode n keys, setting valid[i] as key_from_base64 returns; returns the number which are not */
+size_t keys_from_base64(uint8_t (*keys)[WG_KEY_LEN], const char *const *base64, bool *valid, size_t n);
+
 void key_to_hex(char hex[static WG_KEY_LEN_HEX], const uint8_t key[static WG_KEY_LEN]);
 bool key_from_hex(uint8_t key[static WG_KEY_LEN], const char *hex);
 
@@ -1,6 +1,13 @@
 #include "curve25519.h"
 #include "encoding.h"
 
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_ENCODE_BASE32_SSSE3
+#endif
+
 #define WG_KEY_LEN_BASE32 (((WG_KEY_LEN + 4) / 5) * 8 + 1)
 #define WG_KEY_LEN_BASE64 ((((WG_KEY_LEN) + 2) / 3) * 4 + 1)
 
@@ -20,10 +27,57 @@ static inline void encode_base32(char dest[static 8], const uint8_t src[static 5
 		dest[i] = 'A' + input[i] - (((25 - input[i]) >> 8) & 41);
 }
 
+#ifdef HAVE_ENCODE_BASE32_SSSE3
+/*
+ * The 5-bit values of the group of 5 bytes at src, in the 16-bit lanes of
+ * a vector. Lane i holds the two bytes which contain value i, big-endian,
+ * and pmulhuw by 2^(16 - s) shifts each right by its own s.
+ */
+static inline __attribute__((target("ssse3"))) __m128i encode_base32_ssse3(const uint8_t src[static 8]) {
+	const __m128i spread = _mm_setr_epi8(1, 0, 1, 0, 2, 1, 2, 1, 3, 2, 4, 3, 4, 3, -1, 4);
+	const __m128i shift = _mm_setr_epi16(1 << 5, 1 << 10, 1 << 7, 1 << 12, 1 << 9, 1 << 6, 1 << 11, 1 << 8);
+
+	__m128i val = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *) src), spread);
+
+	return _mm_and_si128(_mm_mulhi_epu16(val, shift), _mm_set1_epi16(31));
+}
+
+// The 7 groups of a key, of which the last is zero-padded, two to a vector
+static __attribute__((target("ssse3"))) void key_to_base32_ssse3(char base32[static WG_KEY_LEN_BASE32],
+	const uint8_t key[static WG_KEY_LEN]) {
+
+	uint8_t padded[40] = { 0 };
+	char out[64];
+
+	memcpy(padded, key, WG_KEY_LEN);
+
+	for(unsigned int i = 0; i < 4; i++) {
+		__m128i hi = i < 3 ? encode_base32_ssse3(&padded[i * 10 + 5]) : _mm_setzero_si128();
+		__m128i val = _mm_packus_epi16(encode_base32_ssse3(&padded[i * 10]), hi);
+
+		// 'A' to 'Z', then '2' to '7'
+		val = _mm_sub_epi8(_mm_add_epi8(val, _mm_set1_epi8('A')),
+			_mm_and_si128(_mm_cmpgt_epi8(val, _mm_set1_epi8(25)), _mm_set1_epi8(41)));
+
+		_mm_storeu_si128((__m128i *) &out[i * 16], val);
+	}
+
+	memcpy(base32, out, WG_KEY_LEN_BASE32 - 5);
+	memcpy(&base32[WG_KEY_LEN_BASE32 - 5], "====", 5);
+}
+#endif
+
 void key_to_base32(char base32[static WG_KEY_LEN_BASE32], const uint8_t key[static WG_KEY_LEN])
 {
 	unsigned int i;
 
+#ifdef HAVE_ENCODE_BASE32_SSSE3
+	if (__builtin_cpu_supports("ssse3")) {
+		key_to_base32_ssse3(base32, key);
+		return;
+	}
+#endif
+
 	for (i = 0; i < WG_KEY_LEN / 5; ++i)
 		encode_base32(&base32[i * 8], &key[i * 5]);
 	encode_base32(&base32[i * 8], (const uint8_t[]){ key[i * 5 + 0], key[i * 5 + 1], 0, 0, 0 });
@@ -34,9 +88,7 @@ void key_to_base32(char base32[static WG_KEY_LEN_BASE32], const uint8_t key[stat
 	base32[WG_KEY_LEN_BASE32 - 1] = '\0';
 }
 
-int wg_pubkey_base32(char const * privkey, char * base32) {
-
-	uint8_t key[WG_KEY_LEN] __attribute((aligned(sizeof(uintptr_t))));
+static bool privkey_from_base64(uint8_t key[static WG_KEY_LEN], char const * privkey) {
 	char base64[WG_KEY_LEN_BASE64];
 
 	int i;
@@ -46,10 +98,16 @@ int wg_pubkey_base32(char const * privkey, char * base32) {
 	base64[WG_KEY_LEN_BASE64 - 1] = '\0';
 
 	if(i != WG_KEY_LEN_BASE64 - 1 || privkey[i]) {
-		return 1;
+		return false;
 	}
 
-	if(!key_from_base64(key, base64)) {
+	return key_from_base64(key, base64);
+}
+
+int wg_pubkey_base32(char const * privkey, char * base32) {
+	uint8_t key[WG_KEY_LEN] __attribute((aligned(sizeof(uintptr_t))));
+
+	if(!privkey_from_base64(key, privkey)) {
 		return 1;
 	}
 
@@ -60,6 +118,37 @@ int wg_pubkey_base32(char const * privkey, char * base32) {
 	return 0;
 }
 
+int wg_pubkey_base32_batch(char const * const * privkeys, char (*base32)[WG_KEY_LEN_BASE32], size_t n) {
+	enum { BATCH = 64 };
+
+	uint8_t keys[BATCH][WG_KEY_LEN] __attribute((aligned(sizeof(uintptr_t))));
+	bool valid[BATCH];
+	int malformed = 0;
+
+	for(size_t begin = 0; begin < n; begin += BATCH) {
+		size_t m = n - begin < BATCH ? n - begin : BATCH;
+
+		malformed += keys_from_base64(keys, privkeys + begin, valid, m);
+
+		for(size_t i = 0; i < m; i++) {
+			// Any secret derives a key, which is discarded
+			if(!valid[i]) {
+				memset(keys[i], 0, WG_KEY_LEN);
+				base32[begin + i][0] = '\0';
+			}
+		}
+
+		curve25519_generate_public_batch(keys, (const uint8_t (*)[WG_KEY_LEN]) keys, m);
+
+		for(size_t i = 0; i < m; i++) {
+			if(valid[i])
+				key_to_base32(base32[begin + i], keys[i]);
+		}
+	}
+
+	return malformed;
+}
+
 int wg_key_convert_base32(char const * base64, char * base32) {
 	uint8_t key[WG_KEY_LEN] __attribute((aligned(sizeof(uintptr_t))));
 
@@ -1,3 +1,6 @@
+#include <stddef.h>
+#include <stdint.h>
+
 extern "C" {
 
 #ifndef WG_KEY_LEN
@@ -20,6 +23,64 @@ extern "C" {
  */
 int wg_pubkey_base32(char const * privkey, char * base32);
 
+/*
+ * wg_pubkey_base32_batch derives the public keys of N private keys at once,
+ * sharing the field inversion of the derivation between them
+ *
+ * PRIVKEYS: N c-style strings as in wg_pubkey_base32
+ * BASE32:   N encoded public keys, the empty string for each private key
+ * which is formatted improperly
+ *
+ * returns: the number of improperly formatted private keys
+ */
+int wg_pubkey_base32_batch(char const * const * privkeys, char (*base32)[WG_KEY_LEN_BASE32], size_t n);
+
 int wg_key_convert_base32(char const * base64, char * base32);
 
+/*
+ * key_to_base32 encodes a key in the base32 of the keyfile names, with
+ * padding
+ */
+void key_to_base32(char * base32, uint8_t const * key);
+
+/*
+ * C++-compatible declarations of the routines in encoding.h, which
+ * decode and encode the base64 form of keys in constant time.
+ * key_from_base64_backend decodes through one backend, returning -1
+ * where it is unavailable.
+ */
+void key_to_base64(char * base64, uint8_t const * key);
+bool key_from_base64(uint8_t * key, char const * base64);
+
+enum base64_backend {
+	BASE64_BACKEND_AUTO,
+	BASE64_BACKEND_SCALAR,
+	BASE64_BACKEND_SSSE3,
+};
+
+int key_from_base64_backend(enum base64_backend backend, uint8_t * key, char const * base64);
+size_t keys_from_base64(uint8_t (*keys)[WG_KEY_LEN], char const * const * base64, bool * valid, size_t n);
+
+/*
+ * C++-compatible declarations of the routines in curve25519.h.
+ * curve25519_generate_public multiplies the fixed basepoint using a table
+ * of its multiples where available, while curve25519 runs the Montgomery
+ * ladder for any point. Both clamp the secret.
+ *
+ * curve25519_generate_public_batch_backend derives a batch through one
+ * backend, rather than the fastest, returning -1 where it is unavailable.
+ */
+void curve25519(uint8_t * mypublic, uint8_t const * secret, uint8_t const * basepoint);
+void curve25519_generate_public(uint8_t * pub, uint8_t const * secret);
+void curve25519_generate_public_batch(uint8_t (*pub)[32], uint8_t const (*secret)[32], size_t n);
+
+enum curve25519_backend {
+	CURVE25519_BACKEND_AUTO,
+	CURVE25519_BACKEND_SCALAR,
+	CURVE25519_BACKEND_AVX512IFMA,
+};
+
+int curve25519_generate_public_batch_backend(enum curve25519_backend backend, uint8_t (*pub)[32],
+	uint8_t const (*secret)[32], size_t n);
+
 }
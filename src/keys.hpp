@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#pragma once
+
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace wg2nd {
+
+	enum class KeySection : uint8_t {
+		INTERFACE,
+		PEER,
+	};
+
+	enum class ConfigKey : uint8_t {
+		// [Interface]
+		PRIVATE_KEY,
+		DNS,
+		ADDRESS,
+		TABLE,
+		LISTEN_PORT,
+		MTU,
+		PRE_UP,
+		POST_UP,
+		PRE_DOWN,
+		POST_DOWN,
+		SAVE_CONFIG,
+		// [Peer]
+		ENDPOINT,
+		ALLOWED_IPS,
+		PUBLIC_KEY,
+		PERSISTENT_KEEPALIVE,
+		PRESHARED_KEY,
+		UNKNOWN,
+	};
+
+	struct KeyDef {
+		std::string_view name;
+		ConfigKey key;
+		KeySection section;
+	};
+
+	// Every key recognized by the parser
+	constexpr KeyDef CONFIG_KEYS[] = {
+		{ "PrivateKey",          ConfigKey::PRIVATE_KEY,          KeySection::INTERFACE },
+		{ "DNS",                 ConfigKey::DNS,                  KeySection::INTERFACE },
+		{ "Address",             ConfigKey::ADDRESS,              KeySection::INTERFACE },
+		{ "Table",               ConfigKey::TABLE,                KeySection::INTERFACE },
+		{ "ListenPort",          ConfigKey::LISTEN_PORT,          KeySection::INTERFACE },
+		{ "MTU",                 ConfigKey::MTU,                  KeySection::INTERFACE },
+		{ "PreUp",               ConfigKey::PRE_UP,               KeySection::INTERFACE },
+		{ "PostUp",              ConfigKey::POST_UP,              KeySection::INTERFACE },
+		{ "PreDown",             ConfigKey::PRE_DOWN,             KeySection::INTERFACE },
+		{ "PostDown",            ConfigKey::POST_DOWN,            KeySection::INTERFACE },
+		{ "SaveConfig",          ConfigKey::SAVE_CONFIG,          KeySection::INTERFACE },
+		{ "Endpoint",            ConfigKey::ENDPOINT,             KeySection::PEER },
+		{ "AllowedIPs",          ConfigKey::ALLOWED_IPS,          KeySection::PEER },
+		{ "PublicKey",           ConfigKey::PUBLIC_KEY,           KeySection::PEER },
+		{ "PersistentKeepalive", ConfigKey::PERSISTENT_KEEPALIVE, KeySection::PEER },
+		{ "PresharedKey",        ConfigKey::PRESHARED_KEY,        KeySection::PEER },
+	};
+
+	constexpr size_t N_CONFIG_KEYS = sizeof(CONFIG_KEYS) / sizeof(CONFIG_KEYS[0]);
+
+	// Perfect hash over the length, first, and last character of a key
+	//
+	// The multiplier is chosen at compile time so that no two keys in
+	// CONFIG_KEYS share a slot; the hash table is then resolved with a
+	// single comparison.
+	constexpr size_t KEY_HASH_BITS = 6;
+	constexpr size_t KEY_HASH_SIZE = size_t(1) << KEY_HASH_BITS;
+
+	static_assert(N_CONFIG_KEYS < KEY_HASH_SIZE, "Too many keys for the hash table");
+
+	constexpr size_t _key_hash(std::string_view key, uint32_t seed) {
+		uint32_t x = uint32_t(key.size()) << 16
+			| uint32_t(uint8_t(key.front())) << 8
+			| uint32_t(uint8_t(key.back()));
+
+		return (x * seed) >> (32 - KEY_HASH_BITS);
+	}
+
+	constexpr uint8_t KEY_HASH_EMPTY = 0xff;
+
+	struct KeyHashTable {
+		uint32_t seed;
+		std::array<uint8_t, KEY_HASH_SIZE> slots;
+	};
+
+	consteval KeyHashTable _build_key_hash() {
+		for(uint32_t seed = 0x9e3779b1; ; seed += 2) {
+			KeyHashTable table { seed, {} };
+			table.slots.fill(KEY_HASH_EMPTY);
+
+			bool collision = false;
+
+			for(size_t i = 0; i < N_CONFIG_KEYS and !collision; i++) {
+				uint8_t & slot = table.slots[_key_hash(CONFIG_KEYS[i].name, seed)];
+
+				collision = slot != KEY_HASH_EMPTY;
+				slot = uint8_t(i);
+			}
+
+			if(!collision) {
+				return table;
+			}
+		}
+	}
+
+	constexpr KeyHashTable KEY_HASH = _build_key_hash();
+
+	// The definition of key, or nullptr if the key is unknown
+	constexpr KeyDef const * lookup_key(std::string_view key) {
+		if(key.empty()) {
+			return nullptr;
+		}
+
+		uint8_t slot = KEY_HASH.slots[_key_hash(key, KEY_HASH.seed)];
+
+		if(slot == KEY_HASH_EMPTY or CONFIG_KEYS[slot].name != key) {
+			return nullptr;
+		}
+
+		return &CONFIG_KEYS[slot];
+	}
+
+};
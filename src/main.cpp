@@ -10,6 +10,9 @@
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
@@ -102,13 +105,13 @@ constexpr char const * DEFAULT_OUTPUT_PATH = "/etc/systemd/network/";
  */
 
 void die_usage(const char *prog) {
-	err("Usage: %s {  install, generate } [ OPTIONS ] { -h, CONFIG_FILE }", prog);
+	err("Usage: %s {  install, generate, check } [ OPTIONS ] { -h, CONFIG_FILE }", prog);
 	err("Usage: %s version", prog);
 	die("Use -h for help");
 }
 
 void print_help(const char *prog) {
-	err("Usage: %s { install, generate } [ OPTIONS ] { -h, CONFIG_FILE }", prog);
+	err("Usage: %s { install, generate, check } [ OPTIONS ] { -h, CONFIG_FILE }", prog);
 	err("Usage: %s version\n", prog);
 	err("  CONFIG_FILE is the complete path to a WireGuard configuration file, used by");
 	err("  `wg-quick`. `wg2nd` will convert the WireGuard configuration to networkd");
@@ -127,41 +130,72 @@ void print_help(const char *prog) {
 	err("     `wg2nd generate -t nft CONFIG_FILE`. Refer to `nft(8)` for details.\n");
 	err("  Actions:");
 	err("    install   Generate and install the configuration with restricted permissions");
-	err("    generate  Generate specific configuration files and write the results to stdout\n");
+	err("    generate  Generate specific configuration files and write the results to stdout");
+	err("    check     Report every error in configuration files, or directories of them\n");
 	err("  Options:");
 	err("    -h        Print this help");
 	exit(EXIT_SUCCESS);
 }
 
 void die_usage_generate(const char *prog) {
-	err("Usage: %s generate [ -h ] [ -k KEYPATH ] [ -t { network, netdev, keyfile, nft } ] [ -a ACTIVATION_POLICY ] CONFIG_FILE\n", prog);
+	err("Usage: %s generate [ -h ] [ -c ] [ -r ] [ -s ] [ -p THREADS ] [ -k KEYPATH ] [ -t { network, netdev, keyfile, nft } ] [ -a ACTIVATION_POLICY ] [ -b ] [ -j ] CONFIG_FILE ...\n", prog);
 	die("Use -h for help");
 }
 
 void print_help_generate(const char *prog) {
-	err("Usage: %s generate [ -h ] [ -a ACTIVATION_POLICY ] [ -k KEYPATH ] [ -t { network, netdev, keyfile, nft } ] CONFIG_FILE\n", prog);
+	err("Usage: %s generate [ -h ] [ -c ] [ -r ] [ -s ] [ -p THREADS ] [ -a ACTIVATION_POLICY ] [ -k KEYPATH ] [ -t { network, netdev, keyfile, nft } ] [ -b ] [ -j ] CONFIG_FILE ...\n", prog);
 	err("Options:");
 	err("  -a ACTIVATION_POLICY");
 	err("     manual Require manual activation (default)");
 	err("     up     Automatically set the link \"up\"\n");
+	err("  -c        Coalesce duplicate, contained, and adjacent routes in the network");
+	err("            (every AllowedIP is still listed in the netdev)\n");
+	err("  -r        Drop packets to each address with a rule of its own in the nft table,");
+	err("            as `wg-quick(8)` does, rather than matching a set of the addresses\n");
+	err("  -s        Fail if an AllowedIP of one peer duplicates, contains, or lies within");
+	err("            that of another, rather than warn\n");
+	err("  -p THREADS  Parse the configuration and format its peers on THREADS threads,");
+	err("              or one per CPU if 0 (default is 1). Worthwhile for thousands of peers\n");
 	err("  -t FILE_TYPE");
 	err("     network  Generate a Network Configuration File (see systemd.network(8))");
 	err("     netdev   Generate a Virtual Device File (see systemd.netdev(8))");
 	err("     keyfile  Print the interface's private key");
 	err("     nft      Print the netfilter table `nft(8)` installed by `wg-quick(8)`\n");
+	err("  -b        With -t nft, print one transaction for every CONFIG_FILE which creates,");
+	err("            flushes and fills each table, so it can be applied with `nft -f` atomically");
+	err("            and repeatedly (implied by more than one CONFIG_FILE)\n");
+	err("  -j        With -t nft, print the transaction in the JSON syntax read by `nft -j -f`");
+	err("            (see libnftables-json(5), implies -b)\n");
 	err("  -k KEYPATH  Full path to the keyfile (a path relative to /etc/systemd/network is generated");
 	err("              if unspecified)\n");
 	err("  -h        Print this help");
 	exit(EXIT_SUCCESS);
 }
 
+void die_usage_check(const char *prog) {
+	err("Usage: %s check [ -h ] { CONFIG_FILE, DIRECTORY } ...\n", prog);
+	die("Use -h for help");
+}
+
+void print_help_check(const char *prog) {
+	err("Usage: %s check [ -h ] { CONFIG_FILE, DIRECTORY } ...\n", prog);
+	err("  `wg2nd check` validates `wg-quick(8)` configuration files without generating");
+	err("  any output. Rather than stopping at the first error, every error is printed");
+	err("  to stdout as CONFIG_FILE:LINE:COLUMN: MESSAGE. Every file ending in `.conf`");
+	err("  within a DIRECTORY is checked.\n");
+	err("  The exit status is 1 if any configuration contains an error.\n");
+	err("Options:");
+	err("  -h        Print this help");
+	exit(EXIT_SUCCESS);
+}
+
 void die_usage_install(const char *prog) {
-	err("Usage: %s install [ -h ] [ -a ACTIVATION_POLICY ] [ -f FILE_NAME ] [ -o OUTPUT_PATH ] CONFIG_FILE\n", prog);
+	err("Usage: %s install [ -h ] [ -c ] [ -s ] [ -p THREADS ] [ -a ACTIVATION_POLICY ] [ -f FILE_NAME ] [ -o OUTPUT_PATH ] { CONFIG_FILE, DIRECTORY } ...\n", prog);
 	die("Use -h for help");
 }
 
 void print_help_install(const char *prog) {
-	err("Usage: %s install [ -h ] [ -a ACTIVATION_POLICY ] [ -f FILE_NAME ] [ -o OUTPUT_PATH ] CONFIG_FILE\n", prog);
+	err("Usage: %s install [ -h ] [ -c ] [ -s ] [ -p THREADS ] [ -a ACTIVATION_POLICY ] [ -f FILE_NAME ] [ -o OUTPUT_PATH ] { CONFIG_FILE, DIRECTORY } ...\n", prog);
 	err("  `wg2nd install` translates `wg-quick(8)` configuration into corresponding");
 	err("  `networkd` configuration and installs the resulting files in `OUTPUT_PATH`.\n");
 	err("  `wg2nd install` generates a `netdev`, `network`, and `keyfile` for each");
@@ -172,10 +206,23 @@ void print_help_install(const char *prog) {
 	err("  or `::/0` is specified in `AllowedIPs`). This is not installed by default");
 	err("  with `wg2nd install`. The equivalent firewall can be generated with");
 	err("  `wg2nd generate -t nft CONFIG_FILE`.\n");
+	err("  An index of the output, FILE_NAME.wg2nd-index, is installed alongside it.");
+	err("  When the configuration is installed again, the sections of unchanged peers");
+	err("  are copied from the installed files rather than regenerated, and the");
+	err("  keyfiles of removed peers are deleted.\n");
+	err("  Several CONFIG_FILEs, or a DIRECTORY of `*.conf` files, can be installed at");
+	err("  once. Each is installed as if given alone, without -f or -k.\n");
 	err("Options:");
 	err("  -a ACTIVATION_POLICY");
 	err("     manual Require manual activation (default)");
 	err("     up     Automatically set the link \"up\"\n");
+	err("  -c              Coalesce duplicate, contained, and adjacent routes in the network");
+	err("                  (every AllowedIP is still listed in the netdev)\n");
+	err("  -s              Fail if an AllowedIP of one peer duplicates, contains, or lies");
+	err("                  within that of another, rather than warn\n");
+	err("  -p THREADS      Parse the configuration and format its peers on THREADS");
+	err("                  threads, or one per CPU if 0 (default is 1). Worthwhile for");
+	err("                  thousands of peers\n");
 	err("  -o OUTPUT_PATH  The installation path (default is /etc/systemd/network)\n");
 	err("  -f FILE_NAME    The base name for the installed configuration files. The");
 	err("                  networkd-specific configuration suffix will be added");
@@ -208,68 +255,282 @@ enum class FileType {
 #include "wg2nd.hpp"
 
 #include <iostream>
-#include <fstream>
 #include <optional>
+#include <algorithm>
+#include <system_error>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <grp.h>
 
 using namespace wg2nd;
 
-static void write_systemd_file(SystemdFilespec const & filespec, std::string output_path, bool secure) {
-	std::string full_path = output_path + "/" + filespec.name;
-	std::ofstream ofs;
+// Read-only contents of a configuration file. Regular files are mapped
+// into memory and parsed in place; pipes and other streams which cannot
+// be mapped are read into a buffer.
+class ConfigInput {
+
+	public:
+
+		ConfigInput()
+			: _map { nullptr }
+			, _map_size { 0 }
+		{}
+
+		ConfigInput(ConfigInput const &) = delete;
+		ConfigInput & operator=(ConfigInput const &) = delete;
+
+		~ConfigInput() {
+			if(_map) {
+				munmap(_map, _map_size);
+			}
+		}
+
+		// Returns false, with errno set, if the file cannot be read
+		bool open(std::filesystem::path const & path) {
+			int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if(fd < 0) {
+				return false;
+			}
+
+			bool ok = _load(fd);
+
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+
+			return ok;
+		}
+
+		std::string_view contents() const noexcept {
+			if(_map) {
+				return { static_cast<char const *>(_map), _map_size };
+			}
+
+			return _buffer;
+		}
+
+	private:
+
+		bool _load(int fd) {
+			struct stat st;
+
+			if(fstat(fd, &st)) {
+				return false;
+			}
+
+			if(S_ISREG(st.st_mode) and st.st_size > 0) {
+				void * map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+				if(map != MAP_FAILED) {
+					_map = map;
+					_map_size = st.st_size;
+					madvise(_map, _map_size, MADV_SEQUENTIAL);
+					return true;
+				}
+			}
 
+			// Stdin, pipes, and files which cannot be mapped
+			size_t len = 0;
+			_buffer.resize(S_ISREG(st.st_mode) and st.st_size > 0 ? st.st_size : 16384);
+
+			while(true) {
+				if(len == _buffer.size()) {
+					_buffer.resize(_buffer.size() * 2);
+				}
+
+				ssize_t n = read(fd, _buffer.data() + len, _buffer.size() - len);
+
+				if(n < 0) {
+					if(errno == EINTR) {
+						continue;
+					}
+					return false;
+				}
+
+				if(n == 0) {
+					break;
+				}
+
+				len += n;
+			}
+
+			_buffer.resize(len);
+
+			return true;
+		}
+
+		void * _map;
+		size_t _map_size;
+		std::string _buffer;
+};
+
+// Open a file for writing, creating or truncating it. Secure files are
+// readable only by root and systemd-network.
+static int open_systemd_file(std::string const & full_path, bool secure) {
 	if (secure) {
 		// Set permissions to 0640 before writing the file
 		umask(0027);
+	}
 
-		// Open the file
-		ofs.open(full_path, std::ios::out | std::ios::trunc);
-		if (!ofs.is_open()) {
-			die("Failed to open file %s for writing", full_path.c_str());
-		}
+	int fd = open(full_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		die_errno("Failed to open file %s for writing", full_path.c_str());
+	}
 
+	if (secure) {
 		// Change ownership to root:systemd-network
 		struct group *grp;
 		grp = getgrnam("systemd-network");
 		if (grp == nullptr) {
 			die_errno("Failed to find the 'systemd-network' group");
 		}
-		if (chown(full_path.c_str(), 0, grp->gr_gid) != 0) {
+		if (fchown(fd, 0, grp->gr_gid) != 0) {
 			die_errno("Failed to change ownership of file %s", full_path.c_str());
 		}
 
 		// Set permissions
-		if (chmod(full_path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP) != 0) {
+		if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP) != 0) {
 			die_errno("Failed to set permissions for file %s", full_path.c_str());
 		}
-	} else {
-		ofs.open(full_path, std::ios::out | std::ios::trunc);
-		if (!ofs.is_open()) {
-			die_errno("Failed to open file %s for writing", full_path.c_str());
-		}
 	}
 
-	// Write the contents to the file
-	ofs << filespec.contents;
+	return fd;
+}
+
+// Writes a file as it is generated. The file is opened (and truncated) by
+// the first write, so an invalid configuration leaves the installed file
+// untouched. A replaced file is unlinked rather than truncated, so that a
+// mapping of the previous file remains intact.
+class SystemdFileSink : public OutputSink {
+
+	public:
+
+		// If given, stale_path (which describes the file) is removed
+		// before the file is first written
+		SystemdFileSink(std::string && full_path, bool secure, bool replace = false, std::string && stale_path = {})
+			: _full_path { std::move(full_path) }
+			, _stale_path { std::move(stale_path) }
+			, _secure { secure }
+			, _replace { replace }
+			, _fd { -1 }
+		{}
+
+		~SystemdFileSink() {
+			if(_fd >= 0) {
+				::close(_fd);
+			}
+		}
+
+		void write(std::string_view data) override {
+			if(_fd < 0) {
+				if(!_stale_path.empty() and unlink(_stale_path.c_str()) != 0 and errno != ENOENT) {
+					die_errno("Failed to remove file %s", _stale_path.c_str());
+				}
+
+				if(_replace and unlink(_full_path.c_str()) != 0 and errno != ENOENT) {
+					die_errno("Failed to replace file %s", _full_path.c_str());
+				}
+
+				_fd = open_systemd_file(_full_path, _secure);
+				_sink.emplace(_fd);
+			}
+
+			try {
+				_sink->write(data);
+			} catch(std::system_error const & ex) {
+				die("Failed to write to file %s: %s", _full_path.c_str(), ex.code().message().c_str());
+			}
+		}
+
+		// Flush and close the file, opening it if nothing was written
+		void close() {
+			write({});
+
+			try {
+				_sink->flush();
+			} catch(std::system_error const & ex) {
+				die("Failed to write to file %s: %s", _full_path.c_str(), ex.code().message().c_str());
+			}
+
+			if(::close(_fd) != 0) {
+				die_errno("Failed to write to file %s", _full_path.c_str());
+			}
+
+			_fd = -1;
+		}
+
+	private:
+		std::string _full_path;
+		std::string _stale_path;
+		bool _secure;
+		bool _replace;
+		int _fd;
+		std::optional<FdSink> _sink;
+};
+
+static void write_systemd_file(SystemdFilespec const & filespec, std::string output_path, bool secure) {
+	SystemdFileSink file { output_path + "/" + filespec.name, secure };
+
+	file.write(filespec.contents);
+	file.close();
+}
+
+// The names of the keyfiles of the netdevs in output_path other than
+// netdev_path, which may share peers, and so keyfiles, with it
+static std::unordered_set<std::string> keyfiles_of_other_netdevs(std::filesystem::path const & output_path,
+	std::filesystem::path const & netdev_path) {
+
+	constexpr std::string_view PRESHARED_KEY_FILE = "PresharedKeyFile = ";
 
-	if (ofs.fail()) {
-		die("Failed to write to file %s", full_path.c_str());
+	std::unordered_set<std::string> keyfiles;
+	std::error_code ec;
+
+	for(std::filesystem::directory_entry const & entry : std::filesystem::directory_iterator(output_path, ec)) {
+		if(entry.path().extension() != ".netdev" or entry.path() == netdev_path) {
+			continue;
+		}
+
+		ConfigInput netdev;
+
+		if(!netdev.open(entry.path())) {
+			die_errno("Failed to read file %s", entry.path().c_str());
+		}
+
+		std::string_view contents = netdev.contents();
+
+		for(size_t pos = contents.find(PRESHARED_KEY_FILE); pos != std::string_view::npos;
+				pos = contents.find(PRESHARED_KEY_FILE, pos + 1)) {
+			std::string_view path = contents.substr(pos + PRESHARED_KEY_FILE.size());
+			path = path.substr(0, path.find('\n'));
+
+			keyfiles.insert(std::filesystem::path(path).filename());
+		}
+	}
+
+	if(ec) {
+		die("Failed to list %s: %s", output_path.c_str(), ec.message().c_str());
 	}
+
+	return keyfiles;
 }
 
 static SystemdConfig generate_cfg_or_die(
 	std::filesystem::path && config_path,
+	SystemdSinks const & sinks,
 	std::filesystem::path const & keyfile_or_output_path,
 	std::optional<std::string> const & filename,
-	ActivationPolicy activation_policy
+	ActivationPolicy activation_policy,
+	GenerateOptions const & options,
+	bool indexed = false,
+	PreviousOutput const * previous = nullptr
 	) {
-	std::fstream cfg_stream { config_path, std::ios_base::in };
+	ConfigInput input;
 
-	if(!cfg_stream.is_open()) {
-		die("Failed to open config file %s", config_path.string().c_str());
+	if(!input.open(config_path)) {
+		die_errno("Failed to read config file %s", config_path.string().c_str());
 	}
 
 	SystemdConfig cfg;
@@ -277,13 +538,30 @@ static SystemdConfig generate_cfg_or_die(
 	std::string interface_name = interface_name_from_filename(config_path);
 
 	try {
-		cfg = wg2nd::wg2nd(
-			interface_name,
-			cfg_stream,
-			keyfile_or_output_path,
-			filename,
-			activation_policy
-		);
+		if(indexed) {
+			cfg = wg2nd_incremental(
+				interface_name,
+				input.contents(),
+				sinks,
+				previous,
+				keyfile_or_output_path,
+				filename,
+				activation_policy,
+				options
+			);
+		} else {
+			cfg = wg2nd::wg2nd(
+				interface_name,
+				input.contents(),
+				sinks,
+				keyfile_or_output_path,
+				filename,
+				activation_policy,
+				options
+			);
+		}
+	} catch(std::system_error const & ex) {
+		die("Failed to write output: %s", ex.code().message().c_str());
 	} catch(ConfigurationException const & cex) {
 
 		const ParsingException * pex = dynamic_cast<const ParsingException *>(&cex);
@@ -295,13 +573,17 @@ static SystemdConfig generate_cfg_or_die(
 
 	}
 
+	if(options.coalesce_routes) {
+		err("coalesced routes: removed %llu [Route] sections", (unsigned long long) cfg.removed_routes);
+	}
+
 	return cfg;
 }
 
 
 static void wg2nd_install_internal(std::optional<std::string> && filename, std::string && keyfile_name,
 	std::filesystem::path && output_path, std::filesystem::path && config_path,
-	ActivationPolicy activation_policy) {
+	ActivationPolicy activation_policy, GenerateOptions const & options) {
 
 	if(!std::filesystem::path(output_path).is_absolute()) {
 		output_path = std::filesystem::absolute(output_path);
@@ -313,55 +595,292 @@ static void wg2nd_install_internal(std::optional<std::string> && filename, std::
 		keyfile_or_output_path /= keyfile_name;
 	}
 
+	std::string basename = filename.value_or(interface_name_from_filename(config_path));
+
+	std::filesystem::path netdev_path = output_path / (basename + ".netdev");
+	std::filesystem::path network_path = output_path / (basename + ".network");
+	std::filesystem::path index_path = output_path / (basename + ".wg2nd-index");
+
+	// The output of the previous installation is mapped, and the sections
+	// of unchanged peers are copied from it
+	ConfigInput previous_index, previous_netdev, previous_network;
+	std::optional<PreviousOutput> previous;
+
+	if(previous_index.open(index_path)) {
+		std::optional<OutputIndex> index = OutputIndex::parse(previous_index.contents());
+
+		if(index and previous_netdev.open(netdev_path) and previous_network.open(network_path)) {
+			previous = PreviousOutput {
+				.index = std::move(*index),
+				.netdev = previous_netdev.contents(),
+				.network = previous_network.contents(),
+			};
+		}
+	}
+
+	// The netdev and network are written as they are generated, once the
+	// configuration is known to be valid. The index no longer describes
+	// the output once either is rewritten.
+	SystemdFileSink netdev_file { netdev_path, false, true, index_path };
+	SystemdFileSink network_file { network_path, false, true, index_path };
+
 	SystemdConfig cfg = generate_cfg_or_die(
 		std::move(config_path),
+		SystemdSinks {
+			.netdev = &netdev_file,
+			.network = &network_file,
+		},
 		keyfile_or_output_path,
 		std::move(filename),
-		activation_policy
+		activation_policy,
+		options,
+		true,
+		previous ? &*previous : nullptr
 	);
 
 	for(std::string const & warning : cfg.warnings) {
 		err("warning: %s", warning.c_str());
 	}
 
-	write_systemd_file(cfg.netdev, output_path, false);
-	write_systemd_file(cfg.network, output_path, false);
+	netdev_file.close();
+	network_file.close();
 	write_systemd_file(cfg.private_keyfile, output_path, true);
 
+	// Removed before the new keyfiles are written, so that none of them
+	// can be lost, unless another interface shares the peer
+	std::unordered_set<std::string> shared_keyfiles;
+
+	if(!cfg.removed_keyfiles.empty()) {
+		shared_keyfiles = keyfiles_of_other_netdevs(output_path, netdev_path);
+	}
+
+	for(std::string const & name : cfg.removed_keyfiles) {
+		if(shared_keyfiles.contains(name)) {
+			continue;
+		}
+
+		std::filesystem::path keyfile_path = output_path / name;
+
+		if(unlink(keyfile_path.c_str()) != 0 and errno != ENOENT) {
+			die_errno("Failed to remove file %s", keyfile_path.c_str());
+		}
+	}
+
 	for(SystemdFilespec const & spec : cfg.symmetric_keyfiles) {
 		write_systemd_file(spec, output_path, true);
 	}
+
+	// The index is written last, once the output it describes is complete
+	write_systemd_file(cfg.index, output_path, false);
+
+	if(previous) {
+		err("reused the sections of %llu unchanged peers", (unsigned long long) cfg.reused_peers);
+	}
 }
 
 static void wg2nd_generate_internal(FileType type, std::string && config_file,
 	std::optional<std::filesystem::path> && keyfile_path,
-	ActivationPolicy activation_policy) {
+	ActivationPolicy activation_policy, GenerateOptions const & options) {
+
+	// The requested netdev or network is written to stdout as it is
+	// generated, and the other discarded
+	FdSink out { STDOUT_FILENO };
+	NullSink discard;
 
 	SystemdConfig cfg = generate_cfg_or_die(
 		std::move(config_file),
+		SystemdSinks {
+			.netdev = type == FileType::NETDEV ? static_cast<OutputSink *>(&out) : &discard,
+			.network = type == FileType::NETWORK ? static_cast<OutputSink *>(&out) : &discard,
+		},
 		std::move(keyfile_path.value_or(DEFAULT_OUTPUT_PATH)),
 		{},
-		activation_policy
+		activation_policy,
+		options
 	);
 
-	switch(type) {
-		case FileType::NFT:
-			printf("%s", cfg.firewall.c_str());
-			break;
-		case FileType::NETWORK:
-			printf("%s", cfg.network.contents.c_str());
-			break;
-		case FileType::NETDEV:
-			printf("%s", cfg.netdev.contents.c_str());
-			break;
-		case FileType::KEYFILE:
-			printf("%s", cfg.private_keyfile.contents.c_str());
-			break;
-		default:
-			break;
+	try {
+		switch(type) {
+			case FileType::NFT:
+				out.write(cfg.firewall);
+				break;
+			case FileType::KEYFILE:
+				out.write(cfg.private_keyfile.contents);
+				break;
+			default:
+				break;
+		}
+
+		out.flush();
+	} catch(std::system_error const & ex) {
+		die("Failed to write to stdout: %s", ex.code().message().c_str());
 	}
 }
 
+// Install several configurations. The public keys which name their private
+// keyfiles are derived together, before any is installed.
+static void wg2nd_install_bulk(std::vector<std::filesystem::path> && config_paths,
+	std::filesystem::path const & output_path, ActivationPolicy activation_policy,
+	GenerateOptions const & options) {
+
+	std::vector<std::string> private_keys;
+	private_keys.reserve(config_paths.size());
+
+	for(std::filesystem::path const & config_path : config_paths) {
+		ConfigInput input;
+
+		if(!input.open(config_path)) {
+			die_errno("Failed to read config file %s", config_path.string().c_str());
+		}
+
+		try {
+			parse_config_streaming(interface_name_from_filename(config_path), input.contents(), {
+				.on_interface = [&](Interface && intf) {
+					private_keys.emplace_back(intf.private_key);
+				},
+				.on_peer = {},
+			});
+		} catch(ConfigurationException const & cex) {
+
+			const ParsingException * pex = dynamic_cast<const ParsingException *>(&cex);
+			if(pex && pex->line_no().has_value()) {
+				die("%s: parsing error (line %llu): %s", config_path.c_str(), pex->line_no().value(), pex->what());
+			} else {
+				die("%s: configuration error: %s", config_path.c_str(), cex.what());
+			}
+
+		}
+	}
+
+	std::vector<std::optional<std::string>> keyfile_names = private_keyfile_names(private_keys);
+
+	for(size_t i = 0; i < config_paths.size(); i++) {
+		if(!keyfile_names[i]) {
+			die("%s: configuration error: Private key is formatted improperly", config_paths[i].c_str());
+		}
+	}
+
+	for(size_t i = 0; i < config_paths.size(); i++) {
+		wg2nd_install_internal(
+			{},
+			std::move(*keyfile_names[i]),
+			std::filesystem::path(output_path),
+			std::move(config_paths[i]),
+			activation_policy,
+			options
+		);
+	}
+}
+
+// Print one nftables transaction for the firewalls of every configuration
+static void wg2nd_generate_nft_transaction(std::vector<std::filesystem::path> const & config_paths,
+	NftSyntax syntax, GenerateOptions const & options) {
+
+	std::vector<Interface> interfaces;
+
+	for(std::filesystem::path const & config_path : config_paths) {
+		ConfigInput input;
+
+		if(!input.open(config_path)) {
+			die_errno("Failed to read config file %s", config_path.string().c_str());
+		}
+
+		try {
+			parse_config_streaming(interface_name_from_filename(config_path), input.contents(), {
+				.on_interface = [&](Interface && intf) {
+					interfaces.push_back(std::move(intf));
+				},
+				.on_peer = {},
+			});
+		} catch(ConfigurationException const & cex) {
+
+			const ParsingException * pex = dynamic_cast<const ParsingException *>(&cex);
+			if(pex && pex->line_no().has_value()) {
+				die("%s: parsing error (line %llu): %s", config_path.c_str(), pex->line_no().value(), pex->what());
+			} else {
+				die("%s: configuration error: %s", config_path.c_str(), cex.what());
+			}
+
+		}
+	}
+
+	try {
+		FdSink out { STDOUT_FILENO };
+
+		out.write(gen_nftables_transaction(interfaces, syntax, options));
+		out.flush();
+	} catch(std::system_error const & ex) {
+		die("Failed to write to stdout: %s", ex.code().message().c_str());
+	}
+}
+
+// Print the errors in the configuration at config_path, returning the number found
+static size_t check_config_file(std::filesystem::path const & config_path) {
+	ConfigInput input;
+
+	if(!input.open(config_path)) {
+		err("%s: %s", config_path.c_str(), strerror(errno));
+		return 1;
+	}
+
+	std::vector<Diagnostic> diagnostics = check_config(
+		interface_name_from_filename(config_path),
+		input.contents()
+	);
+
+	for(Diagnostic const & diagnostic : diagnostics) {
+		if(diagnostic.column) {
+			printf("%s:%llu:%u: %s\n", config_path.c_str(), (unsigned long long) diagnostic.line,
+				diagnostic.column, diagnostic.message.c_str());
+		} else {
+			printf("%s:%llu: %s\n", config_path.c_str(), (unsigned long long) diagnostic.line,
+				diagnostic.message.c_str());
+		}
+	}
+
+	return diagnostics.size();
+}
+
+// Append the *.conf files of the directory at path, in order, to config_paths
+static void list_config_files(std::filesystem::path const & path, std::vector<std::filesystem::path> & config_paths,
+	std::error_code & ec) {
+
+	size_t begin = config_paths.size();
+
+	for(std::filesystem::directory_entry const & entry : std::filesystem::directory_iterator(path, ec)) {
+		if(entry.path().extension() == ".conf" and !entry.is_directory(ec)) {
+			config_paths.push_back(entry.path());
+		}
+	}
+
+	std::sort(config_paths.begin() + begin, config_paths.end());
+}
+
+static size_t wg2nd_check_internal(std::filesystem::path const & path) {
+	std::error_code ec;
+
+	if(!std::filesystem::is_directory(path, ec)) {
+		return check_config_file(path);
+	}
+
+	std::vector<std::filesystem::path> config_paths;
+
+	list_config_files(path, config_paths, ec);
+
+	if(ec) {
+		err("%s: %s", path.c_str(), ec.message().c_str());
+		return 1;
+	}
+
+	size_t n_errors = 0;
+
+	for(std::filesystem::path const & config_path : config_paths) {
+		n_errors += check_config_file(config_path);
+	}
+
+	return n_errors;
+}
+
 #ifdef HAVE_LIBCAP
 
 // Drop excess capabilities and ensure the process have proper capabilities upfront
@@ -426,16 +945,56 @@ static ActivationPolicy activation_policy_from_argument(std::string const & arg)
 	}
 }
 
+// A number of threads, of which 0 is one per CPU
+static unsigned threads_from_argument(char const * arg) {
+	char * end;
+	errno = 0;
+	unsigned long threads = strtoul(arg, &end, 10);
+
+	if(*arg < '0' or *arg > '9' or *end != '\0' or errno != 0 or threads > 1024) {
+		die("Invalid number of threads: \"%s\"", arg);
+	}
+
+	if(threads == 0) {
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	return unsigned(threads);
+}
+
 static int wg2nd_generate(char const * prog, int argc, char **argv) {
 	std::filesystem::path config_path = "";
 
 	FileType type = FileType::NONE;
 	std::optional<std::filesystem::path> keyfile_path = {};
 	ActivationPolicy activation_policy = ActivationPolicy::MANUAL;
+	bool has_activation_policy = false;
+	GenerateOptions options;
+	bool batch = false;
+	NftSyntax nft_syntax = NftSyntax::SCRIPT;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "ht:k:a:")) != -1) {
+	while ((opt = getopt(argc, argv, "hcrsbjp:t:k:a:")) != -1) {
 		switch (opt) {
+			case 'p':
+				options.threads = threads_from_argument(optarg);
+				break;
+			case 'b':
+				batch = true;
+				break;
+			case 'j':
+				batch = true;
+				nft_syntax = NftSyntax::JSON;
+				break;
+			case 'c':
+				options.coalesce_routes = true;
+				break;
+			case 'r':
+				options.nft_rule_per_address = true;
+				break;
+			case 's':
+				options.strict_allowed_ips = true;
+				break;
 			case 't':
 				if (strcmp(optarg, "network") == 0) {
 					type = FileType::NETWORK;
@@ -454,6 +1013,7 @@ static int wg2nd_generate(char const * prog, int argc, char **argv) {
 				break;
 			case 'a':
 				activation_policy = activation_policy_from_argument(optarg);
+				has_activation_policy = true;
 				break;
 			case 'h':
 				print_help_generate(prog);
@@ -471,13 +1031,36 @@ static int wg2nd_generate(char const * prog, int argc, char **argv) {
 	drop_excess_capabilities({});
 #endif /* HAVE_LIBCAP */
 
+	if (optind + 1 < argc) {
+		batch = true;
+	}
+
+	if (batch) {
+		if (type != FileType::NFT) {
+			die("A batch of CONFIG_FILEs can only be generated with -t nft");
+		}
+
+		if (keyfile_path or has_activation_policy) {
+			die("-k and -a can only be given with a single CONFIG_FILE, without -b or -j");
+		}
+
+		wg2nd_generate_nft_transaction(
+			std::vector<std::filesystem::path>(argv + optind, argv + argc),
+			nft_syntax,
+			options
+		);
+
+		return 0;
+	}
+
 	config_path = argv[optind];
 
 	wg2nd_generate_internal(
 		type,
 		std::move(config_path),
 		std::move(keyfile_path),
-		activation_policy
+		activation_policy,
+		options
 	);
 
 	return 0;
@@ -490,10 +1073,20 @@ static int wg2nd_install(char const * prog, int argc, char **argv) {
 	std::filesystem::path output_path = DEFAULT_OUTPUT_PATH;
 	std::string keyfile_name = "";
 	ActivationPolicy activation_policy = ActivationPolicy::MANUAL;
+	GenerateOptions options;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "o:f:k:a:h")) != -1) {
+	while ((opt = getopt(argc, argv, "o:f:k:a:p:csh")) != -1) {
 		switch (opt) {
+			case 'p':
+				options.threads = threads_from_argument(optarg);
+				break;
+			case 'c':
+				options.coalesce_routes = true;
+				break;
+			case 's':
+				options.strict_allowed_ips = true;
+				break;
 			case 'o': {
 				std::string path = optarg;
 				if(path[path.size() - 1] != '/') {
@@ -530,6 +1123,51 @@ static int wg2nd_install(char const * prog, int argc, char **argv) {
 	}});
 #endif /* HAVE_LIBCAP */
 
+	// Several configurations, or a directory of them, are installed in bulk
+	std::error_code ec;
+
+	if(optind + 1 < argc or std::filesystem::is_directory(argv[optind], ec)) {
+		if(filename or !keyfile_name.empty()) {
+			die("-f and -k can only be given with a single CONFIG_FILE");
+		}
+
+		std::vector<std::filesystem::path> config_paths;
+
+		for(int i = optind; i < argc; i++) {
+			if(!std::filesystem::is_directory(argv[i], ec)) {
+				config_paths.push_back(argv[i]);
+				continue;
+			}
+
+			size_t n_listed = config_paths.size();
+
+			list_config_files(argv[i], config_paths, ec);
+
+			if(ec) {
+				die("%s: %s", argv[i], ec.message().c_str());
+			}
+
+			if(config_paths.size() == n_listed) {
+				die("no *.conf files in %s", argv[i]);
+			}
+		}
+
+		// Each interface is installed under its name, so no two may share one
+		std::unordered_map<std::string, std::filesystem::path const *> installed_by;
+
+		for(std::filesystem::path const & path : config_paths) {
+			auto [it, inserted] = installed_by.emplace(interface_name_from_filename(path), &path);
+
+			if(!inserted) {
+				die("%s and %s would both install interface %s", it->second->c_str(), path.c_str(), it->first.c_str());
+			}
+		}
+
+		wg2nd_install_bulk(std::move(config_paths), output_path, activation_policy, options);
+
+		return 0;
+	}
+
 	config_path = argv[optind];
 
 	wg2nd_install_internal(
@@ -537,12 +1175,42 @@ static int wg2nd_install(char const * prog, int argc, char **argv) {
 		std::move(keyfile_name),
 		std::move(output_path),
 		std::move(config_path),
-		activation_policy
+		activation_policy,
+		options
 	);
 
 	return 0;
 }
 
+static int wg2nd_check(char const * prog, int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "h")) != -1) {
+		switch (opt) {
+			case 'h':
+				print_help_check(prog);
+				break;
+			default:
+				die_usage_check(prog);
+		}
+	}
+
+	if (optind >= argc) {
+		die_usage_check(prog);
+	}
+
+#ifdef HAVE_LIBCAP
+	drop_excess_capabilities({});
+#endif /* HAVE_LIBCAP */
+
+	size_t n_errors = 0;
+
+	for(int i = optind; i < argc; i++) {
+		n_errors += wg2nd_check_internal(argv[i]);
+	}
+
+	return n_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
 	char const * prog = "wg2nd";
 
@@ -560,6 +1228,8 @@ int main(int argc, char **argv) {
 		return wg2nd_generate(prog, argc - 1, argv + 1);
 	} else if (action == "install") {
 		return wg2nd_install(prog, argc - 1, argv + 1);
+	} else if (action == "check") {
+		return wg2nd_check(prog, argc - 1, argv + 1);
 	} else if (action == "version") {
 		printf("%s\n", VERSION);
 	} else if (action == "-h" || action == "--help") {
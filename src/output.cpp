@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "output.hpp"
+
+#include <system_error>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace wg2nd {
+
+	FdSink::FdSink(int fd)
+		: _fd { fd }
+		, _ring { new char[BUFFER_SIZE * RING_SIZE] }
+		, _used { }
+		, _head { 0 }
+	{ }
+
+	void FdSink::write(std::string_view data) {
+		if(data.size() >= BUFFER_SIZE) {
+			_writev(data);
+			return;
+		}
+
+		while(!data.empty()) {
+			if(_used[_head] == BUFFER_SIZE) {
+				if(++_head == RING_SIZE) {
+					_writev({});
+				}
+			}
+
+			size_t n = std::min(data.size(), BUFFER_SIZE - _used[_head]);
+			std::memcpy(_ring.get() + _head * BUFFER_SIZE + _used[_head], data.data(), n);
+
+			_used[_head] += n;
+			data.remove_prefix(n);
+		}
+	}
+
+	void FdSink::flush() {
+		_writev({});
+	}
+
+	void FdSink::_writev(std::string_view tail) {
+		struct iovec iov[RING_SIZE + 1];
+		int iovcnt = 0;
+
+		for(size_t i = 0; i < RING_SIZE and _used[i] > 0; i++) {
+			iov[iovcnt++] = { _ring.get() + i * BUFFER_SIZE, _used[i] };
+		}
+
+		if(!tail.empty()) {
+			iov[iovcnt++] = { const_cast<char *>(tail.data()), tail.size() };
+		}
+
+		struct iovec * next = iov;
+
+		while(iovcnt > 0) {
+			ssize_t n = ::writev(_fd, next, iovcnt);
+
+			if(n < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				throw std::system_error(errno, std::generic_category(), "write");
+			}
+
+			// Skip the buffers which were written completely, and the
+			// written part of the next
+			while(iovcnt > 0 and size_t(n) >= next->iov_len) {
+				n -= next->iov_len;
+				next++;
+				iovcnt--;
+			}
+
+			if(iovcnt > 0) {
+				next->iov_base = static_cast<char *>(next->iov_base) + n;
+				next->iov_len -= n;
+			}
+		}
+
+		std::fill(std::begin(_used), std::end(_used), 0);
+		_head = 0;
+	}
+
+};
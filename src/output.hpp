@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <memory>
+
+namespace wg2nd {
+
+	// An integer written in lowercase hexadecimal (without a prefix)
+	struct Hex {
+		uint64_t value;
+	};
+
+	// A value with a fixed-size text representation (such as Cidr)
+	template<typename T>
+	concept TextFormattable = requires(T const & value, char * buf) {
+		{ value.format(buf, true) } -> std::convertible_to<size_t>;
+		{ T::MAX_TEXT_LEN } -> std::convertible_to<size_t>;
+	};
+
+	// A prefix written without its length (e.g. 10.0.0.1 rather than 10.0.0.1/32)
+	template<TextFormattable T>
+	struct Address {
+		T const & value;
+	};
+
+	// A string literal which can be passed as a template argument, and
+	// concatenated with others at compile time
+	template<size_t N>
+	struct FixedString {
+		char text[N];
+
+		constexpr FixedString(char const (&s)[N]) {
+			for(size_t i = 0; i < N; i++) {
+				text[i] = s[i];
+			}
+		}
+
+		constexpr std::string_view view() const {
+			return { text, N - 1 };
+		}
+
+		template<size_t M>
+		constexpr FixedString<N + M - 1> operator+(FixedString<M> const & other) const {
+			char joined[N + M - 1];
+
+			for(size_t i = 0; i < N - 1; i++) {
+				joined[i] = text[i];
+			}
+
+			for(size_t i = 0; i < M; i++) {
+				joined[N - 1 + i] = other.text[i];
+			}
+
+			return joined;
+		}
+
+		template<size_t M>
+		constexpr FixedString<N + M - 1> operator+(char const (&other)[M]) const {
+			return *this + FixedString<M> { other };
+		}
+	};
+
+	// Fixed text with a field substituted at each "{}", which is split into
+	// the pieces between the fields at compile time
+	template<FixedString Text>
+	struct OutputTemplate {
+
+		static constexpr size_t N_FIELDS = [] {
+			std::string_view text = Text.view();
+			size_t n = 0;
+
+			for(size_t pos = text.find("{}"); pos != std::string_view::npos; pos = text.find("{}", pos + 2)) {
+				n++;
+			}
+
+			return n;
+		}();
+
+		static constexpr std::array<std::string_view, N_FIELDS + 1> PIECES = [] {
+			std::string_view text = Text.view();
+			std::array<std::string_view, N_FIELDS + 1> pieces;
+
+			for(size_t i = 0; i < N_FIELDS; i++) {
+				size_t field = text.find("{}");
+				pieces[i] = text.substr(0, field);
+				text.remove_prefix(field + 2);
+			}
+
+			pieces[N_FIELDS] = text;
+
+			return pieces;
+		}();
+	};
+
+	// Receives output as it is generated
+	class OutputSink {
+
+		public:
+
+			virtual ~OutputSink() = default;
+
+			virtual void write(std::string_view data) = 0;
+	};
+
+	// Discards all output
+	class NullSink : public OutputSink {
+
+		public:
+
+			void write(std::string_view) override { }
+	};
+
+	// Writes to a file descriptor through a ring of fixed-size buffers
+	//
+	// Data is copied into the ring until every buffer is full, and the ring is
+	// then written with a single writev(2). Writes larger than a buffer are
+	// passed to writev(2) directly, behind the contents of the ring. Throws
+	// std::system_error if the file descriptor cannot be written.
+	class FdSink : public OutputSink {
+
+		public:
+
+			static constexpr size_t BUFFER_SIZE = 64 * 1024;
+			static constexpr size_t RING_SIZE = 8;
+
+			// The file descriptor is neither owned nor closed
+			explicit FdSink(int fd);
+
+			FdSink(FdSink const &) = delete;
+			FdSink & operator=(FdSink const &) = delete;
+
+			void write(std::string_view data) override;
+
+			// Write the contents of the ring. This is not done on destruction,
+			// as the failure could not be reported.
+			void flush();
+
+		private:
+
+			void _writev(std::string_view tail);
+
+			int _fd;
+			std::unique_ptr<char[]> _ring;
+			// Bytes used of each buffer, those before _head are full
+			size_t _used[RING_SIZE];
+			size_t _head;
+	};
+
+	// Append-only text buffer for the generators
+	//
+	// The buffer is reserved once, from an estimate of the output size, and
+	// numbers and prefixes are formatted in place rather than through a stream.
+	// The result is moved out with take().
+	class OutputBuffer {
+
+		public:
+
+			explicit OutputBuffer(size_t reserve = 0)
+				: _sink { nullptr }
+				, _flushed { 0 }
+			{
+				_buf.reserve(reserve);
+			}
+
+			// Pass the contents to sink from now on, see drain() and flush()
+			void stream_to(OutputSink * sink) {
+				_sink = sink;
+				_buf.reserve(DRAIN_SIZE * 2);
+			}
+
+			bool is_streaming() const noexcept {
+				return _sink != nullptr;
+			}
+
+			void reserve(size_t size) {
+				_buf.reserve(size);
+			}
+
+			size_t size() const noexcept {
+				return _buf.size();
+			}
+
+			std::string_view view() const noexcept {
+				return _buf;
+			}
+
+			// The position of the next byte in the output of a streaming
+			// buffer, counting those already passed to the sink
+			uint64_t offset() const noexcept {
+				return _flushed + _buf.size();
+			}
+
+			OutputBuffer & operator<<(std::string_view s) {
+				_buf.append(s);
+				return *this;
+			}
+
+			OutputBuffer & operator<<(char const * s) {
+				_buf.append(s);
+				return *this;
+			}
+
+			OutputBuffer & operator<<(char c) {
+				_buf.push_back(c);
+				return *this;
+			}
+
+			template<std::integral T>
+			OutputBuffer & operator<<(T value) {
+				return _append_number(value, 10);
+			}
+
+			OutputBuffer & operator<<(Hex hex) {
+				return _append_number(hex.value, 16);
+			}
+
+			template<TextFormattable T>
+			OutputBuffer & operator<<(T const & value) {
+				return _append_formatted(value, true);
+			}
+
+			template<TextFormattable T>
+			OutputBuffer & operator<<(Address<T> address) {
+				return _append_formatted(address.value, false);
+			}
+
+			// Append Text, substituting each field in turn for its "{}"
+			template<FixedString Text, typename... Fields>
+			OutputBuffer & format(Fields const & ... fields) {
+				using Template = OutputTemplate<Text>;
+				static_assert(sizeof...(Fields) == Template::N_FIELDS, "each {} of the template needs a field");
+
+				size_t piece = 0;
+
+				*this << Template::PIECES[0];
+				((*this << fields << Template::PIECES[++piece]), ...);
+
+				return *this;
+			}
+
+			// Insert s before the current contents
+			void prepend(std::string_view s) {
+				_buf.insert(0, s);
+			}
+
+			// Once the contents of a streaming buffer exceed DRAIN_SIZE,
+			// pass them to the sink
+			void drain() {
+				if(_sink and _buf.size() >= DRAIN_SIZE) {
+					flush();
+				}
+			}
+
+			// Pass the contents of a streaming buffer to the sink
+			void flush() {
+				if(_sink) {
+					_sink->write(_buf);
+					_flushed += _buf.size();
+					_buf.clear();
+				}
+			}
+
+			// Release the contents, leaving the buffer empty
+			std::string take() {
+				return std::move(_buf);
+			}
+
+		private:
+
+			template<std::integral T>
+			OutputBuffer & _append_number(T value, int base) {
+				char buf[24];
+				auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value, base);
+				_buf.append(buf, end);
+				return *this;
+			}
+
+			template<TextFormattable T>
+			OutputBuffer & _append_formatted(T const & value, bool with_prefix) {
+				char buf[T::MAX_TEXT_LEN];
+				_buf.append(buf, value.format(buf, with_prefix));
+				return *this;
+			}
+
+			static constexpr size_t DRAIN_SIZE = 64 * 1024;
+
+			std::string _buf;
+			OutputSink * _sink;
+			uint64_t _flushed;
+	};
+
+};
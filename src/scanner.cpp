@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#include "scanner.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace wg2nd {
+
+	void scan_blocks_scalar(char const * data, size_t n_blocks, ScanMasks * masks) {
+		for(size_t b = 0; b < n_blocks; b++, data += SCAN_BLOCK_SIZE) {
+			ScanMasks m = {};
+
+			for(size_t i = 0; i < SCAN_BLOCK_SIZE; i++) {
+				uint64_t bit = uint64_t(1) << i;
+
+				switch(data[i]) {
+					case '\n':
+						m.newline |= bit;
+						break;
+					case '#':
+						m.comment |= bit;
+						break;
+					case '=':
+						m.equals |= bit;
+						break;
+					case '[':
+						m.bracket |= bit;
+						break;
+					case ' ':
+					case '\t':
+					case '\r':
+						m.space |= bit;
+						break;
+				}
+			}
+
+			masks[b] = m;
+		}
+	}
+
+#if defined(__SSE2__)
+	static inline uint64_t _match_sse2(__m128i const v[4], char c) {
+		__m128i needle = _mm_set1_epi8(c);
+		uint64_t mask = 0;
+
+		for(int i = 0; i < 4; i++) {
+			mask |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], needle)))) << (16 * i);
+		}
+
+		return mask;
+	}
+
+	// Whitespace is matched with a single movemask per vector
+	static inline uint64_t _match_space_sse2(__m128i const v[4]) {
+		uint64_t mask = 0;
+
+		for(int i = 0; i < 4; i++) {
+			__m128i space = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v[i], _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v[i], _mm_set1_epi8('\t'))),
+				_mm_cmpeq_epi8(v[i], _mm_set1_epi8('\r'))
+			);
+			mask |= uint64_t(uint32_t(_mm_movemask_epi8(space))) << (16 * i);
+		}
+
+		return mask;
+	}
+
+	void scan_blocks_sse2(char const * data, size_t n_blocks, ScanMasks * masks) {
+		for(size_t b = 0; b < n_blocks; b++, data += SCAN_BLOCK_SIZE) {
+			__m128i v[4];
+
+			for(int i = 0; i < 4; i++) {
+				v[i] = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + 16 * i));
+			}
+
+			masks[b].newline = _match_sse2(v, '\n');
+			masks[b].comment = _match_sse2(v, '#');
+			masks[b].equals = _match_sse2(v, '=');
+			masks[b].bracket = _match_sse2(v, '[');
+			masks[b].space = _match_space_sse2(v);
+		}
+	}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+	__attribute__((target("avx2")))
+	static inline uint64_t _match_avx2(__m256i lo, __m256i hi, char c) {
+		__m256i needle = _mm256_set1_epi8(c);
+
+		return uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle))))
+			| (uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)))) << 32);
+	}
+
+	__attribute__((target("avx2")))
+	static inline __m256i _space_avx2(__m256i v) {
+		return _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))
+		);
+	}
+
+	__attribute__((target("avx2")))
+	static inline uint64_t _match_space_avx2(__m256i lo, __m256i hi) {
+		return uint64_t(uint32_t(_mm256_movemask_epi8(_space_avx2(lo))))
+			| (uint64_t(uint32_t(_mm256_movemask_epi8(_space_avx2(hi)))) << 32);
+	}
+
+	__attribute__((target("avx2")))
+	void scan_blocks_avx2(char const * data, size_t n_blocks, ScanMasks * masks) {
+		for(size_t b = 0; b < n_blocks; b++, data += SCAN_BLOCK_SIZE) {
+			__m256i lo = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data));
+			__m256i hi = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + 32));
+
+			masks[b].newline = _match_avx2(lo, hi, '\n');
+			masks[b].comment = _match_avx2(lo, hi, '#');
+			masks[b].equals = _match_avx2(lo, hi, '=');
+			masks[b].bracket = _match_avx2(lo, hi, '[');
+			masks[b].space = _match_space_avx2(lo, hi);
+		}
+	}
+
+	bool cpu_has_avx2() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+
+	ScanBlocksFn scan_blocks_impl() {
+		static ScanBlocksFn const impl = [] () -> ScanBlocksFn {
+#if defined(__x86_64__) || defined(__i386__)
+			if(cpu_has_avx2()) {
+				return scan_blocks_avx2;
+			}
+#endif
+#if defined(__SSE2__)
+			return scan_blocks_sse2;
+#else
+			return scan_blocks_scalar;
+#endif
+		}();
+
+		return impl;
+	}
+
+};
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace wg2nd {
+
+	constexpr size_t SCAN_BLOCK_SIZE = 64;
+
+	// Positions of the characters which delimit tokens in a configuration,
+	// for one SCAN_BLOCK_SIZE-byte block. Bit i corresponds to byte i.
+	struct ScanMasks {
+		// '\n'
+		uint64_t newline;
+		// '#'
+		uint64_t comment;
+		// '='
+		uint64_t equals;
+		// '['
+		uint64_t bracket;
+		// ' ', '\t', and '\r'
+		uint64_t space;
+	};
+
+	// Classify n_blocks consecutive blocks starting at data
+	using ScanBlocksFn = void (*)(char const * data, size_t n_blocks, ScanMasks * masks);
+
+	void scan_blocks_scalar(char const * data, size_t n_blocks, ScanMasks * masks);
+
+#if defined(__SSE2__)
+	void scan_blocks_sse2(char const * data, size_t n_blocks, ScanMasks * masks);
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+	void scan_blocks_avx2(char const * data, size_t n_blocks, ScanMasks * masks);
+
+	bool cpu_has_avx2();
+#endif
+
+	// The fastest block scanner supported by the CPU, selected at runtime
+	ScanBlocksFn scan_blocks_impl();
+
+};
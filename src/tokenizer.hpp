@@ -0,0 +1,365 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+
+/*
+ * Copyright (C) 2023 Alex David <flu0r1ne@flu0r1ne.net>
+ */
+
+#pragma once
+
+#include <string_view>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#include "scanner.hpp"
+
+namespace wg2nd {
+
+	constexpr bool _is_config_space(char c) {
+		return c == ' ' or c == '\t' or c == '\r';
+	}
+
+	constexpr std::string_view _trim(std::string_view s) {
+		size_t begin = 0, end = s.size();
+
+		while(begin < end and _is_config_space(s[begin])) {
+			begin++;
+		}
+
+		while(end > begin and _is_config_space(s[end - 1])) {
+			end--;
+		}
+
+		return s.substr(begin, end - begin);
+	}
+
+	// Tokenizer for wg-quick(8) configuration files
+	//
+	// The tokenizer operates on one contiguous buffer and hands out views
+	// into it. Comments and surrounding whitespace are removed, but nothing
+	// is copied; the views remain valid as long as the input buffer does.
+	//
+	// Token boundaries are located with a vectorized block scanner which
+	// classifies SCAN_BLOCK_SIZE bytes at a time (see scanner.hpp).
+	class ConfigTokenizer {
+
+		public:
+
+			enum class TokenType {
+				// [Section]
+				SECTION,
+				// Key = Value
+				KEY_VALUE,
+				// A non-empty line which is neither a section nor a key-value pair
+				INVALID,
+			};
+
+			struct Token {
+				TokenType type;
+				uint64_t line_no;
+				// For SECTION, the name of the section (without brackets)
+				// For KEY_VALUE, the key
+				// For INVALID, the entire line (without comments)
+				std::string_view key;
+				std::string_view value;
+			};
+
+			ConfigTokenizer(std::string_view input, ScanBlocksFn scan_blocks = scan_blocks_impl())
+				: _input { input }
+				, _scan_blocks { scan_blocks }
+				, _pos { 0 }
+				, _line_no { 0 }
+				, _chunk_begin { 0 }
+				, _chunk_end { 0 }
+			{}
+
+			// Advance to the next non-empty line, returning false at the
+			// end of the input
+			bool next(Token & token) {
+				size_t const size = _input.size();
+
+				while(_pos < size) {
+					size_t begin = _pos;
+					bool found;
+
+					// The masks of the 64 bytes following the start of the line
+					ScanMasks window;
+					_window(begin, window);
+
+					// The end of the input terminates the last line
+					uint64_t newline = window.newline;
+					if(size - begin < SCAN_BLOCK_SIZE) {
+						newline |= uint64_t(1) << (size - begin);
+					}
+
+					if(newline) {
+						size_t len = std::countr_zero(newline);
+						_pos = begin + len + 1;
+						found = _split_window(token, window, begin, len);
+					} else {
+						size_t eol = _find(&ScanMasks::newline, begin, size);
+						_pos = eol + 1;
+						found = _split(token, begin, eol);
+					}
+
+					_line_no++;
+
+					if(found) {
+						token.line_no = _line_no;
+						return true;
+					}
+				}
+
+				return false;
+			}
+
+		private:
+
+			using MaskType = uint64_t ScanMasks::*;
+
+			// Bits [lo, hi) of a block mask, for lo <= hi < SCAN_BLOCK_SIZE
+			static uint64_t _bits(size_t lo, size_t hi) {
+				return ((uint64_t(1) << hi) - 1) & (~uint64_t(0) << lo);
+			}
+
+			// The masks of bytes [pos, pos + SCAN_BLOCK_SIZE), assembled from
+			// the blocks which they straddle
+			void _window(size_t pos, ScanMasks & window) {
+				size_t block = pos / SCAN_BLOCK_SIZE;
+				size_t shift = pos % SCAN_BLOCK_SIZE;
+
+				window = _masks(block);
+
+				if(shift == 0) {
+					return;
+				}
+
+				ScanMasks next = {};
+				if((block + 1) * SCAN_BLOCK_SIZE < _input.size()) {
+					next = _masks(block + 1);
+				}
+
+				auto combine = [shift](uint64_t lo, uint64_t hi) {
+					return (lo >> shift) | (hi << (SCAN_BLOCK_SIZE - shift));
+				};
+
+				window.newline = combine(window.newline, next.newline);
+				window.comment = combine(window.comment, next.comment);
+				window.equals = combine(window.equals, next.equals);
+				window.bracket = combine(window.bracket, next.bracket);
+				window.space = combine(window.space, next.space);
+			}
+
+			// Tokenize a line shorter than SCAN_BLOCK_SIZE (the common case) using
+			// only the masks of the window which begins at the line
+			bool _split_window(Token & token, ScanMasks const & m, size_t base, size_t len) {
+				uint64_t line = _bits(0, len);
+
+				// Remove content exceeding a comment
+				uint64_t comment = line & m.comment;
+				if(comment) {
+					line &= (comment & -comment) - 1;
+				}
+
+				// Ignore empty lines
+				uint64_t text = line & ~m.space;
+				if(!text) {
+					return false;
+				}
+
+				size_t first = std::countr_zero(text);
+				size_t last = SCAN_BLOCK_SIZE - 1 - std::countl_zero(text);
+
+				size_t begin = base + first;
+				size_t end = base + last + 1;
+
+				if(last > first and (m.bracket >> first) & 1 and _input[end - 1] == ']') {
+					token.type = TokenType::SECTION;
+					token.key = _trim(_input.substr(begin + 1, end - begin - 2));
+					token.value = {};
+					return true;
+				}
+
+				uint64_t equals = line & m.equals;
+				if(!equals) {
+					token.type = TokenType::INVALID;
+					token.key = _input.substr(begin, end - begin);
+					token.value = {};
+					return true;
+				}
+
+				size_t split = std::countr_zero(equals);
+
+				uint64_t key = text & _bits(0, split);
+				uint64_t value = text & (~uint64_t(0) << split << 1);
+
+				size_t key_end = key ? base + SCAN_BLOCK_SIZE - std::countl_zero(key) : begin;
+				size_t value_begin = value ? base + std::countr_zero(value) : end;
+
+				token.type = TokenType::KEY_VALUE;
+				token.key = _input.substr(begin, key_end - begin);
+				token.value = _input.substr(value_begin, end - value_begin);
+				return true;
+			}
+
+			// Tokenize a line of any length
+			bool _split(Token & token, size_t begin, size_t eol) {
+				// Remove content exceeding a comment, and surrounding whitespace
+				size_t end = _find(&ScanMasks::comment, begin, eol);
+				begin = _skip_space(begin, end);
+				end = _skip_space_reverse(begin, end);
+
+				// Ignore empty lines
+				if(begin == end) {
+					return false;
+				}
+
+				token.value = {};
+
+				if(end - begin >= 2 and _is(&ScanMasks::bracket, begin) and _input[end - 1] == ']') {
+					token.type = TokenType::SECTION;
+					token.key = _trim(_input.substr(begin + 1, end - begin - 2));
+					return true;
+				}
+
+				size_t equals = _find(&ScanMasks::equals, begin, end);
+				if(equals == end) {
+					token.type = TokenType::INVALID;
+					token.key = _input.substr(begin, end - begin);
+					return true;
+				}
+
+				size_t key_end = _skip_space_reverse(begin, equals);
+				size_t value_begin = _skip_space(equals + 1, end);
+
+				token.type = TokenType::KEY_VALUE;
+				token.key = _input.substr(begin, key_end - begin);
+				token.value = _input.substr(value_begin, end - value_begin);
+				return true;
+			}
+
+			// Blocks are classified CHUNK_BLOCKS at a time
+			static constexpr size_t CHUNK_BLOCKS = 32;
+
+			ScanMasks const & _masks(size_t block) {
+				if(block < _chunk_begin or block >= _chunk_end) {
+					_scan_chunk(block);
+				}
+
+				return _chunk[block - _chunk_begin];
+			}
+
+			void _scan_chunk(size_t block) {
+				size_t offset = block * SCAN_BLOCK_SIZE;
+				size_t full_blocks = (_input.size() - offset) / SCAN_BLOCK_SIZE;
+				size_t n = full_blocks < CHUNK_BLOCKS ? full_blocks : CHUNK_BLOCKS;
+
+				_scan_blocks(_input.data() + offset, n, _chunk);
+
+				if(n < CHUNK_BLOCKS) {
+					// The final block is padded with zeros
+					char padded[SCAN_BLOCK_SIZE] = {};
+					std::memcpy(padded, _input.data() + offset + n * SCAN_BLOCK_SIZE, _input.size() - offset - n * SCAN_BLOCK_SIZE);
+					_scan_blocks(padded, 1, _chunk + n);
+					n++;
+				}
+
+				_chunk_begin = block;
+				_chunk_end = block + n;
+			}
+
+			bool _is(MaskType type, size_t pos) {
+				return (_masks(pos / SCAN_BLOCK_SIZE).*type >> (pos % SCAN_BLOCK_SIZE)) & 1;
+			}
+
+			// Position of the first character of the given type in [from, limit),
+			// or limit if none exists
+			size_t _find(MaskType type, size_t from, size_t limit, bool invert = false) {
+				while(from < limit) {
+					uint64_t bits = _masks(from / SCAN_BLOCK_SIZE).*type;
+					if(invert) {
+						bits = ~bits;
+					}
+					bits >>= from % SCAN_BLOCK_SIZE;
+
+					if(bits) {
+						size_t pos = from + std::countr_zero(bits);
+						return pos < limit ? pos : limit;
+					}
+
+					from = (from / SCAN_BLOCK_SIZE + 1) * SCAN_BLOCK_SIZE;
+				}
+
+				return limit;
+			}
+
+			size_t _skip_space(size_t from, size_t limit) {
+				return _find(&ScanMasks::space, from, limit, true);
+			}
+
+			// One past the last non-whitespace character in [begin, end),
+			// or begin if there is none
+			size_t _skip_space_reverse(size_t begin, size_t end) {
+				while(end > begin) {
+					size_t last = end - 1;
+					size_t block = last / SCAN_BLOCK_SIZE;
+
+					uint64_t bits = ~_masks(block).space;
+					bits &= ~uint64_t(0) >> (SCAN_BLOCK_SIZE - 1 - last % SCAN_BLOCK_SIZE);
+
+					if(bits) {
+						size_t pos = block * SCAN_BLOCK_SIZE + (SCAN_BLOCK_SIZE - 1 - std::countl_zero(bits));
+						return pos >= begin ? pos + 1 : begin;
+					}
+
+					end = block * SCAN_BLOCK_SIZE;
+				}
+
+				return begin;
+			}
+
+			std::string_view _input;
+			ScanBlocksFn _scan_blocks;
+			size_t _pos;
+			uint64_t _line_no;
+
+			// The masks of blocks [_chunk_begin, _chunk_end)
+			size_t _chunk_begin;
+			size_t _chunk_end;
+			ScanMasks _chunk[CHUNK_BLOCKS];
+	};
+
+	// Splits a comma-separated value into its (trimmed, non-empty) items
+	class ItemSplitter {
+
+		public:
+
+			ItemSplitter(std::string_view value)
+				: _value { value }
+				, _pos { 0 }
+			{}
+
+			bool next(std::string_view & item) {
+				while(_pos <= _value.size()) {
+					size_t comma = _value.find(',', _pos);
+					if(comma == std::string_view::npos) {
+						comma = _value.size();
+					}
+
+					item = _trim(_value.substr(_pos, comma - _pos));
+					_pos = comma + 1;
+
+					if(!item.empty()) {
+						return true;
+					}
+				}
+
+				return false;
+			}
+
+		private:
+			std::string_view _value;
+			size_t _pos;
+	};
+
+};
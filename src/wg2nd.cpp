@@ -7,13 +7,23 @@
 #include "wg2nd.hpp"
 
 #include <exception>
-#include <sstream>
+#include <stdexcept>
 #include <random>
-#include <regex>
+#include <iterator>
+#include <charconv>
+#include <algorithm>
+#include <bit>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <string_view>
 
+#include "tokenizer.hpp"
+#include "keys.hpp"
 #include "crypto/pubkey.hpp"
+#include "version.hpp"
 
 extern "C" {
 	#include "crypto/halfsiphash.h"
@@ -24,7 +34,7 @@ constexpr char const * SYMMETRIC_KEY_SUFFIX = ".symkey";
 
 
 namespace wg2nd {
-	std::string private_keyfile_name(std::string const & priv_key) {
+	std::string private_keyfile_name(std::pmr::string const & priv_key) {
 		char pub_key[WG_KEY_LEN_BASE32];
 
 		// Derive public key
@@ -38,11 +48,42 @@ namespace wg2nd {
 		return keyfile_name;
 	}
 
-	std::string public_keyfile_name(std::string const & pub_key) {
+	std::vector<std::optional<std::string>> private_keyfile_names(std::span<std::string const> priv_keys) {
+		std::vector<char const *> keys;
+		keys.reserve(priv_keys.size());
+
+		for(std::string const & priv_key : priv_keys) {
+			keys.push_back(priv_key.c_str());
+		}
+
+		std::vector<std::array<char, WG_KEY_LEN_BASE32>> pub_keys(priv_keys.size());
+
+		wg_pubkey_base32_batch(keys.data(), reinterpret_cast<char (*)[WG_KEY_LEN_BASE32]>(pub_keys.data()), keys.size());
+
+		std::vector<std::optional<std::string>> keyfile_names;
+		keyfile_names.reserve(priv_keys.size());
+
+		for(std::array<char, WG_KEY_LEN_BASE32> const & pub_key : pub_keys) {
+			// Improperly formatted keys are left empty
+			if(pub_key[0] == '\0') {
+				keyfile_names.push_back(std::nullopt);
+				continue;
+			}
+
+			std::string keyfile_name { pub_key.data() };
+			keyfile_name.append(PRIVATE_KEY_SUFFIX);
+
+			keyfile_names.push_back(std::move(keyfile_name));
+		}
+
+		return keyfile_names;
+	}
+
+	std::string public_keyfile_name(std::pmr::string const & pub_key) {
 		char pub_key32[WG_KEY_LEN_BASE32];
 
 		if(wg_key_convert_base32(pub_key.c_str(), pub_key32)) {
-			throw ParsingException("Public key for [Peer] " + pub_key + " is formatted improperly");
+			throw ParsingException(std::string("Public key for [Peer] ").append(pub_key).append(" is formatted improperly"));
 		}
 
 		std::string keyfile_name { pub_key32 };
@@ -72,578 +113,2769 @@ namespace wg2nd {
 		return interface_name;
 	}
 
-	bool _is_default_route(std::string const & cidr) {
-		static std::regex ipv4_wildcard("0(\\.0){0,3}\\/0");
-		static std::regex ipv6_wildcard("(0{0,4}:){0,7}0{0,4}\\/0{1,4}");
-		
-		return std::regex_match(cidr, ipv4_wildcard) or std::regex_match(cidr, ipv6_wildcard);
+	static int _hex_digit(char c) {
+		if(c >= '0' and c <= '9') {
+			return c - '0';
+		} else if(c >= 'a' and c <= 'f') {
+			return c - 'a' + 10;
+		} else if(c >= 'A' and c <= 'F') {
+			return c - 'A' + 10;
+		}
+
+		return -1;
 	}
 
-	bool _is_ipv4_route(std::string const & cidr) {
-		static std::regex ipv4("\\d{1,3}(\\.\\d{1,3}){0,3}(\\/\\d{1,2})?");
+	// Parse a dotted-decimal IPv4 address. If shorthand is permitted, fewer than four
+	// components may be specified, in which case the last component fills the
+	// remaining bytes as in inet_aton(3) (e.g. 10.1 is 10.0.0.1)
+	static bool _parse_ipv4(std::string_view s, uint8_t * addr, bool shorthand) {
+		uint64_t components[4];
+		size_t n = 0, pos = 0;
 
-		return std::regex_match(cidr, ipv4);
-	}
+		while(true) {
+			if(n == 4) {
+				return false;
+			}
 
-	std::string_view _get_addr(std::string_view const & cidr) {
-		size_t suffix = cidr.rfind('/');
+			size_t start = pos;
+			uint64_t value = 0;
 
-		if(suffix == std::string::npos) {
-			return cidr;
-		} else {
-			return cidr.substr(0, suffix);
+			while(pos < s.size() and pos - start < 10 and s[pos] >= '0' and s[pos] <= '9') {
+				value = value * 10 + (s[pos] - '0');
+				pos++;
+			}
+
+			if(pos == start) {
+				return false;
+			}
+
+			components[n++] = value;
+
+			if(pos == s.size()) {
+				break;
+			}
+
+			if(s[pos] != '.') {
+				return false;
+			}
+
+			pos++;
+		}
+
+		if(n != 4 and !shorthand) {
+			return false;
+		}
+
+		for(size_t i = 0; i < n - 1; i++) {
+			if(components[i] > 0xff) {
+				return false;
+			}
+			addr[i] = components[i];
+		}
+
+		// The final component spans the remaining bytes
+		size_t width = 4 - (n - 1);
+		uint64_t last = components[n - 1];
+
+		if(last >> (8 * width)) {
+			return false;
+		}
+
+		for(size_t i = 4; i-- > n - 1; ) {
+			addr[i] = last & 0xff;
+			last >>= 8;
 		}
+
+		return true;
 	}
 
-	constexpr uint32_t MAIN_TABLE = 254;
-	constexpr uint32_t LOCAL_TABLE = 255;
+	// Parse an IPv6 address (RFC 4291 text representation), including the
+	// "::" shorthand and a trailing dotted-decimal IPv4 address
+	static bool _parse_ipv6(std::string_view s, uint8_t * addr) {
+		uint16_t groups[8] = {};
+		size_t n = 0, pos = 0;
+		int gap = -1;
+
+		if(s.starts_with("::")) {
+			gap = 0;
+			pos = 2;
+		} else if(s.starts_with(":")) {
+			return false;
+		}
 
-	// Parse the wireguard configuration from an input stream
-	// into a Config object. If an invalid key or section occurs,
-	// exists, a ParsingException is thrown.
-	Config parse_config(std::string const & interface_name, std::istream & stream) {
-		Config cfg;
+		while(pos < s.size()) {
+			if(n == 8) {
+				return false;
+			}
 
-		cfg.intf.name = interface_name;
-		cfg.has_default_route = false;
-		cfg.intf.should_create_routes = true;
+			size_t start = pos;
+			uint32_t value = 0;
+			int digit;
 
-		std::string line;
-		uint64_t line_no = 0;
+			while(pos < s.size() and pos - start < 4 and (digit = _hex_digit(s[pos])) >= 0) {
+				value = (value << 4) | digit;
+				pos++;
+			}
 
-		enum class Section {
-			Interface,
-			Peer,
-			None
-		};
+			// Embedded IPv4 address (e.g. ::ffff:10.0.0.1) in the last two groups
+			if(pos < s.size() and s[pos] == '.') {
+				uint8_t ipv4[4];
 
-		Section section = Section::None;
+				if(n > 6 or !_parse_ipv4(s.substr(start), ipv4, false)) {
+					return false;
+				}
 
-		bool peer_has_default_route = false;
+				groups[n++] = (ipv4[0] << 8) | ipv4[1];
+				groups[n++] = (ipv4[2] << 8) | ipv4[3];
+				pos = s.size();
+				break;
+			}
+
+			if(pos == start) {
+				return false;
+			}
 
-		while (std::getline(stream, line)) {
-			++line_no;
+			groups[n++] = value;
 
-			// Strip whitespace (\t) from line in-place
-			{
-				size_t i = 0, j = 0;
-				for(; i < line.size(); i++) {
-					if(line[i] != ' ' and line[i] != '\t' and line[i] != '\r') {
-						line[j] = line[i];
-						j++;
-					}
+			if(pos == s.size()) {
+				break;
+			}
+
+			if(s[pos] != ':') {
+				return false;
+			}
+
+			pos++;
+
+			if(pos < s.size() and s[pos] == ':') {
+				if(gap >= 0) {
+					return false;
 				}
-				line.erase(j);
+
+				gap = n;
+				pos++;
+			} else if(pos == s.size()) {
+				return false;
 			}
+		}
+
+		if(gap < 0 ? n != 8 : n > 7) {
+			return false;
+		}
+
+		// Expand "::" to the missing groups
+		size_t shift = 8 - n;
+		for(size_t i = 8; gap >= 0 and i-- > (size_t) gap + shift; ) {
+			groups[i] = groups[i - shift];
+		}
+		for(size_t i = gap; gap >= 0 and i < (size_t) gap + shift; i++) {
+			groups[i] = 0;
+		}
+
+		for(size_t i = 0; i < 8; i++) {
+			addr[2 * i] = groups[i] >> 8;
+			addr[2 * i + 1] = groups[i] & 0xff;
+		}
+
+		return true;
+	}
+
+	std::optional<Cidr> parse_cidr(std::string_view text) {
+		Cidr prefix {};
+
+		size_t slash = text.find('/');
+		std::string_view addr = text.substr(0, slash);
+
+		uint8_t max_prefix_len;
 
-			// Remove content exceeding a comment
-			size_t comment_start = line.find('#');
-			if(comment_start != std::string::npos) {
-				line.erase(comment_start);
+		if(addr.find(':') != std::string_view::npos) {
+			prefix.family = AddressFamily::IPV6;
+			max_prefix_len = 128;
+
+			if(!_parse_ipv6(addr, prefix.addr.data())) {
+				return {};
 			}
+		} else {
+			prefix.family = AddressFamily::IPV4;
+			max_prefix_len = 32;
 
-			// Ignore empty lines
-			if (line.empty()) {
-				continue;
+			if(!_parse_ipv4(addr, prefix.addr.data(), true)) {
+				return {};
 			}
+		}
 
-			// Handle section: [Interface] or [Peer] specifies further
-			// configuration concerns an interface or peer respectively
-			
-			bool interface_sec_wanted = line == "[Interface]";
-			bool peer_sec_wanted = line == "[Peer]";
+		prefix.prefix_len = max_prefix_len;
 
-			if(interface_sec_wanted || peer_sec_wanted) {
-				cfg.has_default_route = cfg.has_default_route or peer_has_default_route;
-				peer_has_default_route = false;
+		if(slash != std::string_view::npos) {
+			std::string_view len = text.substr(slash + 1);
+			uint32_t value = 0;
+
+			if(len.empty() or len.size() > 3) {
+				return {};
 			}
 
-			if (interface_sec_wanted) {
-				section = Section::Interface;
-				continue;
-			} else if (peer_sec_wanted) {
-				section = Section::Peer;
-				cfg.peers.emplace_back();
-				continue;
+			for(char c : len) {
+				if(c < '0' or c > '9') {
+					return {};
+				}
+				value = value * 10 + (c - '0');
 			}
 
-			// Split key
-			size_t pos = line.find('=');
-			if(pos == std::string::npos) {
-				throw ParsingException("Expected key-value pair, got \"" + line + "\"", line_no);
+			if(value > max_prefix_len) {
+				return {};
 			}
 
-			std::string key = line.substr(0, pos);
-			std::string value = line.substr(pos + 1);
+			prefix.prefix_len = value;
+		}
 
-			// Read keys according to corresponding section
-			switch (section) {
-			case Section::Interface: {
-				if (key == "PrivateKey") {
-					cfg.intf.private_key = value;
-				} else if (key == "DNS") {
-					std::istringstream dnsStream(value);
-					std::string dnsIp;
-					while (std::getline(dnsStream, dnsIp, ',')) {
-						cfg.intf.DNS.push_back(dnsIp);
-					}
-				} else if (key == "Address") {
-					std::istringstream addressStream(value);
-					std::string address;
-					while (std::getline(addressStream, address, ',')) {
-						cfg.intf.addresses.push_back(address);
-					}
-				} else if (key == "Table") {
-					if(value == "off") {
-						cfg.intf.table = 0;
-						cfg.intf.should_create_routes = false;
-					} else {
-						cfg.intf.should_create_routes = true;
-						if(value == "auto") {
-							cfg.intf.table = 0;
-						} else if(value == "main") {
-							cfg.intf.table = MAIN_TABLE;
-						} else if(value == "local") {
-							cfg.intf.table = LOCAL_TABLE;
-						} else {
-							long long table;
-							try {
-								table = std::stoll(value);
-							} catch(std::exception const & e) {
-								table = -1;
-							}
+		return prefix;
+	}
 
-							if(table < 1 || table > UINT32_MAX) {
-								throw ParsingException("Invalid option to \"Table\", must be one of \"off\", \"auto\" or a table number", line_no);
-							}
+	bool _is_default_route(std::string const & cidr) {
+		std::optional<Cidr> prefix = parse_cidr(cidr);
 
-							cfg.intf.table = table;
-						}
-					}
-				} else if (key == "ListenPort") {
-					int port;
-					try {
-						port = std::stoi(value);
-					} catch(std::exception & e) {
-						port = -1;
-					}
+		return prefix.has_value() and prefix->is_default_route();
+	}
 
-					if(port < 0 || port > UINT16_MAX) {
-						throw ParsingException("Invalid port: " + key, line_no);
-					}
+	bool _is_ipv4_route(std::string const & cidr) {
+		std::optional<Cidr> prefix = parse_cidr(cidr);
 
-					cfg.intf.listen_port = port;
-				} else if (key == "MTU") {
-					cfg.intf.mtu = value;
-				} else if (key == "PreUp") {
-					cfg.intf.preup = value;
-				} else if (key == "PostUp") {
-					cfg.intf.postup = value;
-				} else if (key == "PreDown") {
-					cfg.intf.predown = value;
-				} else if (key == "PostDown") {
-					cfg.intf.postdown = value;
-				} else if (key == "SaveConfig") {
-					cfg.intf.save_config = value;
-				} else {
-					throw ParsingException("Invalid key in [Interface] section: " + key, line_no);
+		return prefix.has_value() and prefix->is_ipv4();
+	}
+
+	size_t Cidr::format(char * buf, bool with_prefix) const {
+		char * p = buf;
+
+		auto write_decimal = [&p](uint32_t value) {
+			p = std::to_chars(p, p + 3, value).ptr;
+		};
+
+		auto write_ipv4 = [&p, &write_decimal](uint8_t const * bytes) {
+			for(size_t i = 0; i < 4; i++) {
+				if(i) {
+					*p++ = '.';
 				}
-				break;
+				write_decimal(bytes[i]);
 			}
-			case Section::Peer: {
-				if (key == "Endpoint") {
-					cfg.peers.back().endpoint = value;
-				} else if (key == "AllowedIPs") {
-					std::istringstream allowedIpsStream(value);
-					std::string allowedIp;
+		};
 
-					while (std::getline(allowedIpsStream, allowedIp, ',')) {
-						bool is_default_route = _is_default_route(allowedIp);
+		if(is_ipv4()) {
+			write_ipv4(addr.data());
+		} else {
+			uint16_t groups[8];
+			for(size_t i = 0; i < 8; i++) {
+				groups[i] = (addr[2 * i] << 8) | addr[2 * i + 1];
+			}
 
-						if(is_default_route and cfg.has_default_route) {
-							throw ParsingException("Default routes exist on multiple peers");
-						}
-						
-						cfg.peers.back().allowed_ips.push_back(Cidr {
-							.route = allowedIp,
-							.is_default_route = is_default_route,
-							.is_ipv4 = _is_ipv4_route(allowedIp),
-						});
+			// Find the longest run of two or more zero groups (the first, if tied)
+			int run_start = -1, run_len = 0;
+			for(int i = 0; i < 8; ) {
+				int j = i;
+				while(j < 8 and groups[j] == 0) {
+					j++;
+				}
 
-						peer_has_default_route = peer_has_default_route or is_default_route;
-					}
+				if(j - i > run_len and j - i >= 2) {
+					run_start = i;
+					run_len = j - i;
+				}
 
-				} else if (key == "PublicKey") {
-					cfg.peers.back().public_key = value;
-				} else if (key == "PersistentKeepalive") {
-					cfg.peers.back().persistent_keepalive = value;
-				} else if (key == "PresharedKey") {
-					cfg.peers.back().preshared_key = value;
-				} else {
-					throw ParsingException("Invalid key in [Peer] section: " + key, line_no);
+				i = j == i ? i + 1 : j;
+			}
+
+			// IPv4-mapped addresses are written with a dotted quad (::ffff:10.0.0.1)
+			bool mapped = run_start == 0 and run_len == 5 and groups[5] == 0xffff;
+			int n_groups = mapped ? 6 : 8;
+
+			for(int i = 0; i < n_groups; i++) {
+				if(i == run_start) {
+					*p++ = ':';
+					*p++ = ':';
+					i += run_len - 1;
+					continue;
 				}
-				break;
+
+				if(i and i != run_start + run_len) {
+					*p++ = ':';
+				}
+
+				p = std::to_chars(p, p + 4, groups[i], 16).ptr;
 			}
-			case Section::None:
-				throw ParsingException("Unexpected key outside of section: " + key, line_no);
+
+			if(mapped) {
+				*p++ = ':';
+				write_ipv4(addr.data() + 12);
 			}
 		}
 
-		cfg.has_default_route = cfg.has_default_route or peer_has_default_route;
+		if(with_prefix) {
+			*p++ = '/';
+			write_decimal(prefix_len);
+		}
 
-#define MissingField(section, key) \
-	ConfigurationException("[" section "] section missing essential field \"" key "\"")
+		return p - buf;
+	}
 
-		// Ensure PrivateKey, Address, PublicKey, and AllowedIPs are present
+	std::string Cidr::to_string(bool with_prefix) const {
+		char buf[MAX_TEXT_LEN];
 
-		if(cfg.intf.private_key.empty()) {
-			throw MissingField("Interface", "PrivateKey");
-		}
+		return std::string(buf, format(buf, with_prefix));
+	}
 
-		if(cfg.intf.addresses.empty()) {
-			throw MissingField("Interface", "Address");
-		}
+	// Clear the address bits past the prefix
+	static void _clear_host_bits(Cidr & cidr) {
+		for(size_t i = 0; i < cidr.addr.size(); i++) {
+			int bits = int(cidr.prefix_len) - int(i * 8);
 
-		for(Peer const & peer : cfg.peers) {
-			if(peer.public_key.empty()) {
-				throw MissingField("Peer", "PublicKey");
+			if(bits <= 0) {
+				cidr.addr[i] = 0;
+			} else if(bits < 8) {
+				cidr.addr[i] &= uint8_t(0xff << (8 - bits));
 			}
+		}
+	}
 
-			if(peer.allowed_ips.empty()) {
-				throw MissingField("Peer", "AllowedIPs");
-			}
+	// If outer covers every address of inner, for outer without host bits
+	static bool _contains(Cidr const & outer, Cidr const & inner) {
+		if(outer.family != inner.family or outer.prefix_len > inner.prefix_len) {
+			return false;
 		}
 
-#undef MissingField
+		Cidr masked = inner;
+		masked.prefix_len = outer.prefix_len;
+		_clear_host_bits(masked);
 
-		return cfg;
+		return masked.addr == outer.addr;
 	}
 
-	static void _write_table(std::stringstream & firewall, Config const & cfg, std::vector<std::string_view> addrs, bool ipv4, uint32_t fwd_table) {
-		char const * ip = ipv4 ? "ip" : "ip6";
+	// The prefix one bit shorter than cidr
+	static Cidr _parent(Cidr const & cidr) {
+		Cidr parent = cidr;
+		parent.prefix_len--;
+		_clear_host_bits(parent);
+		return parent;
+	}
 
-		firewall << "table " << ip << " " << cfg.intf.name << " {\n"
-		         << "  chain preraw {\n"
-		         << "    type filter hook prerouting priority raw; policy accept;\n";
+	// If lower and upper are the two halves of one prefix
+	static bool _are_siblings(Cidr const & lower, Cidr const & upper) {
+		return lower.family == upper.family
+			and lower.prefix_len == upper.prefix_len
+			and lower.prefix_len > 0
+			and lower.addr != upper.addr
+			and _parent(lower).addr == _parent(upper).addr;
+	}
 
-		for(std::string_view const & addr : addrs) {
-			firewall << "    iifname != \"" << cfg.intf.name << "\" " << ip << " daddr " << addr << " fib saddr type != local drop;\n";
+	std::vector<Cidr> coalesce_routes(std::vector<Cidr> routes) {
+		for(Cidr & route : routes) {
+			_clear_host_bits(route);
 		}
 
-		firewall << "  }\n"
-		         << "\n"
-		         << "  chain premangle {\n"
-		         << "    type filter hook prerouting priority mangle; policy accept;\n"
-		         << "    meta l4proto udp meta mark set ct mark;\n"
-		         << "  }\n"
-		         << "\n"
-		         << "  chain postmangle {\n"
-		         << "    type filter hook postrouting priority mangle; policy accept;\n"
-		         << "    meta l4proto udp meta mark 0x" << std::hex << fwd_table << std::dec << " ct mark set meta mark;\n"
-		         << "  }\n"
-		         << "}\n";
-		
-	}
+		// A prefix sorts after any prefix which contains it
+		std::sort(routes.begin(), routes.end());
+
+		// The stack remains sorted and disjoint, so a route can only be
+		// contained by, or the sibling of, the top
+		std::vector<Cidr> coalesced;
 
-	std::string _gen_nftables_firewall(Config const & cfg, uint32_t fwd_table) {
-		std::stringstream firewall;
+		for(Cidr const & route : routes) {
+			if(!coalesced.empty() and _contains(coalesced.back(), route)) {
+				continue;
+			}
 
-		std::vector<std::string_view> ipv4_addrs;
-		std::vector<std::string_view> ipv6_addrs;
+			coalesced.push_back(route);
 
-		for(std::string const & addr : cfg.intf.addresses) {
-			if(_is_ipv4_route(addr)) {
-				ipv4_addrs.push_back(_get_addr(addr));
-			} else {
-				ipv6_addrs.push_back(_get_addr(addr));
+			while(coalesced.size() >= 2 and _are_siblings(coalesced[coalesced.size() - 2], coalesced.back())) {
+				coalesced.pop_back();
+				coalesced.back() = _parent(coalesced.back());
 			}
 		}
 
-		if(ipv4_addrs.size() > 0) {
-			_write_table(firewall, cfg, ipv4_addrs, true, fwd_table);
-			firewall << "\n";
-		}
+		return coalesced;
+	}
 
-		if(ipv6_addrs.size() > 0) {
-			_write_table(firewall, cfg, ipv6_addrs, false, fwd_table);
+	AllowedIPsTrie::AllowedIPsTrie()
+		: _roots { NIL, NIL }
+		, _n_peers { 0 }
+		, _n_conflicts { 0 }
+	{
+		for(uint32_t & root : _roots) {
+			root = _new_node(Key {}, 0, NIL, false);
 		}
+	}
+
+	// The bit of key at index, counting from the most significant
+	static bool _key_bit(std::array<uint64_t, 2> const & key, uint8_t index) {
+		return (key[index / 64] >> (63 - index % 64)) & 1;
+	}
 
-		return firewall.str();
+	// The length of the prefix which a and b share, up to limit
+	static uint8_t _common_len(std::array<uint64_t, 2> const & a, std::array<uint64_t, 2> const & b, uint8_t limit) {
+		uint64_t hi = a[0] ^ b[0];
+		uint64_t lo = a[1] ^ b[1];
+		int len = hi ? std::countl_zero(hi) : 64 + std::countl_zero(lo);
+		return uint8_t(std::min<int>(len, limit));
 	}
 
-	static std::string _gen_netdev_cfg(Config const & cfg, uint32_t fwd_table, std::filesystem::path const & private_keyfile,
-			std::filesystem::path const & output_path, std::vector<SystemdFilespec> & symmetric_keyfiles) {
-		std::stringstream netdev;
+	// key with the bits past len cleared
+	static std::array<uint64_t, 2> _key_prefix(std::array<uint64_t, 2> key, uint8_t len) {
+		for(size_t i = 0; i < 2; i++) {
+			int bits = int(len) - int(i * 64);
 
-		netdev << "# Autogenerated by wg2nd\n";
-		netdev << "[NetDev]\n";
-		netdev << "Name = " << cfg.intf.name << "\n";
-		netdev << "Kind = wireguard\n";
-		netdev << "Description = " << cfg.intf.name << " - wireguard tunnel\n";
-		netdev << "\n";
+			if(bits <= 0) {
+				key[i] = 0;
+			} else if(bits < 64) {
+				key[i] &= ~uint64_t(0) << (64 - bits);
+			}
+		}
 
-		netdev << "[WireGuard]\n";
-		netdev << "PrivateKeyFile = " << private_keyfile.string() << "\n";
+		return key;
+	}
+
+	static std::array<uint64_t, 2> _cidr_key(Cidr const & cidr) {
+		std::array<uint64_t, 2> key {};
 
-		if(cfg.intf.listen_port.has_value()) {
-			netdev << "ListenPort = " << cfg.intf.listen_port.value() << "\n";
+		for(size_t i = 0; i < cidr.addr.size(); i++) {
+			key[i / 8] = key[i / 8] << 8 | cidr.addr[i];
 		}
 
-		if(cfg.intf.should_create_routes and cfg.intf.table != 0) {
-			netdev << "RouteTable = ";
+		return _key_prefix(key, cidr.prefix_len);
+	}
 
-			switch(cfg.intf.table) {
-				case LOCAL_TABLE:
-					netdev << "local";
-					break;
-				case MAIN_TABLE:
-					netdev << "main";
-					break;
-				default:
-					netdev << cfg.intf.table;
-					break;
-			}
+	static Cidr _key_cidr(std::array<uint64_t, 2> const & key, uint8_t len, AddressFamily family) {
+		Cidr cidr { .addr = {}, .family = family, .prefix_len = len };
 
-			netdev << "\n";
+		for(size_t i = 0; i < cidr.addr.size(); i++) {
+			cidr.addr[i] = uint8_t(key[i / 8] >> (56 - i % 8 * 8));
 		}
 
-		if(cfg.intf.should_create_routes and cfg.has_default_route) {
-			netdev << "FirewallMark = 0x" << std::hex << fwd_table << std::dec << "\n";
+		return cidr;
+	}
+
+	uint32_t AllowedIPsTrie::_new_node(Key const & key, uint8_t len, uint32_t peer, bool owned) {
+		_nodes.push_back(Node {
+			.key = key,
+			.child = { NIL, NIL },
+			.peer = peer,
+			.subtree_peer = peer,
+			.len = len,
+			.owned = owned,
+			.mixed = false,
+		});
+
+		return uint32_t(_nodes.size() - 1);
+	}
+
+	void AllowedIPsTrie::reserve(size_t n_peers, size_t n_allowed_ips) {
+		// Each prefix adds at most a leaf and the fork above it
+		_nodes.reserve(_nodes.size() + 2 * n_allowed_ips);
+		_public_keys.reserve(n_peers * (WG_KEY_LEN_BASE64 - 1));
+		_public_key_ends.reserve(n_peers);
+	}
+
+	void AllowedIPsTrie::add_peer(std::string_view public_key, std::span<Cidr const> allowed_ips) {
+		_public_keys.append(public_key);
+		_public_key_ends.push_back(uint32_t(_public_keys.size()));
+
+		uint32_t peer = _n_peers++;
+
+		for(Cidr const & cidr : allowed_ips) {
+			if(cidr.prefix_len > 0) {
+				_insert(cidr, peer);
+			}
 		}
+	}
 
-		netdev << "\n";
+	void AllowedIPsTrie::_insert(Cidr const & cidr, uint32_t peer) {
+		Key key = _cidr_key(cidr);
+		uint8_t len = cidr.prefix_len;
+
+		// The nodes above the prefix, whose summaries include it
+		std::array<uint32_t, 130> path;
+		size_t depth = 0;
+
+		// The longest prefix of another peer which contains it
+		uint32_t within = NIL;
+		// A prefix of another peer which it contains
+		uint32_t contains = NIL;
+
+		uint32_t cur = _roots[cidr.is_ipv4() ? 0 : 1];
+
+		for(;;) {
+			Node & node = _nodes[cur];
+
+			if(node.len == len) {
+				if(node.owned and node.peer != peer) {
+					// WireGuard routes the prefix to the last peer. A prefix
+					// containing it is not reported as well.
+					_record(ConflictKind::DUPLICATE, cidr, peer, cur);
+					within = NIL;
+					node.peer = peer;
+
+					// The previous owner may have left this subtree, and
+					// those above it, entirely
+					_summarize(cur);
+					while(depth > 0) {
+						_summarize(path[--depth]);
+					}
+				} else if(!node.owned) {
+					contains = _find_other(cur, peer);
+					node.owned = true;
+					node.peer = peer;
+					node.mixed = node.mixed or node.subtree_peer != peer;
+				}
 
-		for(Peer const & peer : cfg.peers) {
-			netdev << "[WireGuardPeer]\n";
-			netdev << "PublicKey = " << peer.public_key << "\n";
+				break;
+			}
 
-			if(!peer.endpoint.empty()) {
-				netdev << "Endpoint = " << peer.endpoint << "\n";
+			if(node.owned and node.peer != peer) {
+				within = cur;
 			}
 
-			if(!peer.preshared_key.empty()) {
-				std::string filename = public_keyfile_name(peer.public_key);
+			path[depth++] = cur;
 
-				symmetric_keyfiles.push_back(SystemdFilespec {
-					.name = filename,
-					.contents = peer.preshared_key + "\n",
-				});
+			bool bit = _key_bit(key, node.len);
+			uint32_t next = node.child[bit];
 
-				netdev << "PresharedKeyFile = " << (output_path / filename).c_str() << "\n";
+			if(next == NIL) {
+				uint32_t leaf = _new_node(key, len, peer, true);
+				_nodes[cur].child[bit] = leaf;
+				break;
 			}
 
-			for(Cidr const & cidr : peer.allowed_ips) {
-				netdev << "AllowedIPs = " << cidr.route << "\n";
+			Node const & child = _nodes[next];
+			uint8_t common = _common_len(child.key, key, std::min(child.len, len));
+
+			if(common == child.len) {
+				cur = next;
+				continue;
 			}
 
-			if(!peer.persistent_keepalive.empty()) {
-				netdev << "PersistentKeepalive = " << peer.persistent_keepalive << "\n";
+			// The prefix lies on the edge to the child, or the edge forks
+			// where their paths part
+			uint32_t fork;
+			if(common == len) {
+				contains = _find_other(next, peer);
+				fork = _new_node(key, len, peer, true);
+			} else {
+				uint32_t leaf = _new_node(key, len, peer, true);
+				fork = _new_node(_key_prefix(key, common), common, peer, false);
+				_nodes[fork].child[_key_bit(key, common)] = leaf;
 			}
 
-			netdev << "\n";
+			Node const & below = _nodes[next];
+			Node & above = _nodes[fork];
+			above.child[_key_bit(below.key, common)] = next;
+			above.mixed = below.mixed or below.subtree_peer != peer;
+
+			_nodes[cur].child[bit] = fork;
+			break;
 		}
 
-		return netdev.str();
-	}
+		// Only a node with one peer below it, other than this, changes
+		while(depth > 0) {
+			Node & node = _nodes[path[--depth]];
 
-	static std::string_view activation_policy_keyword(ActivationPolicy activation_policy) {
-		switch(activation_policy) {
-			case ActivationPolicy::MANUAL:
-				return "manual";
-			case ActivationPolicy::UP:
-				return "up";
+			if(node.mixed or node.subtree_peer == peer) {
+				break;
+			}
+
+			if(node.subtree_peer == NIL) {
+				node.subtree_peer = peer;
+			} else {
+				node.mixed = true;
+			}
 		}
 
-		return "none";
+		if(within != NIL) {
+			_record(ConflictKind::WITHIN, cidr, peer, within);
+		} else if(contains != NIL) {
+			_record(ConflictKind::CONTAINS, cidr, peer, contains);
+		}
 	}
 
-	static std::string _gen_network_cfg(Config const & cfg, uint32_t fwd_table, ActivationPolicy activation_policy) {
-		std::stringstream network;
+	void AllowedIPsTrie::_summarize(uint32_t i) {
+		Node & node = _nodes[i];
 
-		network << "# Autogenerated by wg2nd\n";
-		network << "[Match]\n";
-		network << "Name = " << cfg.intf.name << "\n";
-		network << "\n";
+		node.subtree_peer = node.owned ? node.peer : NIL;
+		node.mixed = false;
 
-		network << "[Link]" << "\n";
+		for(uint32_t child : node.child) {
+			if(child == NIL) {
+				continue;
+			}
 
-		network << "ActivationPolicy = " << activation_policy_keyword(activation_policy) << "\n";
+			Node const & below = _nodes[child];
 
-		if(!cfg.intf.mtu.empty()) {
-			network << "MTUBytes = " << cfg.intf.mtu << "\n";
+			if(below.mixed or (node.subtree_peer != NIL and below.subtree_peer != node.subtree_peer)) {
+				node.mixed = true;
+			} else {
+				node.subtree_peer = below.subtree_peer;
+			}
 		}
-		network << "\n";
+	}
 
-		network << "[Network]\n";
-		for(std::string const & addr : cfg.intf.addresses) {
-			network << "Address = " << addr << "\n";
-		}
+	uint32_t AllowedIPsTrie::_find_other(uint32_t cur, uint32_t peer) const {
+		// The summaries lead to a prefix of another peer without backtracking
+		auto has_other = [&](uint32_t i) {
+			return i != NIL and (_nodes[i].mixed or (_nodes[i].subtree_peer != NIL and _nodes[i].subtree_peer != peer));
+		};
 
-		for(std::string const & dns : cfg.intf.DNS) {
-			network << "DNS = " << dns << "\n";
+		if(!has_other(cur)) {
+			return NIL;
 		}
 
-		if(cfg.has_default_route and cfg.intf.DNS.size() > 0) {
-			network << "Domains = ~." << "\n";
-		}
+		for(;;) {
+			Node const & node = _nodes[cur];
 
-		network << "\n";
+			if(node.owned and node.peer != peer) {
+				return cur;
+			}
 
-		if(!cfg.intf.should_create_routes) {
-			return network.str();
+			cur = has_other(node.child[0]) ? node.child[0] : node.child[1];
 		}
+	}
 
-		constexpr uint8_t POLICY_ROUTE_NONE = 0;
-		constexpr uint8_t POLICY_ROUTE_V4 = 1 << 0;
-		constexpr uint8_t POLICY_ROUTE_V6 = 1 << 1;
-		constexpr uint8_t POLICY_ROUTE_BOTH = POLICY_ROUTE_V4 | POLICY_ROUTE_V6;
+	void AllowedIPsTrie::_record(ConflictKind kind, Cidr const & prefix, uint32_t peer, uint32_t other) {
+		_n_conflicts++;
 
-		uint8_t policy_route = POLICY_ROUTE_NONE;
+		if(_conflicts.size() < MAX_REPORTED) {
+			Node const & node = _nodes[other];
 
-		for(Peer const & peer : cfg.peers) {
-			for(Cidr const & cidr : peer.allowed_ips) {
-				if(cidr.is_default_route) {
-					policy_route |= cidr.is_ipv4 ? POLICY_ROUTE_V4 : POLICY_ROUTE_V6;
-				}
-				
-				network << "[Route]\n";
-				network << "Destination = " << cidr.route << "\n";
-				uint32_t table = cfg.has_default_route ? fwd_table : cfg.intf.table;
-				if(table) {
-					network << "Table = " << table << "\n";
-				}
-				network << "\n";
-			}
+			_conflicts.push_back(Conflict {
+				.kind = kind,
+				.prefix = prefix,
+				.peer = peer,
+				.other = _key_cidr(node.key, node.len, prefix.family),
+				.other_peer = node.peer,
+			});
 		}
+	}
 
-		if(policy_route != POLICY_ROUTE_NONE) {
+	std::string_view AllowedIPsTrie::_public_key(uint32_t peer) const {
+		uint32_t begin = peer > 0 ? _public_key_ends[peer - 1] : 0;
+		return std::string_view(_public_keys).substr(begin, _public_key_ends[peer] - begin);
+	}
 
-			char const * family = nullptr;
+	std::vector<std::string> AllowedIPsTrie::report() const {
+		std::vector<std::string> messages;
 
-			switch(policy_route) {
-				case POLICY_ROUTE_V4:
-					family = "ipv6";
+		for(Conflict const & conflict : _conflicts) {
+			std::string message = "AllowedIPs ";
+			message.append(conflict.prefix.to_string())
+				.append(" of [Peer] ")
+				.append(_public_key(conflict.peer));
+
+			switch(conflict.kind) {
+				case ConflictKind::DUPLICATE:
+					message.append(" duplicates that of [Peer] ");
 					break;
-				case POLICY_ROUTE_V6:
-					family = "ipv4";
+				case ConflictKind::WITHIN:
+					message.append(" is within ").append(conflict.other.to_string()).append(" of [Peer] ");
 					break;
-				case POLICY_ROUTE_BOTH:
-					family = "both";
+				case ConflictKind::CONTAINS:
+					message.append(" contains ").append(conflict.other.to_string()).append(" of [Peer] ");
 					break;
 			}
 
-			network << "[RoutingPolicyRule]\n";
-			network << "SuppressPrefixLength = 0\n";
-			network << "Family = " << family << "\n";
-			network << "Priority = 32764\n";
-			network << "\n";
-
-			network << "[RoutingPolicyRule]\n";
-			network << "FirewallMark = 0x" << std::hex << fwd_table << std::dec << "\n";
-			network << "InvertRule = true\n";
-			network << "Table = " << fwd_table << "\n";
-			network << "Family = " << family << "\n";
-			network << "Priority = 32765\n";
-			network << "\n";
+			messages.push_back(message.append(_public_key(conflict.other_peer)));
+		}
 
+		if(_n_conflicts > _conflicts.size()) {
+			messages.push_back(std::to_string(_n_conflicts - _conflicts.size()) + " further AllowedIPs conflicts are not shown");
 		}
 
-		return network.str();
+		return messages;
 	}
 
-	static uint32_t _deterministic_random_table(std::string const & interface_name) {
-
+	constexpr uint32_t MAIN_TABLE = 254;
+	constexpr uint32_t LOCAL_TABLE = 255;
+
+	// Copy a value into the configuration, dropping any whitespace
+	// which remains within it
+	static void _assign_value(std::pmr::string & dst, std::string_view value) {
+		dst.clear();
+		dst.reserve(value.size());
+
+		for(char c : value) {
+			if(!_is_config_space(c)) {
+				dst.push_back(c);
+			}
+		}
+	}
+
+	// Parse the wireguard configuration from an input stream
+	// into a Config object. If an invalid key or section occurs,
+	// exists, a ParsingException is thrown.
+	Config parse_config(std::string const & interface_name, std::istream & stream) {
+		std::string input { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+		return parse_config(interface_name, std::string_view { input });
+	}
+
+	// Whether key is a base64-encoded WireGuard key
+	static bool _is_valid_key(std::pmr::string const & key) {
+		char base32[WG_KEY_LEN_BASE32];
+
+		return wg_key_convert_base32(key.c_str(), base32) == 0;
+	}
+
+	// Parse the sections of input, where a peers_only chunk of a configuration
+	// follows its [Interface] section and begins with a [Peer] section
+	//
+	// Errors are thrown unless diagnostics are given, in which case each
+	// error is recorded and parsing resumes with the next line.
+	static bool _parse_sections(std::string const & interface_name, std::string_view input, ParseCallbacks const & callbacks,
+			std::pmr::memory_resource * resource, bool peers_only, std::vector<Diagnostic> * diagnostics = nullptr) {
+		Interface intf { resource };
+
+		intf.name = interface_name;
+		intf.should_create_routes = true;
+
+		enum class Section {
+			Interface,
+			Peer,
+			// Following an invalid section header, only when collecting diagnostics
+			Invalid,
+			None
+		};
+
+		Section section = Section::None;
+
+		// The peer currently being parsed
+		Peer peer { resource };
+		// Complete peers which precede the [Interface] section
+		std::vector<Peer> pending_peers;
+
+		bool interface_complete = peers_only;
+		bool has_default_route = false;
+		bool peer_has_default_route = false;
+
+		// Lines of the current [Interface] and [Peer] headers
+		uint64_t interface_line = 0;
+		uint64_t peer_line = 0;
+
+		// Throw, or record the error at the position of at (if given) within line_no
+		auto error = [&](DiagnosticCode code, std::string && message, uint64_t line_no, std::string_view at = {}) {
+			if(!diagnostics) {
+				switch(code) {
+					case DiagnosticCode::MISSING_FIELD:
+						throw ConfigurationException(message);
+					case DiagnosticCode::MULTIPLE_DEFAULT_ROUTES:
+						throw ParsingException(message);
+					default:
+						throw ParsingException(message, line_no);
+				}
+			}
+
+			uint32_t column = 0;
+
+			if(!at.empty()) {
+				size_t offset = at.data() - input.data();
+				size_t line_begin = input.rfind('\n', offset);
+				line_begin = line_begin == std::string_view::npos ? 0 : line_begin + 1;
+				column = offset - line_begin + 1;
+			}
+
+			diagnostics->push_back(Diagnostic {
+				.line = line_no,
+				.column = column,
+				.code = code,
+				.message = std::move(message),
+			});
+		};
+
+#define MissingField(section, key) \
+	"[" section "] section missing essential field \"" key "\""
+
+		auto complete_interface = [&]() {
+			// Ensure PrivateKey and Address are present
+			if(intf.private_key.empty()) {
+				error(DiagnosticCode::MISSING_FIELD, MissingField("Interface", "PrivateKey"), interface_line);
+			}
+
+			if(intf.addresses.empty()) {
+				error(DiagnosticCode::MISSING_FIELD, MissingField("Interface", "Address"), interface_line);
+			}
+
+			interface_complete = true;
+
+			if(callbacks.on_interface) {
+				callbacks.on_interface(std::move(intf));
+			}
+
+			for(Peer & pending : pending_peers) {
+				if(callbacks.on_peer) {
+					callbacks.on_peer(std::move(pending));
+				}
+			}
+
+			pending_peers.clear();
+			pending_peers.shrink_to_fit();
+		};
+
+		auto complete_peer = [&]() {
+			// Ensure PublicKey and AllowedIPs are present
+			if(peer.public_key.empty()) {
+				error(DiagnosticCode::MISSING_FIELD, MissingField("Peer", "PublicKey"), peer_line);
+			}
+
+			if(peer.allowed_ips.empty()) {
+				error(DiagnosticCode::MISSING_FIELD, MissingField("Peer", "AllowedIPs"), peer_line);
+			}
+
+			has_default_route = has_default_route or peer_has_default_route;
+			peer_has_default_route = false;
+
+			if(!interface_complete) {
+				pending_peers.push_back(std::move(peer));
+			} else if(callbacks.on_peer) {
+				callbacks.on_peer(std::move(peer));
+			}
+
+			peer = Peer { resource };
+		};
+
+#undef MissingField
+
+		ConfigTokenizer tokenizer { input };
+		ConfigTokenizer::Token token;
+
+		while (tokenizer.next(token)) {
+			uint64_t line_no = token.line_no;
+
+			if(token.type == ConfigTokenizer::TokenType::INVALID) {
+				error(DiagnosticCode::EXPECTED_KEY_VALUE, "Expected key-value pair, got \"" + std::string(token.key) + "\"", line_no, token.key);
+				continue;
+			}
+
+			// Handle section: [Interface] or [Peer] specifies further
+			// configuration concerns an interface or peer respectively
+			if(token.type == ConfigTokenizer::TokenType::SECTION) {
+				if(token.key != "Interface" and token.key != "Peer") {
+					error(DiagnosticCode::UNKNOWN_SECTION, "Unknown section: [" + std::string(token.key) + "]", line_no, token.key);
+				}
+
+				if(section == Section::Peer) {
+					complete_peer();
+				}
+
+				if(token.key == "Interface") {
+					// The interface has been handed off once a peer follows it
+					if(interface_complete) {
+						error(DiagnosticCode::DUPLICATE_INTERFACE, "Duplicate [Interface] section", line_no, token.key);
+						section = Section::Invalid;
+						continue;
+					}
+
+					section = Section::Interface;
+					interface_line = line_no;
+				} else if(token.key == "Peer") {
+					if(section == Section::Interface) {
+						complete_interface();
+					}
+
+					section = Section::Peer;
+					peer_line = line_no;
+				} else {
+					section = Section::Invalid;
+				}
+
+				continue;
+			}
+
+			std::string_view key = token.key;
+			std::string_view value = token.value;
+
+			KeyDef const * def = lookup_key(key);
+
+			// Read keys according to corresponding section
+			switch (section) {
+			case Section::Interface: {
+				if (!def or def->section != KeySection::INTERFACE) {
+					error(DiagnosticCode::INVALID_KEY, "Invalid key in [Interface] section: " + std::string(key), line_no, key);
+					break;
+				}
+
+				switch (def->key) {
+				case ConfigKey::PRIVATE_KEY:
+					_assign_value(intf.private_key, value);
+
+					if(diagnostics and !_is_valid_key(intf.private_key)) {
+						error(DiagnosticCode::INVALID_KEY_FORMAT, "Private key is formatted improperly", line_no, value);
+					}
+					break;
+				case ConfigKey::DNS: {
+					ItemSplitter items { value };
+					std::string_view dns_ip;
+					while (items.next(dns_ip)) {
+						_assign_value(intf.DNS.emplace_back(), dns_ip);
+					}
+					break;
+				}
+				case ConfigKey::ADDRESS: {
+					ItemSplitter items { value };
+					std::string_view address;
+					while (items.next(address)) {
+						std::optional<Cidr> cidr = parse_cidr(address);
+
+						if(!cidr) {
+							error(DiagnosticCode::INVALID_ADDRESS, "Invalid address: " + std::string(address), line_no, address);
+							continue;
+						}
+
+						intf.addresses.push_back(*cidr);
+					}
+					break;
+				}
+				case ConfigKey::TABLE:
+					if(value == "off") {
+						intf.table = 0;
+						intf.should_create_routes = false;
+					} else {
+						intf.should_create_routes = true;
+						if(value == "auto") {
+							intf.table = 0;
+						} else if(value == "main") {
+							intf.table = MAIN_TABLE;
+						} else if(value == "local") {
+							intf.table = LOCAL_TABLE;
+						} else {
+							uint64_t table = 0;
+							auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), table);
+
+							if(ec != std::errc() or ptr != value.data() + value.size() or table < 1 or table > UINT32_MAX) {
+								error(DiagnosticCode::INVALID_TABLE, "Invalid option to \"Table\", must be one of \"off\", \"auto\" or a table number", line_no, value);
+								break;
+							}
+
+							intf.table = table;
+						}
+					}
+					break;
+				case ConfigKey::LISTEN_PORT: {
+					uint16_t port = 0;
+					auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), port);
+
+					if(ec != std::errc() or ptr != value.data() + value.size()) {
+						error(DiagnosticCode::INVALID_PORT, "Invalid port: " + std::string(value), line_no, value);
+						break;
+					}
+
+					intf.listen_port = port;
+					break;
+				}
+				case ConfigKey::MTU:
+					_assign_value(intf.mtu, value);
+					break;
+				case ConfigKey::PRE_UP:
+					_assign_value(intf.preup, value);
+					break;
+				case ConfigKey::POST_UP:
+					_assign_value(intf.postup, value);
+					break;
+				case ConfigKey::PRE_DOWN:
+					_assign_value(intf.predown, value);
+					break;
+				case ConfigKey::POST_DOWN:
+					_assign_value(intf.postdown, value);
+					break;
+				case ConfigKey::SAVE_CONFIG:
+					_assign_value(intf.save_config, value);
+					break;
+				default:
+					break;
+				}
+				break;
+			}
+			case Section::Peer: {
+				if (!def or def->section != KeySection::PEER) {
+					error(DiagnosticCode::INVALID_KEY, "Invalid key in [Peer] section: " + std::string(key), line_no, key);
+					break;
+				}
+
+				switch (def->key) {
+				case ConfigKey::ENDPOINT:
+					_assign_value(peer.endpoint, value);
+					break;
+				case ConfigKey::ALLOWED_IPS: {
+					ItemSplitter items { value };
+					std::string_view allowed_ip;
+
+					while (items.next(allowed_ip)) {
+						std::optional<Cidr> cidr = parse_cidr(allowed_ip);
+
+						if(!cidr) {
+							error(DiagnosticCode::INVALID_ALLOWED_IP, "Invalid CIDR in AllowedIPs: " + std::string(allowed_ip), line_no, allowed_ip);
+							continue;
+						}
+
+						bool is_default_route = cidr->is_default_route();
+
+						if(is_default_route and has_default_route) {
+							error(DiagnosticCode::MULTIPLE_DEFAULT_ROUTES, "Default routes exist on multiple peers", line_no, allowed_ip);
+						}
+
+						peer.allowed_ips.push_back(*cidr);
+
+						peer_has_default_route = peer_has_default_route or is_default_route;
+					}
+					break;
+				}
+				case ConfigKey::PUBLIC_KEY:
+					_assign_value(peer.public_key, value);
+
+					if(diagnostics and !_is_valid_key(peer.public_key)) {
+						error(DiagnosticCode::INVALID_KEY_FORMAT, "Public key is formatted improperly", line_no, value);
+					}
+					break;
+				case ConfigKey::PERSISTENT_KEEPALIVE:
+					_assign_value(peer.persistent_keepalive, value);
+					break;
+				case ConfigKey::PRESHARED_KEY:
+					_assign_value(peer.preshared_key, value);
+
+					if(diagnostics and !_is_valid_key(peer.preshared_key)) {
+						error(DiagnosticCode::INVALID_KEY_FORMAT, "Preshared key is formatted improperly", line_no, value);
+					}
+					break;
+				default:
+					break;
+				}
+				break;
+			}
+			case Section::Invalid:
+				break;
+			case Section::None:
+				error(DiagnosticCode::KEY_OUTSIDE_SECTION, "Unexpected key outside of section: " + std::string(key), line_no, key);
+				break;
+			}
+		}
+
+		if(section == Section::Peer) {
+			complete_peer();
+		}
+
+		if(!interface_complete) {
+			complete_interface();
+		}
+
+		return has_default_route;
+	}
+
+	bool parse_config_streaming(std::string const & interface_name, std::string_view input, ParseCallbacks const & callbacks,
+			std::pmr::memory_resource * resource) {
+		return _parse_sections(interface_name, input, callbacks, resource, false);
+	}
+
+	std::vector<Diagnostic> check_config(std::string const & interface_name, std::string_view input) {
+		std::vector<Diagnostic> diagnostics;
+
+		// The sections of a typical configuration fit within the buffer,
+		// larger configurations spill onto the heap
+		char buffer[4096];
+		std::pmr::monotonic_buffer_resource arena { buffer, sizeof(buffer) };
+
+		_parse_sections(interface_name, input, ParseCallbacks {}, &arena, false, &diagnostics);
+
+		return diagnostics;
+	}
+
+	// An upper bound on the number of [Peer] sections in input
+	static size_t _count_peers(std::string_view input) {
+		size_t n_peers = 0;
+		for(size_t pos = input.find("[Peer]"); pos != std::string_view::npos; pos = input.find("[Peer]", pos + 1)) {
+			n_peers++;
+		}
+		return n_peers;
+	}
+
+	// Split a configuration into n_chunks of roughly equal size, each but
+	// the first beginning with a [Peer] section
+	static std::vector<std::string_view> _split_at_peers(std::string_view input, size_t n_chunks) {
+		std::vector<std::string_view> chunks;
+
+		size_t begin = 0;
+
+		for(size_t i = 1; i < n_chunks; i++) {
+			size_t target = input.size() / n_chunks * i;
+			if(target < begin) {
+				continue;
+			}
+
+			size_t header = input.find("\n[Peer]", target);
+			if(header == std::string_view::npos) {
+				break;
+			}
+
+			chunks.push_back(input.substr(begin, header + 1 - begin));
+			begin = header + 1;
+		}
+
+		chunks.push_back(input.substr(begin));
+
+		return chunks;
+	}
+
+	// Parse the chunks of a configuration concurrently, returning an empty
+	// optional if any chunk is invalid
+	static std::optional<Config> _parse_config_parallel(std::string const & interface_name,
+			std::vector<std::string_view> const & chunks, unsigned threads) {
+
+		struct ChunkResult {
+			std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+			std::optional<Interface> intf;
+			std::vector<Peer> peers;
+			bool has_default_route;
+			bool failed;
+		};
+
+		std::vector<ChunkResult> results(chunks.size());
+
+		auto parse_chunk = [&](size_t i) {
+			ChunkResult & result = results[i];
+
+			result.arena = std::make_unique<std::pmr::monotonic_buffer_resource>(chunks[i].size() + 1024);
+			result.peers.reserve(_count_peers(chunks[i]));
+
+			try {
+				result.has_default_route = _parse_sections(interface_name, chunks[i], ParseCallbacks {
+					.on_interface = [&result](Interface && intf) {
+						result.intf.emplace(std::move(intf));
+					},
+					.on_peer = [&result](Peer && peer) {
+						result.peers.push_back(std::move(peer));
+					},
+				}, result.arena.get(), i > 0);
+				result.failed = false;
+			} catch(ConfigurationException const &) {
+				result.failed = true;
+			}
+		};
+
+		// Chunks are claimed in order by each thread of the pool
+		std::atomic<size_t> next_chunk { 0 };
+
+		auto worker = [&]() {
+			for(size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+				parse_chunk(i);
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for(unsigned t = 1; t < threads and t < chunks.size(); t++) {
+			pool.emplace_back(worker);
+		}
+
+		worker();
+
+		for(std::thread & thread : pool) {
+			thread.join();
+		}
+
+		size_t n_peers = 0;
+		size_t n_default_routes = 0;
+
+		for(ChunkResult const & result : results) {
+			if(result.failed) {
+				return {};
+			}
+
+			n_peers += result.peers.size();
+			n_default_routes += result.has_default_route;
+		}
+
+		// Each chunk only verifies its own peers
+		if(n_default_routes > 1) {
+			throw ParsingException("Default routes exist on multiple peers");
+		}
+
+		Config cfg { std::move(results[0].arena) };
+
+		cfg.intf = std::move(*results[0].intf);
+		cfg.has_default_route = n_default_routes > 0;
+		cfg.peers.reserve(n_peers);
+
+		for(ChunkResult & result : results) {
+			std::move(result.peers.begin(), result.peers.end(), std::back_inserter(cfg.peers));
+
+			if(result.arena) {
+				cfg.arenas.push_back(std::move(result.arena));
+			}
+		}
+
+		return cfg;
+	}
+
+	Config parse_config(std::string const & interface_name, std::string_view input, ParseOptions const & options) {
+		if(options.threads > 1 and input.size() >= PARALLEL_MIN_CHUNK_SIZE * 2) {
+			size_t n_chunks = std::min<size_t>(options.threads * 4, input.size() / PARALLEL_MIN_CHUNK_SIZE);
+
+			std::vector<std::string_view> chunks = _split_at_peers(input, n_chunks);
+
+			// Errors are reported as they would be without threads, by
+			// parsing the configuration once more
+			if(chunks.size() > 1) {
+				std::optional<Config> cfg = _parse_config_parallel(interface_name, chunks, options.threads);
+
+				if(cfg) {
+					return std::move(*cfg);
+				}
+			}
+		}
+
+		// The arena is sized by the input, which bounds the text of the
+		// configuration, so that it is typically allocated at once
+		Config cfg { std::make_unique<std::pmr::monotonic_buffer_resource>(input.size() + 1024) };
+
+		// Reserve the peers up front, rather than moving them as the array grows
+		cfg.peers.reserve(_count_peers(input));
+
+		cfg.has_default_route = parse_config_streaming(interface_name, input, ParseCallbacks {
+			.on_interface = [&cfg](Interface && intf) {
+				cfg.intf = std::move(intf);
+			},
+			.on_peer = [&cfg](Peer && peer) {
+				cfg.peers.push_back(std::move(peer));
+			},
+		}, cfg.arenas.front().get());
+
+		return cfg;
+	}
+
+	// The nftables family and address type of the tables of each IP version
+	struct NftIpv4 {
+		static constexpr bool IS_IPV4 = true;
+		static constexpr FixedString IP = "ip";
+		static constexpr FixedString ADDR_TYPE = "ipv4_addr";
+	};
+
+	struct NftIpv6 {
+		static constexpr bool IS_IPV4 = false;
+		static constexpr FixedString IP = "ip6";
+		static constexpr FixedString ADDR_TYPE = "ipv6_addr";
+	};
+
+	// Write an nftables table which drops packets addressed to the interface
+	// from elsewhere. The addresses are either elements of a set, which is
+	// matched by one rule, or the drop rules themselves (as wg-quick(8) writes).
+	template<typename Family>
+	static void _write_table(OutputBuffer & firewall, std::string const & interface_name, std::string_view addrs,
+			uint32_t fwd_table, bool rule_per_address) {
+		constexpr FixedString SET_TABLE = FixedString(
+			"table ") + Family::IP + " {} {\n"
+			"  set {}_addrs {\n"
+			"    type " + Family::ADDR_TYPE + "\n"
+			"    elements = { {} }\n"
+			"  }\n"
+			"\n"
+			"  chain preraw {\n"
+			"    type filter hook prerouting priority raw; policy accept;\n"
+			"    iifname != \"{}\" " + Family::IP + " daddr @{}_addrs fib saddr type != local drop;\n"
+			"  }\n";
+
+		constexpr FixedString RULE_TABLE = FixedString(
+			"table ") + Family::IP + " {} {\n"
+			"  chain preraw {\n"
+			"    type filter hook prerouting priority raw; policy accept;\n"
+			"{}"
+			"  }\n";
+
+		if(rule_per_address) {
+			firewall.format<RULE_TABLE>(interface_name, addrs);
+		} else {
+			firewall.format<SET_TABLE>(interface_name, interface_name, addrs, interface_name, interface_name);
+		}
+
+		firewall.format<
+			"\n"
+			"  chain premangle {\n"
+			"    type filter hook prerouting priority mangle; policy accept;\n"
+			"    meta l4proto udp meta mark set ct mark;\n"
+			"  }\n"
+			"\n"
+			"  chain postmangle {\n"
+			"    type filter hook postrouting priority mangle; policy accept;\n"
+			"    meta l4proto udp meta mark 0x{} ct mark set meta mark;\n"
+			"  }\n"
+			"}\n"
+		>(Hex { fwd_table });
+	}
+
+	// Add the address at it to the elements of a set (or the drop rules) of
+	// its family, unless it appeared earlier in the interface
+	static void _write_firewall_addr(OutputBuffer & addrs, Interface const & intf,
+			std::pmr::vector<Cidr>::const_iterator it, bool rule_per_address) {
+		Cidr const & addr = *it;
+
+		if(rule_per_address) {
+			addrs.format<"    iifname != \"{}\" {} daddr {} fib saddr type != local drop;\n">(
+				intf.name, addr.is_ipv4() ? "ip" : "ip6", Address { addr });
+			return;
+		}
+
+		// nft(8) rejects a set with duplicate elements
+		bool duplicate = std::any_of(intf.addresses.begin(), it, [&addr](Cidr const & other) {
+			return other.family == addr.family and other.addr == addr.addr;
+		});
+
+		if(!duplicate) {
+			addrs << (addrs.size() > 0 ? ", " : "") << Address { addr };
+		}
+	}
+
+	static std::string_view activation_policy_keyword(ActivationPolicy activation_policy) {
+		switch(activation_policy) {
+			case ActivationPolicy::MANUAL:
+				return "manual";
+			case ActivationPolicy::UP:
+				return "up";
+		}
+
+		return "none";
+	}
+
+	static uint32_t _deterministic_random_table(std::string const & interface_name) {
+
 		uint32_t table = 0;
 		while(table == 0 or table == MAIN_TABLE or table == LOCAL_TABLE) {
 			table = deterministic_fwmark(interface_name);
 		}
 
-		return table;
+		return table;
+	}
+
+	constexpr uint8_t POLICY_ROUTE_NONE = 0;
+	constexpr uint8_t POLICY_ROUTE_V4 = 1 << 0;
+	constexpr uint8_t POLICY_ROUTE_V6 = 1 << 1;
+	constexpr uint8_t POLICY_ROUTE_BOTH = POLICY_ROUTE_V4 | POLICY_ROUTE_V6;
+
+	// Generous estimates of the size of each part of the output, from which
+	// the buffers are reserved. An allowed IP is at most "AllowedIPs = " plus
+	// Cidr::MAX_TEXT_LEN, and a route "[Route]", its destination, and a table.
+	constexpr size_t NETDEV_HEADER_SIZE_HINT = 512;
+	constexpr size_t NETDEV_PEER_SIZE_HINT = 256;
+	constexpr size_t ALLOWED_IP_SIZE_HINT = 64;
+	constexpr size_t NETWORK_HEADER_SIZE_HINT = 1024;
+	constexpr size_t ROUTE_SIZE_HINT = 96;
+	constexpr size_t NFT_TABLE_SIZE_HINT = 512;
+
+	// Peers are never formatted in ranges smaller than this
+	constexpr size_t PARALLEL_MIN_PEERS = 4096;
+
+	SystemdConfigBuilder::SystemdConfigBuilder(
+		std::filesystem::path const & keyfile_or_output_path,
+		std::optional<std::string> const & filename,
+		ActivationPolicy activation_policy,
+		GenerateOptions const & options
+	)
+		: _keyfile_or_output_path { keyfile_or_output_path }
+		, _filename { filename }
+		, _activation_policy { activation_policy }
+		, _options { options }
+		, _fwd_table { 0 }
+		, _route_table { 0 }
+		, _removed_routes { 0 }
+		, _has_default_route { false }
+		, _policy_route { POLICY_ROUTE_NONE }
+	{ }
+
+	void SystemdConfigBuilder::add_interface(Interface const & intf, bool has_default_route) {
+		_intf = intf;
+
+		// If the table is explicitly specified with Table=<number>,
+		// all routes are added to this table.
+		//
+		// If Table=auto and a default route exists, this
+		// table is used by the default route to supersede
+		// non-encrypted traffic traveling to /0 routes in the
+		// main routing table by using suppress_prefix policy rules.
+		// These routes match a fwmark which is identical to the
+		// table name. All other routes are placed in the main routing
+		// table.
+		//
+		// If Table=off, no routes are added.
+		_fwd_table = _deterministic_random_table(intf.name);
+
+		if(_keyfile_or_output_path.has_filename()) {
+			_keyfile_path = _keyfile_or_output_path;
+			_output_path = _keyfile_or_output_path.parent_path();
+		} else {
+			std::string private_keyfile = private_keyfile_name(intf.private_key);
+			_keyfile_path = _keyfile_or_output_path / private_keyfile;
+			_output_path = _keyfile_or_output_path;
+		}
+
+		// Routes are written assuming the final table, and rewritten
+		// should a default route show otherwise
+		_has_default_route = has_default_route;
+		_route_table = has_default_route ? _fwd_table : intf.table;
+
+		// The addresses of the network and the firewall which guards
+		// them are written in one pass
+		for(auto it = intf.addresses.begin(); it != intf.addresses.end(); it++) {
+			Cidr const & addr = *it;
+
+			_network_addresses.format<"Address = {}\n">(addr);
+
+			OutputBuffer & addrs = addr.is_ipv4() ? _firewall_addrs_v4 : _firewall_addrs_v6;
+			_write_firewall_addr(addrs, intf, it, _options.nft_rule_per_address);
+		}
+
+		// When streaming, the headers are written first, which is
+		// possible as it is known whether a default route exists
+		if(_netdev_peers.is_streaming()) {
+			_write_netdev_header(_netdev_peers);
+			_write_network_header(_network_routes);
+		}
+
+#define WarnOnIntfField(field_, field_name) \
+if(!intf.field_.empty()) { \
+	_warnings.push_back("[Interface] section contains a field \"" field_name "\" which does not have a systemd-networkd analog, omitting"); \
+}
+
+		WarnOnIntfField(preup, "PreUp")
+		WarnOnIntfField(postup, "PostUp")
+		WarnOnIntfField(predown, "PreDown")
+		WarnOnIntfField(postdown, "PostDown")
+		WarnOnIntfField(save_config, "SaveConfig")
+
+#undef WarnOnIntfField
+
+		if(!intf.preup.empty()) {
+			_warnings.push_back("[Interface] section contains a field \"PreUp\" which does not have a systemd-networkd analog");
+		}
+	}
+
+	void SystemdConfigBuilder::stream_to(SystemdSinks const & sinks) {
+		_netdev_peers.stream_to(sinks.netdev);
+		_network_routes.stream_to(sinks.network);
+	}
+
+	void SystemdConfigBuilder::reserve(size_t n_peers, size_t n_allowed_ips) {
+		_allowed_ips.reserve(n_peers, n_allowed_ips);
+		_netdev_peers.reserve(NETDEV_HEADER_SIZE_HINT + n_peers * NETDEV_PEER_SIZE_HINT + n_allowed_ips * ALLOWED_IP_SIZE_HINT);
+
+		if(_intf.should_create_routes and _options.coalesce_routes) {
+			_routes.reserve(n_allowed_ips);
+		} else if(_intf.should_create_routes) {
+			_network_routes.reserve(NETWORK_HEADER_SIZE_HINT + n_allowed_ips * ROUTE_SIZE_HINT);
+		}
+	}
+
+	void SystemdConfigBuilder::_write_route(OutputBuffer & routes, Cidr const & cidr) const {
+		if(_route_table) {
+			routes.format<
+				"[Route]\n"
+				"Destination = {}\n"
+				"Table = {}\n"
+				"\n"
+			>(cidr, _route_table);
+		} else {
+			routes.format<
+				"[Route]\n"
+				"Destination = {}\n"
+				"\n"
+			>(cidr);
+		}
+	}
+
+	void SystemdConfigBuilder::_retable_routes(uint32_t table) {
+		if(table == _route_table) {
+			return;
+		}
+
+		constexpr std::string_view DESTINATION = "Destination = ";
+		constexpr std::string_view TABLE = "Table = ";
+
+		std::string_view routes = _network_routes.view();
+		OutputBuffer retabled { routes.size() + routes.size() / 2 };
+
+		// Copy each line, replacing the table which follows each destination
+		for(size_t pos = 0; pos < routes.size(); ) {
+			size_t eol = routes.find('\n', pos) + 1;
+			std::string_view line = routes.substr(pos, eol - pos);
+
+			if(!line.starts_with(TABLE)) {
+				retabled << line;
+			}
+
+			if(line.starts_with(DESTINATION) and table) {
+				retabled << TABLE << table << "\n";
+			}
+
+			pos = eol;
+		}
+
+		_network_routes = std::move(retabled);
+		_route_table = table;
+	}
+
+	void SystemdConfigBuilder::_add_default_routes(Peer const & peer) {
+		for(Cidr const & cidr : peer.allowed_ips) {
+			if(!cidr.is_default_route()) {
+				continue;
+			}
+
+			if(!_has_default_route and _netdev_peers.is_streaming()) {
+				throw std::logic_error("A default route must be given to add_interface() when streaming");
+			}
+
+			_has_default_route = true;
+			_policy_route |= cidr.is_ipv4() ? POLICY_ROUTE_V4 : POLICY_ROUTE_V6;
+
+			// All routes are placed in the forwarding table once a
+			// default route exists
+			if(_intf.should_create_routes) {
+				_retable_routes(_fwd_table);
+			}
+		}
+	}
+
+	void SystemdConfigBuilder::_write_peer(Peer const & peer, OutputBuffer & netdev, OutputBuffer & routes,
+			std::vector<Cidr> & destinations, std::vector<SystemdFilespec> & symmetric_keyfiles) const {
+		netdev.format<
+			"[WireGuardPeer]\n"
+			"PublicKey = {}\n"
+		>(peer.public_key);
+
+		if(!peer.endpoint.empty()) {
+			netdev.format<"Endpoint = {}\n">(peer.endpoint);
+		}
+
+		if(!peer.preshared_key.empty()) {
+			std::string filename = public_keyfile_name(peer.public_key);
+
+			netdev.format<"PresharedKeyFile = {}\n">((_output_path / filename).native());
+
+			symmetric_keyfiles.push_back(SystemdFilespec {
+				.name = std::move(filename),
+				.contents = std::string(peer.preshared_key).append("\n"),
+			});
+		}
+
+		// The peer and route of each allowed IP are written in one pass
+		// over the peer
+		for(Cidr const & cidr : peer.allowed_ips) {
+			netdev.format<"AllowedIPs = {}\n">(cidr);
+
+			if(!_intf.should_create_routes) {
+				continue;
+			}
+
+			if(_options.coalesce_routes) {
+				destinations.push_back(cidr);
+			} else {
+				_write_route(routes, cidr);
+			}
+		}
+
+		if(!peer.persistent_keepalive.empty()) {
+			netdev.format<"PersistentKeepalive = {}\n">(peer.persistent_keepalive);
+		}
+
+		netdev << "\n";
+	}
+
+	// Insert the peers of formatted [WireGuardPeer] sections into trie
+	static void _add_formatted_allowed_ips(AllowedIPsTrie & trie, std::string_view netdev) {
+		constexpr std::string_view PUBLIC_KEY = "PublicKey = ";
+		constexpr std::string_view ALLOWED_IP = "AllowedIPs = ";
+
+		std::string_view public_key;
+		std::vector<Cidr> allowed_ips;
+
+		while(!netdev.empty()) {
+			size_t end = netdev.find('\n');
+			std::string_view line = netdev.substr(0, end);
+			netdev.remove_prefix(end == std::string_view::npos ? netdev.size() : end + 1);
+
+			if(line.starts_with(PUBLIC_KEY)) {
+				if(!public_key.empty()) {
+					trie.add_peer(public_key, allowed_ips);
+					allowed_ips.clear();
+				}
+
+				public_key = line.substr(PUBLIC_KEY.size());
+			} else if(line.starts_with(ALLOWED_IP)) {
+				if(std::optional<Cidr> cidr = parse_cidr(line.substr(ALLOWED_IP.size()))) {
+					allowed_ips.push_back(*cidr);
+				}
+			}
+		}
+
+		if(!public_key.empty()) {
+			trie.add_peer(public_key, allowed_ips);
+		}
+	}
+
+	// Throw a ConfigurationException describing the conflicts of trie
+	static void _throw_allowed_ips_conflicts(AllowedIPsTrie const & trie) {
+		if(trie.n_conflicts() == 0) {
+			return;
+		}
+
+		std::string message = "the AllowedIPs of peers conflict";
+		for(std::string const & conflict : trie.report()) {
+			message.append("\n  ").append(conflict);
+		}
+
+		throw ConfigurationException(message);
+	}
+
+	void SystemdConfigBuilder::add_peer(Peer const & peer) {
+		_allowed_ips.add_peer(peer.public_key, peer.allowed_ips);
+		_add_default_routes(peer);
+		_write_peer(peer, _netdev_peers, _network_routes, _routes, _symmetric_keyfiles);
+
+		_netdev_peers.drain();
+		_network_routes.drain();
+	}
+
+	void SystemdConfigBuilder::add_formatted_peer(std::string_view netdev, std::string_view routes, uint8_t policy_route) {
+		if(policy_route != POLICY_ROUTE_NONE) {
+			_has_default_route = true;
+			_policy_route |= policy_route;
+		}
+
+		_add_formatted_allowed_ips(_allowed_ips, netdev);
+
+		_netdev_peers << netdev;
+		_network_routes << routes;
+
+		_netdev_peers.drain();
+		_network_routes.drain();
+	}
+
+	void SystemdConfigBuilder::add_peers(std::span<Peer const> peers, unsigned threads, std::span<PeerSize> sizes) {
+		size_t n_ranges = std::min<size_t>(threads, peers.size() / PARALLEL_MIN_PEERS);
+
+		if(n_ranges < 2) {
+			for(size_t i = 0; i < peers.size(); i++) {
+				uint64_t netdev_begin = netdev_offset();
+				uint64_t network_begin = network_offset();
+
+				add_peer(peers[i]);
+
+				if(!sizes.empty()) {
+					sizes[i] = PeerSize {
+						.netdev = netdev_offset() - netdev_begin,
+						.network = network_offset() - network_begin,
+					};
+				}
+			}
+
+			return;
+		}
+
+		// The table of every route is settled before any is written
+		for(Peer const & peer : peers) {
+			_allowed_ips.add_peer(peer.public_key, peer.allowed_ips);
+			_add_default_routes(peer);
+		}
+
+		struct PeerRange {
+			OutputBuffer netdev;
+			OutputBuffer routes;
+			std::vector<Cidr> destinations;
+			std::vector<SystemdFilespec> symmetric_keyfiles;
+			// Thrown while writing the range, which is rethrown once every
+			// thread has joined
+			std::exception_ptr error;
+		};
+
+		std::vector<PeerRange> ranges(n_ranges);
+
+		auto write_range = [&](size_t i) {
+			size_t begin = peers.size() * i / n_ranges;
+			std::span<Peer const> range = peers.subspan(begin, peers.size() * (i + 1) / n_ranges - begin);
+
+			size_t n_allowed_ips = 0;
+			for(Peer const & peer : range) {
+				n_allowed_ips += peer.allowed_ips.size();
+			}
+
+			PeerRange & out = ranges[i];
+			out.netdev.reserve(range.size() * NETDEV_PEER_SIZE_HINT + n_allowed_ips * ALLOWED_IP_SIZE_HINT);
+
+			if(_intf.should_create_routes and _options.coalesce_routes) {
+				out.destinations.reserve(n_allowed_ips);
+			} else if(_intf.should_create_routes) {
+				out.routes.reserve(n_allowed_ips * ROUTE_SIZE_HINT);
+			}
+
+			try {
+				for(size_t j = 0; j < range.size(); j++) {
+					size_t netdev_size = out.netdev.size();
+					size_t routes_size = out.routes.size();
+
+					_write_peer(range[j], out.netdev, out.routes, out.destinations, out.symmetric_keyfiles);
+
+					if(!sizes.empty()) {
+						sizes[begin + j] = PeerSize {
+							.netdev = out.netdev.size() - netdev_size,
+							.network = out.routes.size() - routes_size,
+						};
+					}
+				}
+			} catch(...) {
+				out.error = std::current_exception();
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for(size_t i = 1; i < n_ranges; i++) {
+			pool.emplace_back(write_range, i);
+		}
+
+		write_range(0);
+
+		for(std::thread & thread : pool) {
+			thread.join();
+		}
+
+		// The first peer which fails is reported, as it is by add_peer
+		for(PeerRange const & range : ranges) {
+			if(range.error) {
+				std::rethrow_exception(range.error);
+			}
+		}
+
+		// The ranges are joined in peer order, so the output does not
+		// depend on the number of threads
+		for(PeerRange & range : ranges) {
+			_netdev_peers << range.netdev.view();
+			_network_routes << range.routes.view();
+			_routes.insert(_routes.end(), range.destinations.begin(), range.destinations.end());
+			std::move(range.symmetric_keyfiles.begin(), range.symmetric_keyfiles.end(),
+				std::back_inserter(_symmetric_keyfiles));
+
+			_netdev_peers.drain();
+			_network_routes.drain();
+		}
+	}
+
+	void SystemdConfigBuilder::_write_netdev_header(OutputBuffer & netdev) {
+		netdev.format<
+			"# Autogenerated by wg2nd\n"
+			"[NetDev]\n"
+			"Name = {}\n"
+			"Kind = wireguard\n"
+			"Description = {} - wireguard tunnel\n"
+			"\n"
+			"[WireGuard]\n"
+			"PrivateKeyFile = {}\n"
+		>(_intf.name, _intf.name, _keyfile_path.native());
+
+		if(_intf.listen_port.has_value()) {
+			netdev.format<"ListenPort = {}\n">(_intf.listen_port.value());
+		}
+
+		if(_intf.should_create_routes and _intf.table != 0) {
+			netdev << "RouteTable = ";
+
+			switch(_intf.table) {
+				case LOCAL_TABLE:
+					netdev << "local";
+					break;
+				case MAIN_TABLE:
+					netdev << "main";
+					break;
+				default:
+					netdev << _intf.table;
+					break;
+			}
+
+			netdev << "\n";
+		}
+
+		if(_intf.should_create_routes and _has_default_route) {
+			netdev.format<"FirewallMark = 0x{}\n">(Hex { _fwd_table });
+		}
+
+		netdev << "\n";
+	}
+
+	std::string SystemdConfigBuilder::_gen_netdev_cfg() {
+		if(_netdev_peers.is_streaming()) {
+			_netdev_peers.flush();
+			return {};
+		}
+
+		OutputBuffer netdev { NETDEV_HEADER_SIZE_HINT };
+		_write_netdev_header(netdev);
+
+		// The peers are generally reserved with room for the header, so
+		// it is shifted into place rather than copied into a new buffer
+		_netdev_peers.prepend(netdev.view());
+
+		return _netdev_peers.take();
+	}
+
+	void SystemdConfigBuilder::_write_network_header(OutputBuffer & network) {
+		network.format<
+			"# Autogenerated by wg2nd\n"
+			"[Match]\n"
+			"Name = {}\n"
+			"\n"
+			"[Link]\n"
+			"ActivationPolicy = {}\n"
+		>(_intf.name, activation_policy_keyword(_activation_policy));
+
+		if(!_intf.mtu.empty()) {
+			network.format<"MTUBytes = {}\n">(_intf.mtu);
+		}
+
+		network.format<
+			"\n"
+			"[Network]\n"
+			"{}"
+		>(_network_addresses.view());
+
+		for(std::pmr::string const & dns : _intf.DNS) {
+			network.format<"DNS = {}\n">(dns);
+		}
+
+		if(_has_default_route and _intf.DNS.size() > 0) {
+			network << "Domains = ~.\n";
+		}
+
+		network << "\n";
+	}
+
+	std::string SystemdConfigBuilder::_gen_network_cfg() {
+		if(_intf.should_create_routes and _options.coalesce_routes) {
+			size_t n_routes = _routes.size();
+			std::vector<Cidr> coalesced = coalesce_routes(std::move(_routes));
+
+			_route_table = _has_default_route ? _fwd_table : _intf.table;
+
+			for(Cidr const & cidr : coalesced) {
+				_write_route(_network_routes, cidr);
+				_network_routes.drain();
+			}
+
+			_removed_routes = n_routes - coalesced.size();
+		}
+
+		if(_intf.should_create_routes and _policy_route != POLICY_ROUTE_NONE) {
+
+			char const * family = nullptr;
+
+			switch(_policy_route) {
+				case POLICY_ROUTE_V4:
+					family = "ipv6";
+					break;
+				case POLICY_ROUTE_V6:
+					family = "ipv4";
+					break;
+				case POLICY_ROUTE_BOTH:
+					family = "both";
+					break;
+			}
+
+			_network_routes.format<
+				"[RoutingPolicyRule]\n"
+				"SuppressPrefixLength = 0\n"
+				"Family = {}\n"
+				"Priority = 32764\n"
+				"\n"
+				"[RoutingPolicyRule]\n"
+				"FirewallMark = 0x{}\n"
+				"InvertRule = true\n"
+				"Table = {}\n"
+				"Family = {}\n"
+				"Priority = 32765\n"
+				"\n"
+			>(family, Hex { _fwd_table }, _fwd_table, family);
+
+		}
+
+		if(_network_routes.is_streaming()) {
+			_network_routes.flush();
+			return {};
+		}
+
+		OutputBuffer network { NETWORK_HEADER_SIZE_HINT + _network_addresses.size() };
+		_write_network_header(network);
+
+		// The routes are reserved with room for the header
+		_network_routes.prepend(network.view());
+
+		return _network_routes.take();
+	}
+
+	std::string SystemdConfigBuilder::_gen_firewall() {
+		OutputBuffer firewall { 2 * NFT_TABLE_SIZE_HINT + _firewall_addrs_v4.size() + _firewall_addrs_v6.size() };
+
+		if(_firewall_addrs_v4.size() > 0) {
+			_write_table<NftIpv4>(firewall, _intf.name, _firewall_addrs_v4.view(), _fwd_table, _options.nft_rule_per_address);
+			firewall << "\n";
+		}
+
+		if(_firewall_addrs_v6.size() > 0) {
+			_write_table<NftIpv6>(firewall, _intf.name, _firewall_addrs_v6.view(), _fwd_table, _options.nft_rule_per_address);
+		}
+
+		return firewall.take();
+	}
+
+	SystemdConfig SystemdConfigBuilder::finish() {
+		if(_options.strict_allowed_ips) {
+			_throw_allowed_ips_conflicts(_allowed_ips);
+		}
+
+		std::vector<std::string> conflicts = _allowed_ips.report();
+		std::move(conflicts.begin(), conflicts.end(), std::back_inserter(_warnings));
+
+		std::string const & basename = _filename.value_or(_intf.name);
+
+		return SystemdConfig {
+			.netdev = {
+				.name = basename + ".netdev",
+				.contents = _gen_netdev_cfg(),
+			},
+			.network = {
+				.name = basename + ".network",
+				.contents = _gen_network_cfg(),
+			},
+			.private_keyfile = {
+				.name = _keyfile_path.filename(),
+				.contents = std::string(_intf.private_key).append("\n"),
+			},
+			.symmetric_keyfiles = std::move(_symmetric_keyfiles),
+			.warnings = std::move(_warnings),
+			.firewall = _gen_firewall(),
+			.removed_routes = _removed_routes,
+		};
+	}
+
+	SystemdConfig gen_systemd_config(
+		Config const & cfg,
+		std::filesystem::path const & keyfile_or_output_path,
+		std::optional<std::string> const & filename,
+		ActivationPolicy activation_policy,
+		GenerateOptions const & options
+	) {
+		SystemdConfigBuilder builder { keyfile_or_output_path, filename, activation_policy, options };
+
+		builder.add_interface(cfg.intf, cfg.has_default_route);
+
+		size_t n_allowed_ips = 0;
+		for(Peer const & peer : cfg.peers) {
+			n_allowed_ips += peer.allowed_ips.size();
+		}
+
+		builder.reserve(cfg.peers.size(), n_allowed_ips);
+		builder.add_peers(cfg.peers, options.threads);
+
+		return builder.finish();
+	}
+
+	SystemdConfig wg2nd(std::string const & interface_name, std::istream & stream,
+			std::filesystem::path const & keyfile_or_output_path,
+			std::optional<std::string> const & filename,
+			ActivationPolicy activation_policy,
+			GenerateOptions const & options) {
+		std::string input { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+		return wg2nd(interface_name, std::string_view { input }, keyfile_or_output_path, filename, activation_policy, options);
+	}
+
+	SystemdConfig wg2nd(std::string const & interface_name, std::string_view input,
+			std::filesystem::path const & keyfile_or_output_path,
+			std::optional<std::string> const & filename,
+			ActivationPolicy activation_policy,
+			GenerateOptions const & options) {
+		// Peers are only formatted concurrently once all have been parsed
+		if(options.threads > 1) {
+			Config cfg = parse_config(interface_name, input, ParseOptions { .threads = options.threads });
+
+			return gen_systemd_config(cfg, keyfile_or_output_path, filename, activation_policy, options);
+		}
+
+		SystemdConfigBuilder builder { keyfile_or_output_path, filename, activation_policy, options };
+
+		// Peers are converted as they are parsed, rather than retained
+		parse_config_streaming(interface_name, input, ParseCallbacks {
+			.on_interface = [&builder, input](Interface && intf) {
+				builder.add_interface(intf);
+
+				// Peers usually have a single allowed IP, past which the buffers grow
+				size_t n_peers = _count_peers(input);
+				builder.reserve(n_peers, n_peers);
+			},
+			.on_peer = [&builder](Peer && peer) {
+				builder.add_peer(peer);
+			},
+		});
+
+		return builder.finish();
+	}
+
+	// Throw the ParsingException which SystemdConfigBuilder would for the
+	// keys it names keyfiles after
+	static void _validate_keys(Interface const & intf, std::filesystem::path const & keyfile_or_output_path) {
+		if(!keyfile_or_output_path.has_filename()) {
+			private_keyfile_name(intf.private_key);
+		}
+	}
+
+	static void _validate_keys(Peer const & peer) {
+		if(!peer.preshared_key.empty()) {
+			public_keyfile_name(peer.public_key);
+		}
+	}
+
+	// Validate input before any output is streamed, returning whether a
+	// peer has a default route
+	static bool _validate(std::string const & interface_name, std::string_view input,
+			std::filesystem::path const & keyfile_or_output_path, GenerateOptions const & options) {
+		AllowedIPsTrie trie;
+
+		bool has_default_route = parse_config_streaming(interface_name, input, ParseCallbacks {
+			.on_interface = [&keyfile_or_output_path](Interface && intf) {
+				_validate_keys(intf, keyfile_or_output_path);
+			},
+			.on_peer = [&trie, &options](Peer && peer) {
+				_validate_keys(peer);
+
+				if(options.strict_allowed_ips) {
+					trie.add_peer(peer.public_key, peer.allowed_ips);
+				}
+			},
+		});
+
+		_throw_allowed_ips_conflicts(trie);
+
+		return has_default_route;
+	}
+
+	// Validate a configuration parsed in full, as _validate does its input
+	static void _validate(Config const & cfg, std::filesystem::path const & keyfile_or_output_path,
+			GenerateOptions const & options) {
+		AllowedIPsTrie trie;
+
+		_validate_keys(cfg.intf, keyfile_or_output_path);
+
+		for(Peer const & peer : cfg.peers) {
+			_validate_keys(peer);
+
+			if(options.strict_allowed_ips) {
+				trie.add_peer(peer.public_key, peer.allowed_ips);
+			}
+		}
+
+		_throw_allowed_ips_conflicts(trie);
+	}
+
+	// Parse input on options.threads threads and add it to a streaming
+	// builder, formatting its peers concurrently. Nothing is streamed
+	// unless the input is valid. The size of the output of each peer is
+	// recorded in sizes, if given.
+	static Config _add_parallel(SystemdConfigBuilder & builder, std::string const & interface_name, std::string_view input,
+			std::filesystem::path const & keyfile_or_output_path, GenerateOptions const & options,
+			std::vector<SystemdConfigBuilder::PeerSize> * sizes = nullptr) {
+		Config cfg = parse_config(interface_name, input, ParseOptions { .threads = options.threads });
+
+		_validate(cfg, keyfile_or_output_path, options);
+
+		size_t n_allowed_ips = 0;
+		for(Peer const & peer : cfg.peers) {
+			n_allowed_ips += peer.allowed_ips.size();
+		}
+
+		builder.add_interface(cfg.intf, cfg.has_default_route);
+		builder.reserve(cfg.peers.size(), n_allowed_ips);
+		if(sizes) {
+			sizes->resize(cfg.peers.size());
+		}
+
+		builder.add_peers(cfg.peers, options.threads, sizes ? std::span { *sizes } : std::span<SystemdConfigBuilder::PeerSize> {});
+
+		return cfg;
+	}
+
+	SystemdConfig wg2nd(std::string const & interface_name, std::string_view input,
+			SystemdSinks const & sinks,
+			std::filesystem::path const & keyfile_or_output_path,
+			std::optional<std::string> const & filename,
+			ActivationPolicy activation_policy,
+			GenerateOptions const & options) {
+		if(options.threads > 1) {
+			SystemdConfigBuilder builder { keyfile_or_output_path, filename, activation_policy, options };
+			builder.stream_to(sinks);
+
+			_add_parallel(builder, interface_name, input, keyfile_or_output_path, options);
+
+			return builder.finish();
+		}
+
+		// The headers depend on whether a peer has a default route, which
+		// is found (and the input validated) before streaming begins
+		bool has_default_route = _validate(interface_name, input, keyfile_or_output_path, options);
+
+		SystemdConfigBuilder builder { keyfile_or_output_path, filename, activation_policy, options };
+		builder.stream_to(sinks);
+
+		parse_config_streaming(interface_name, input, ParseCallbacks {
+			.on_interface = [&builder, has_default_route](Interface && intf) {
+				builder.add_interface(intf, has_default_route);
+			},
+			.on_peer = [&builder](Peer && peer) {
+				builder.add_peer(peer);
+			},
+		});
+
+		return builder.finish();
 	}
 
-	SystemdConfig gen_systemd_config(
-		Config const & cfg,
-		std::filesystem::path const & keyfile_or_output_path,
-		std::optional<std::string> const & filename,
-		ActivationPolicy activation_policy
-	) {
+	constexpr std::string_view OUTPUT_INDEX_MAGIC = "# wg2nd index 1\n";
 
-		// If the table is explicitly specified with Table=<number>,
-		// all routes are added to this table.
-		//
-		// If Table=auto and a default route exists, this
-		// table is used by the default route to supersede
-		// non-encrypted traffic traveling to /0 routes in the
-		// main routing table by using suppress_prefix policy rules.
-		// These routes match a fwmark which is identical to the
-		// table name. All other routes are placed in the main routing
-		// table.
-		//
-		// If Table=off, no routes are added.
-		uint32_t fwd_table = _deterministic_random_table(cfg.intf.name);
+	std::string OutputIndex::serialize() const {
+		OutputBuffer index { OUTPUT_INDEX_MAGIC.size() + 128 + peers.size() * 96 };
 
-		std::vector<SystemdFilespec> symmetric_keyfiles;
+		index << OUTPUT_INDEX_MAGIC
+		      << "settings " << Hex { settings_hash } << "\n"
+		      << "default-route " << int(has_default_route) << "\n"
+		      << "netdev " << netdev_size << "\n"
+		      << "network " << network_size << "\n";
 
-		std::filesystem::path keyfile_path;
-		std::filesystem::path output_path;
+		for(IndexedPeer const & peer : peers) {
+			index << "peer " << Hex { peer.hash }
+			      << " " << peer.netdev_offset << " " << peer.netdev_size
+			      << " " << peer.network_offset << " " << peer.network_size
+			      << " " << int(peer.policy_route)
+			      << " " << (peer.keyfile.empty() ? "-" : peer.keyfile) << "\n";
+		}
 
-		if(keyfile_or_output_path.has_filename()) {
-			keyfile_path = keyfile_or_output_path;
-			output_path = keyfile_or_output_path.parent_path();
-		} else {
-			std::string private_keyfile = private_keyfile_name(cfg.intf.private_key);
-			keyfile_path = keyfile_or_output_path / private_keyfile;
-			output_path = keyfile_or_output_path;
+		return index.take();
+	}
+
+	// Whether name is one public_keyfile_name() could have chosen, and so
+	// names a file within the output path
+	static bool _is_symmetric_keyfile_name(std::string_view name) {
+		constexpr std::string_view SUFFIX = SYMMETRIC_KEY_SUFFIX;
+		constexpr size_t PADDING = 4;
+		constexpr size_t N_DIGITS = WG_KEY_LEN_BASE32 - 1 - PADDING;
+
+		if(name.size() != N_DIGITS + PADDING + SUFFIX.size() or !name.ends_with(SUFFIX)) {
+			return false;
 		}
 
-		std::vector<std::string> warnings;
+		for(size_t i = 0; i < N_DIGITS; i++) {
+			if(!((name[i] >= 'A' and name[i] <= 'Z') or (name[i] >= '2' and name[i] <= '7'))) {
+				return false;
+			}
+		}
 
-#define WarnOnIntfField(field_, field_name) \
-if(!cfg.intf.field_.empty()) { \
-	warnings.push_back("[Interface] section contains a field \"" field_name "\" which does not have a systemd-networkd analog, omitting"); \
-}
+		return name.substr(N_DIGITS, PADDING) == "====";
+	}
 
-		WarnOnIntfField(preup, "PreUp")
-		WarnOnIntfField(postup, "PostUp")
-		WarnOnIntfField(predown, "PreDown")
-		WarnOnIntfField(postdown, "PostDown")
-		WarnOnIntfField(save_config, "SaveConfig")
+	std::optional<OutputIndex> OutputIndex::parse(std::string_view text) {
+		if(!text.starts_with(OUTPUT_INDEX_MAGIC)) {
+			return {};
+		}
+
+		text.remove_prefix(OUTPUT_INDEX_MAGIC.size());
+
+		// Consume the next space-separated field of the current line
+		auto field = [&text](bool last) -> std::string_view {
+			size_t end = text.find(last ? '\n' : ' ');
+			if(end == std::string_view::npos) {
+				end = text.size();
+			}
+
+			std::string_view value = text.substr(0, end);
+			text.remove_prefix(std::min(end + 1, text.size()));
+			return value;
+		};
+
+		auto number = [&field](bool last, int base, auto & value) {
+			std::string_view digits = field(last);
+			auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value, base);
+			return ec == std::errc() and end == digits.data() + digits.size() and !digits.empty();
+		};
+
+		OutputIndex index;
+		int has_default_route = 0;
+
+		bool ok = field(false) == "settings" and number(true, 16, index.settings_hash)
+		      and field(false) == "default-route" and number(true, 10, has_default_route)
+		      and field(false) == "netdev" and number(true, 10, index.netdev_size)
+		      and field(false) == "network" and number(true, 10, index.network_size);
+
+		index.has_default_route = has_default_route;
+
+		while(ok and !text.empty()) {
+			IndexedPeer peer;
+			int policy_route = 0;
+
+			ok = field(false) == "peer" and number(false, 16, peer.hash)
+			  and number(false, 10, peer.netdev_offset) and number(false, 10, peer.netdev_size)
+			  and number(false, 10, peer.network_offset) and number(false, 10, peer.network_size)
+			  and number(false, 10, policy_route);
+
+			peer.policy_route = policy_route;
+			peer.keyfile = field(true);
+
+			if(peer.keyfile == "-") {
+				peer.keyfile.clear();
+			} else if(!_is_symmetric_keyfile_name(peer.keyfile)) {
+				ok = false;
+			}
+
+			index.peers.push_back(std::move(peer));
+		}
 
-		if(!cfg.intf.preup.empty()) {
-			warnings.push_back("[Interface] section contains a field \"PreUp\" which does not have a systemd-networkd analog");
+		if(!ok) {
+			return {};
 		}
 
-		std::string const & basename = filename.value_or(cfg.intf.name);
+		return index;
+	}
 
-		return SystemdConfig {
-			.netdev = {
-				.name = basename + ".netdev",
-				.contents = _gen_netdev_cfg(cfg, fwd_table, keyfile_path, output_path, symmetric_keyfiles),
-			},
-			.network = {
-				.name = basename + ".network",
-				.contents = _gen_network_cfg(cfg, fwd_table, activation_policy)
-			},
-			.private_keyfile = {
-				.name = keyfile_path.filename(),
-				.contents = cfg.intf.private_key + "\n",
-			},
-			.symmetric_keyfiles = std::move(symmetric_keyfiles),
-			.warnings = std::move(warnings),
-			.firewall = _gen_nftables_firewall(cfg, fwd_table),
+	static uint64_t _hash_text(std::string_view text) {
+		constexpr uint8_t const SIP_KEY[8] = {
+			0x3c, 0x51, 0x0e, 0xa7,
+			0x92, 0x6b, 0xd4, 0x18,
 		};
+
+		uint64_t hash;
+
+		halfsiphash(text.data(), text.size(), SIP_KEY, (uint8_t *) &hash, sizeof(hash));
+
+		return hash;
 	}
 
-	SystemdConfig wg2nd(std::string const & interface_name, std::istream & stream,
+	// Split input into the text before its first [Peer] section and the text
+	// of each [Peer] section, unless the input is anything other than an
+	// [Interface] section followed by [Peer] sections
+	static std::optional<std::vector<std::string_view>> _split_peer_sections(std::string_view input) {
+		std::vector<std::string_view> sections;
+
+		ConfigTokenizer tokenizer { input };
+		ConfigTokenizer::Token token;
+
+		size_t begin = 0;
+		bool has_interface = false;
+
+		while(tokenizer.next(token)) {
+			if(token.type != ConfigTokenizer::TokenType::SECTION) {
+				continue;
+			}
+
+			if(token.key == "Interface" and !has_interface) {
+				has_interface = true;
+				continue;
+			}
+
+			if(token.key != "Peer" or !has_interface) {
+				return {};
+			}
+
+			size_t line_begin = input.rfind('\n', token.key.data() - input.data());
+			line_begin = line_begin == std::string_view::npos ? 0 : line_begin + 1;
+
+			sections.push_back(input.substr(begin, line_begin - begin));
+			begin = line_begin;
+		}
+
+		if(!has_interface) {
+			return {};
+		}
+
+		sections.push_back(input.substr(begin));
+
+		return sections;
+	}
+
+	static uint8_t _policy_route_of(Peer const & peer) {
+		uint8_t policy_route = POLICY_ROUTE_NONE;
+
+		for(Cidr const & cidr : peer.allowed_ips) {
+			if(cidr.is_default_route()) {
+				policy_route |= cidr.is_ipv4() ? POLICY_ROUTE_V4 : POLICY_ROUTE_V6;
+			}
+		}
+
+		return policy_route;
+	}
+
+	SystemdConfig wg2nd_incremental(std::string const & interface_name, std::string_view input,
+			SystemdSinks const & sinks,
+			PreviousOutput const * previous,
 			std::filesystem::path const & keyfile_or_output_path,
 			std::optional<std::string> const & filename,
-			ActivationPolicy activation_policy) {
-		return gen_systemd_config(
-			parse_config(interface_name, stream),
-			keyfile_or_output_path,
-			filename,
-			activation_policy
-		);
+			ActivationPolicy activation_policy,
+			GenerateOptions const & options) {
+		std::optional<std::vector<std::string_view>> sections = _split_peer_sections(input);
+
+		OutputIndex index;
+
+		// The sections of a peer depend on its own text, the [Interface]
+		// section, the name of the interface, and the path to its keyfiles.
+		// Coalesced routes are not attributed to peers.
+		if(sections and !options.coalesce_routes) {
+			std::string settings;
+
+			settings.append(VERSION).push_back('\0');
+			settings.append(interface_name).push_back('\0');
+			settings.append(keyfile_or_output_path.native()).push_back('\0');
+			settings.append(sections->front());
+
+			index.settings_hash = _hash_text(settings) | 1;
+		}
+
+		size_t n_peers = sections ? sections->size() - 1 : 0;
+
+		std::vector<uint64_t> hashes(n_peers);
+		for(size_t i = 0; i < n_peers; i++) {
+			hashes[i] = _hash_text((*sections)[i + 1]);
+		}
+
+		// The earlier output of each unchanged peer
+		std::vector<IndexedPeer const *> reused(n_peers, nullptr);
+		size_t n_reused = 0;
+
+		if(previous and index.settings_hash and previous->index.settings_hash == index.settings_hash
+				and previous->index.netdev_size == previous->netdev.size()
+				and previous->index.network_size == previous->network.size()) {
+			std::unordered_map<uint64_t, IndexedPeer const *> by_hash;
+
+			for(IndexedPeer const & peer : previous->index.peers) {
+				bool in_bounds = peer.netdev_offset <= previous->netdev.size()
+				             and peer.netdev_size <= previous->netdev.size() - peer.netdev_offset
+				             and peer.network_offset <= previous->network.size()
+				             and peer.network_size <= previous->network.size() - peer.network_offset;
+
+				if(in_bounds) {
+					by_hash.emplace(peer.hash, &peer);
+				}
+			}
+
+			for(size_t i = 0; i < n_peers; i++) {
+				auto it = by_hash.find(hashes[i]);
+
+				if(it != by_hash.end()) {
+					reused[i] = it->second;
+					n_reused++;
+				}
+			}
+		}
+
+		// Only the [Interface] and the changed peers are parsed. Errors are
+		// reported by parsing the configuration in full, as the line
+		// numbers within a section are not those of the input.
+		std::pmr::monotonic_buffer_resource arena;
+
+		std::optional<Interface> intf;
+		std::vector<Peer> changed;
+		// The keyfiles of reused peers, which are written again in case
+		// another interface sharing a peer removed them
+		std::vector<SystemdFilespec> reused_keyfiles;
+		size_t n_default_routes = 0;
+
+		if(n_reused > 0) {
+			try {
+				_parse_sections(interface_name, sections->front(), ParseCallbacks {
+					.on_interface = [&intf, &keyfile_or_output_path](Interface && parsed) {
+						_validate_keys(parsed, keyfile_or_output_path);
+						intf.emplace(std::move(parsed));
+					},
+					.on_peer = {},
+				}, &arena, false);
+
+				for(size_t i = 0; i < n_peers; i++) {
+					if(reused[i]) {
+						n_default_routes += reused[i]->policy_route != POLICY_ROUTE_NONE;
+
+						if(reused[i]->keyfile.empty()) {
+							continue;
+						}
+
+						_parse_sections(interface_name, (*sections)[i + 1], ParseCallbacks {
+							.on_interface = {},
+							.on_peer = [&reused_keyfiles, &name = reused[i]->keyfile](Peer && peer) {
+								reused_keyfiles.push_back(SystemdFilespec {
+									.name = name,
+									.contents = std::string(peer.preshared_key).append("\n"),
+								});
+							},
+						}, &arena, true);
+
+						continue;
+					}
+
+					_parse_sections(interface_name, (*sections)[i + 1], ParseCallbacks {
+						.on_interface = {},
+						.on_peer = [&changed, &n_default_routes](Peer && peer) {
+							_validate_keys(peer);
+							n_default_routes += _policy_route_of(peer) != POLICY_ROUTE_NONE;
+							changed.push_back(std::move(peer));
+						},
+					}, &arena, true);
+				}
+			} catch(ConfigurationException const &) {
+				parse_config_streaming(interface_name, input, {});
+				throw;
+			}
+
+			// Reported with the line number of the full parse, should it
+			// find the error
+			if(n_default_routes > 1) {
+				parse_config_streaming(interface_name, input, {});
+				throw ParsingException("Default routes exist on multiple peers");
+			}
+
+			// Routes were written for a table which depends on whether
+			// there is a default route
+			if((n_default_routes > 0) != previous->index.has_default_route) {
+				n_reused = 0;
+			}
+		}
+
+		if(n_reused > 0 and options.strict_allowed_ips) {
+			AllowedIPsTrie trie;
+			auto next_changed = changed.begin();
+
+			for(size_t i = 0; i < n_peers; i++) {
+				if(reused[i]) {
+					_add_formatted_allowed_ips(trie, previous->netdev.substr(reused[i]->netdev_offset, reused[i]->netdev_size));
+				} else {
+					trie.add_peer(next_changed->public_key, next_changed->allowed_ips);
+					next_changed++;
+				}
+			}
+
+			_throw_allowed_ips_conflicts(trie);
+		}
+
+		SystemdConfigBuilder builder { keyfile_or_output_path, filename, activation_policy, options };
+		builder.stream_to(sinks);
+
+		// Index each peer as it is added, if its section is known
+		auto add_peer = [&](size_t i, auto const & add) {
+			uint64_t netdev_offset = builder.netdev_offset();
+			uint64_t network_offset = builder.network_offset();
+
+			IndexedPeer peer = add();
+
+			if(i < n_peers and index.settings_hash) {
+				peer.hash = hashes[i];
+				peer.netdev_offset = netdev_offset;
+				peer.netdev_size = builder.netdev_offset() - netdev_offset;
+				peer.network_offset = network_offset;
+				peer.network_size = builder.network_offset() - network_offset;
+				index.peers.push_back(std::move(peer));
+			}
+		};
+
+		auto format_peer = [&builder](Peer const & peer) {
+			builder.add_peer(peer);
+
+			return IndexedPeer {
+				.policy_route = _policy_route_of(peer),
+				.keyfile = peer.preshared_key.empty() ? std::string() : public_keyfile_name(peer.public_key),
+			};
+		};
+
+		if(n_reused > 0) {
+			index.has_default_route = n_default_routes > 0;
+
+			builder.add_interface(*intf, index.has_default_route);
+
+			auto next_changed = changed.begin();
+
+			for(size_t i = 0; i < n_peers; i++) {
+				IndexedPeer const * earlier = reused[i];
+
+				add_peer(i, [&]() {
+					if(!earlier) {
+						return format_peer(*next_changed++);
+					}
+
+					builder.add_formatted_peer(
+						previous->netdev.substr(earlier->netdev_offset, earlier->netdev_size),
+						previous->network.substr(earlier->network_offset, earlier->network_size),
+						earlier->policy_route
+					);
+
+					return IndexedPeer {
+						.policy_route = earlier->policy_route,
+						.keyfile = earlier->keyfile,
+					};
+				});
+			}
+		} else if(options.threads > 1) {
+			std::vector<SystemdConfigBuilder::PeerSize> sizes;
+
+			Config cfg = _add_parallel(builder, interface_name, input, keyfile_or_output_path, options, &sizes);
+			index.has_default_route = cfg.has_default_route;
+
+			// The peers follow the headers, and end where the output does
+			uint64_t netdev_offset = builder.netdev_offset();
+			uint64_t network_offset = builder.network_offset();
+
+			for(SystemdConfigBuilder::PeerSize const & size : sizes) {
+				netdev_offset -= size.netdev;
+				network_offset -= size.network;
+			}
+
+			// The sections of the input were not those parsed
+			if(cfg.peers.size() != n_peers) {
+				index = OutputIndex {};
+			}
+
+			for(size_t i = 0; i < n_peers and index.settings_hash; i++) {
+				Peer const & peer = cfg.peers[i];
+
+				index.peers.push_back(IndexedPeer {
+					.hash = hashes[i],
+					.netdev_offset = netdev_offset,
+					.netdev_size = sizes[i].netdev,
+					.network_offset = network_offset,
+					.network_size = sizes[i].network,
+					.policy_route = _policy_route_of(peer),
+					.keyfile = peer.preshared_key.empty() ? std::string() : public_keyfile_name(peer.public_key),
+				});
+
+				netdev_offset += sizes[i].netdev;
+				network_offset += sizes[i].network;
+			}
+		} else {
+			index.has_default_route = _validate(interface_name, input, keyfile_or_output_path, options);
+
+			size_t i = 0;
+
+			parse_config_streaming(interface_name, input, ParseCallbacks {
+				.on_interface = [&builder, &index](Interface && intf) {
+					builder.add_interface(intf, index.has_default_route);
+				},
+				.on_peer = [&](Peer && peer) {
+					add_peer(i++, [&]() {
+						return format_peer(peer);
+					});
+				},
+			});
+
+			// The sections of the input were not those parsed
+			if(i != n_peers) {
+				index = OutputIndex {};
+			}
+		}
+
+		SystemdConfig cfg = builder.finish();
+
+		index.netdev_size = builder.netdev_offset();
+		index.network_size = builder.network_offset();
+
+		if(n_reused > 0) {
+			std::move(reused_keyfiles.begin(), reused_keyfiles.end(), std::back_inserter(cfg.symmetric_keyfiles));
+			cfg.reused_peers = n_reused;
+		}
+
+		// Every keyfile which the output names is kept, whether or not the
+		// output could be indexed
+		if(previous) {
+			std::unordered_set<std::string_view> keyfiles;
+			for(SystemdFilespec const & spec : cfg.symmetric_keyfiles) {
+				keyfiles.insert(spec.name);
+			}
+
+			for(IndexedPeer const & peer : previous->index.peers) {
+				if(!peer.keyfile.empty() and keyfiles.insert(peer.keyfile).second) {
+					cfg.removed_keyfiles.push_back(peer.keyfile);
+				}
+			}
+		}
+
+		cfg.index = SystemdFilespec {
+			.name = filename.value_or(interface_name) + ".wg2nd-index",
+			.contents = index.serialize(),
+		};
+
+		return cfg;
+	}
+
+	// Create the table of an interface if it does not exist, and empty it
+	// (along with its address set, whose elements survive a flush)
+	template<typename Family>
+	static void _write_table_replacement(OutputBuffer & firewall, std::string const & interface_name,
+			bool rule_per_address) {
+		constexpr FixedString TABLE = FixedString(
+			"add table ") + Family::IP + " {}\n"
+			"flush table " + Family::IP + " {}\n";
+
+		constexpr FixedString SET = FixedString(
+			"add set ") + Family::IP + " {} {}_addrs { type " + Family::ADDR_TYPE + "; }\n"
+			"flush set " + Family::IP + " {} {}_addrs\n";
+
+		firewall.format<TABLE>(interface_name, interface_name);
+
+		if(!rule_per_address) {
+			firewall.format<SET>(interface_name, interface_name, interface_name, interface_name);
+		}
+
+		firewall << "\n";
+	}
+
+	static void _write_json_string(OutputBuffer & json, std::string_view s) {
+		json << '"';
+
+		for(char c : s) {
+			if(c == '"' or c == '\\') {
+				json << '\\' << c;
+			} else if(uint8_t(c) < 0x20) {
+				char const * hex = "0123456789abcdef";
+				json << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+			} else {
+				json << c;
+			}
+		}
+
+		json << '"';
+	}
+
+	// Write the commands of the libnftables-json(5) schema which replace
+	// the table of one family of an interface
+	template<typename Family>
+	static void _write_table_json(OutputBuffer & json, Interface const & intf,
+			uint32_t fwd_table, bool rule_per_address) {
+		OutputBuffer family;
+		family << "\"family\": \"" << Family::IP.view() << "\"";
+
+		OutputBuffer name;
+		_write_json_string(name, intf.name);
+
+		OutputBuffer set_name;
+		_write_json_string(set_name, intf.name + "_addrs");
+
+		std::string_view protocol = Family::IP.view();
+
+		auto table = [&]() -> OutputBuffer & {
+			return json << "{" << family.view() << ", \"name\": " << name.view() << "}";
+		};
+
+		auto chain = [&](std::string_view chain_name, std::string_view hook, int priority) {
+			json << ",\n{\"add\": {\"chain\": {" << family.view() << ", \"table\": " << name.view()
+			     << ", \"name\": \"" << chain_name << "\", \"type\": \"filter\", \"hook\": \"" << hook
+			     << "\", \"prio\": " << priority << ", \"policy\": \"accept\"}}}";
+		};
+
+		auto rule = [&](std::string_view chain_name) -> OutputBuffer & {
+			return json << ",\n{\"add\": {\"rule\": {" << family.view() << ", \"table\": " << name.view()
+			            << ", \"chain\": \"" << chain_name << "\", \"expr\": [";
+		};
+
+		// Drops packets to daddr which did not arrive on the interface
+		auto drop_rule = [&](auto const & write_daddr) {
+			rule("preraw") << "{\"match\": {\"op\": \"!=\", \"left\": {\"meta\": {\"key\": \"iifname\"}}, \"right\": " << name.view() << "}}, "
+			               << "{\"match\": {\"op\": \"==\", \"left\": {\"payload\": {\"protocol\": \"" << protocol << "\", \"field\": \"daddr\"}}, \"right\": ";
+			write_daddr();
+			json << "}}, "
+			     << "{\"match\": {\"op\": \"!=\", \"left\": {\"fib\": {\"result\": \"type\", \"flags\": [\"saddr\"]}}, \"right\": \"local\"}}, "
+			     << "{\"drop\": null}]}}}";
+		};
+
+		json << ",\n{\"add\": {\"table\": ";
+		table() << "}}";
+		json << ",\n{\"flush\": {\"table\": ";
+		table() << "}}";
+
+		std::vector<Cidr> addrs;
+		for(auto it = intf.addresses.begin(); it != intf.addresses.end(); it++) {
+			bool duplicate = std::any_of(intf.addresses.begin(), it, [it](Cidr const & other) {
+				return other.family == it->family and other.addr == it->addr;
+			});
+
+			if(it->is_ipv4() == Family::IS_IPV4 and !duplicate) {
+				addrs.push_back(*it);
+			}
+		}
+
+		if(!rule_per_address) {
+			OutputBuffer set;
+			set << "{" << family.view() << ", \"table\": " << name.view() << ", \"name\": " << set_name.view()
+			    << ", \"type\": \"" << Family::ADDR_TYPE.view() << "\"";
+
+			json << ",\n{\"add\": {\"set\": " << set.view() << "}}}";
+			json << ",\n{\"flush\": {\"set\": " << set.view() << "}}}";
+
+			json << ",\n{\"add\": {\"element\": {" << family.view() << ", \"table\": " << name.view()
+			     << ", \"name\": " << set_name.view() << ", \"elem\": [";
+
+			for(size_t i = 0; i < addrs.size(); i++) {
+				json << (i > 0 ? ", \"" : "\"") << Address { addrs[i] } << "\"";
+			}
+
+			json << "]}}}";
+		}
+
+		chain("preraw", "prerouting", -300);
+
+		if(rule_per_address) {
+			for(Cidr const & addr : addrs) {
+				drop_rule([&]() {
+					json << "\"" << Address { addr } << "\"";
+				});
+			}
+		} else {
+			drop_rule([&]() {
+				json << "\"@" << set_name.view().substr(1);
+			});
+		}
+
+		chain("premangle", "prerouting", -150);
+		rule("premangle") << "{\"match\": {\"op\": \"==\", \"left\": {\"meta\": {\"key\": \"l4proto\"}}, \"right\": \"udp\"}}, "
+		                  << "{\"mangle\": {\"key\": {\"meta\": {\"key\": \"mark\"}}, \"value\": {\"ct\": {\"key\": \"mark\"}}}}]}}}";
+
+		chain("postmangle", "postrouting", -150);
+		rule("postmangle") << "{\"match\": {\"op\": \"==\", \"left\": {\"meta\": {\"key\": \"l4proto\"}}, \"right\": \"udp\"}}, "
+		                   << "{\"match\": {\"op\": \"==\", \"left\": {\"meta\": {\"key\": \"mark\"}}, \"right\": " << fwd_table << "}}, "
+		                   << "{\"mangle\": {\"key\": {\"ct\": {\"key\": \"mark\"}}, \"value\": {\"meta\": {\"key\": \"mark\"}}}}]}}}";
+	}
+
+	std::string gen_nftables_transaction(std::vector<Interface> const & interfaces, NftSyntax syntax,
+			GenerateOptions const & options) {
+		OutputBuffer firewall { interfaces.size() * 4 * NFT_TABLE_SIZE_HINT };
+
+		if(syntax == NftSyntax::JSON) {
+			firewall << "{\"nftables\": [\n{\"metainfo\": {\"json_schema_version\": 1}}";
+		}
+
+		for(Interface const & intf : interfaces) {
+			uint32_t fwd_table = _deterministic_random_table(intf.name);
+
+			OutputBuffer addrs_v4, addrs_v6;
+			for(auto it = intf.addresses.begin(); it != intf.addresses.end(); it++) {
+				_write_firewall_addr(it->is_ipv4() ? addrs_v4 : addrs_v6, intf, it, options.nft_rule_per_address);
+			}
+
+			auto write_family = [&](auto family, OutputBuffer const & addrs) {
+				using Family = decltype(family);
+
+				if(addrs.size() == 0) {
+					return;
+				}
+
+				if(syntax == NftSyntax::JSON) {
+					_write_table_json<Family>(firewall, intf, fwd_table, options.nft_rule_per_address);
+				} else {
+					_write_table_replacement<Family>(firewall, intf.name, options.nft_rule_per_address);
+					_write_table<Family>(firewall, intf.name, addrs.view(), fwd_table, options.nft_rule_per_address);
+					firewall << "\n";
+				}
+			};
+
+			write_family(NftIpv4 {}, addrs_v4);
+			write_family(NftIpv6 {}, addrs_v6);
+		}
+
+		if(syntax == NftSyntax::JSON) {
+			firewall << "\n]}\n";
+		}
+
+		return firewall.take();
 	}
 
 }
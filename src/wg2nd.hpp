@@ -7,14 +7,23 @@
 #pragma once
 
 #include <istream>
+#include <functional>
+#include <array>
 #include <exception>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
+#include <compare>
+#include <memory>
+#include <memory_resource>
+#include <span>
 
 #include <cstdint>
 
+#include "output.hpp"
+
 namespace wg2nd {
 
 	enum class ActivationPolicy {
@@ -22,20 +31,76 @@ namespace wg2nd {
 		UP,
 	};
 
+	enum class AddressFamily : uint8_t {
+		IPV4,
+		IPV6,
+	};
+
+	// An IPv4 or IPv6 prefix in binary form (e.g. 10.0.0.1/24 or fc00::1/128)
+	struct Cidr {
+		// Address bytes in network order, IPv4 addresses occupy
+		// the first four bytes and the remainder is zero
+		std::array<uint8_t, 16> addr;
+		AddressFamily family;
+		// Prefix length, the full address length if unspecified
+		uint8_t prefix_len;
+
+		// Longest text representation, "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255/128"
+		static constexpr size_t MAX_TEXT_LEN = 49;
+
+		bool is_ipv4() const noexcept {
+			return family == AddressFamily::IPV4;
+		}
+
+		// A prefix of length zero with an unspecified address (e.g. 0.0.0.0/0)
+		bool is_default_route() const noexcept {
+			uint8_t acc = 0;
+			for(uint8_t byte : addr) {
+				acc |= byte;
+			}
+			return prefix_len == 0 and acc == 0;
+		}
+
+		// Write the text representation (RFC 5952 for IPv6) to buf,
+		// which must hold MAX_TEXT_LEN characters. Returns the number
+		// of characters written.
+		size_t format(char * buf, bool with_prefix = true) const;
+
+		std::string to_string(bool with_prefix = true) const;
+
+		// Ordered by family, address, then prefix length
+		std::strong_ordering operator<=>(Cidr const & other) const noexcept {
+			if(family != other.family) {
+				return family <=> other.family;
+			}
+			if(addr != other.addr) {
+				return addr <=> other.addr;
+			}
+			return prefix_len <=> other.prefix_len;
+		}
+
+		bool operator==(Cidr const & other) const noexcept = default;
+	};
+
+	static_assert(sizeof(Cidr) == 18, "Cidr should remain packed");
+
+	// The strings and vectors of an Interface or Peer are allocated from the
+	// memory_resource given at construction (the global heap by default)
+
 	struct Interface {
 		// File name, or defaults to "wg"
 		std::string name;
 		// Address=...
 		// List of ip addresses to be assigned to the interface
-		std::vector<std::string> addresses;
+		std::pmr::vector<Cidr> addresses;
 		// PrivateKey=...
 		// Base64-encoded private key string
-		std::string private_key;
+		std::pmr::string private_key;
 		// MTu=..
-		std::string mtu;
+		std::pmr::string mtu;
 		// DNS=...
 		// DNS consists of a comma-separated list of IP addresses of DNS servers
-		std::vector<std::string> DNS;
+		std::pmr::vector<std::pmr::string> DNS;
 		// Table=...
 		// By default, wireguard creates routes. This is disabled, when Table=off
 		bool should_create_routes;
@@ -45,40 +110,54 @@ namespace wg2nd {
 		// The port number on which the interface will listen
 		std::optional<uint16_t> listen_port;
 		// PreUp, PostUp, PreDown PostDown
-		std::string preup, postup, predown, postdown;
+		std::pmr::string preup, postup, predown, postdown;
 		// SaveConfig
-		std::string save_config;
+		std::pmr::string save_config;
 
-		Interface()
-			: should_create_routes { false }
+		explicit Interface(std::pmr::memory_resource * resource = std::pmr::get_default_resource())
+			: addresses { resource }
+			, private_key { resource }
+			, mtu { resource }
+			, DNS { resource }
+			, should_create_routes { false }
 			, table { 0 }
 			, listen_port { }
+			, preup { resource }
+			, postup { resource }
+			, predown { resource }
+			, postdown { resource }
+			, save_config { resource }
 		{ }
 	};
 
-	struct Cidr {
-		std::string route;
-		bool is_default_route;
-		bool is_ipv4;
-	};
-
 	struct Peer {
 		// Endpoint=...
 		// IP and port of the peer
-		std::string endpoint;
+		std::pmr::string endpoint;
 		// PublicKey=...
-		std::string public_key;
+		std::pmr::string public_key;
 		// AllowedIPs=...
 		// Comma separated list of allowed ips
 		// Each allowed ip is a CIDR block
-		std::vector<Cidr> allowed_ips;
+		std::pmr::vector<Cidr> allowed_ips;
 		// PersistentAlive=...
-		std::string persistent_keepalive;
+		std::pmr::string persistent_keepalive;
 		// PresharedKey=...
-		std::string preshared_key;
+		std::pmr::string preshared_key;
+
+		explicit Peer(std::pmr::memory_resource * resource = std::pmr::get_default_resource())
+			: endpoint { resource }
+			, public_key { resource }
+			, allowed_ips { resource }
+			, persistent_keepalive { resource }
+			, preshared_key { resource }
+		{ }
 	};
 
 	struct Config {
+		// Back intf and peers, which are released with them at once
+		// rather than node by node
+		std::vector<std::unique_ptr<std::pmr::monotonic_buffer_resource>> arenas;
 		// [Interface]
 		Interface intf;
 		// [Peer]
@@ -89,6 +168,20 @@ namespace wg2nd {
 		Config()
 			: has_default_route { false }
 		{ }
+
+		// Allocate the interface from arena
+		explicit Config(std::unique_ptr<std::pmr::monotonic_buffer_resource> arena)
+			: arenas { }
+			, intf { arena.get() }
+			, has_default_route { false }
+		{
+			arenas.push_back(std::move(arena));
+		}
+
+		Config(Config &&) = default;
+
+		// intf and peers must be released before their arenas are replaced
+		Config & operator=(Config &&) = delete;
 	};
 
 	class ConfigurationException : public std::exception {
@@ -139,23 +232,422 @@ namespace wg2nd {
 
 		std::vector<std::string> warnings;
 		std::string firewall;
+
+		// The number of [Route] sections removed by coalescing
+		uint64_t removed_routes = 0;
+
+		// Written by wg2nd_incremental() (see OutputIndex)
+		SystemdFilespec index {};
+		// The number of peers whose sections were reused
+		uint64_t reused_peers = 0;
+		// Keyfiles of the previous output which this output no longer names
+		std::vector<std::string> removed_keyfiles {};
+	};
+
+	// Decode an address in CIDR notation (e.g. 10.0.0.1/24 or fc00::1/128)
+	// Returns an empty optional if the address or prefix is malformed
+	std::optional<Cidr> parse_cidr(std::string_view text);
+
+	// The fewest prefixes which cover the same addresses as routes, with
+	// duplicate and contained prefixes removed and adjacent prefixes merged.
+	// The result is sorted, and its host bits are cleared.
+	std::vector<Cidr> coalesce_routes(std::vector<Cidr> routes);
+
+	// Binary radix trie of the AllowedIPs of every peer, which finds the
+	// prefixes of one peer which equal, contain, or lie within those of
+	// another. WireGuard routes a duplicated prefix to the peer configured
+	// last, and a nested prefix to whichever is longer.
+	//
+	// The trie is path-compressed and each node summarizes the peers below
+	// it, so each prefix is inserted, and its conflict found, in time linear
+	// in the address length. At most one conflict is noted per prefix.
+	// Default routes are exempt, as they are meant to cover other prefixes.
+	class AllowedIPsTrie {
+
+		public:
+
+			// Conflicts described by report(), beyond which they are counted
+			static constexpr size_t MAX_REPORTED = 10;
+
+			AllowedIPsTrie();
+
+			// Reserve space for (an estimate of) the number of peers and
+			// allowed IPs which will be added
+			void reserve(size_t n_peers, size_t n_allowed_ips);
+
+			// Insert the allowed IPs of the next peer, which is named by
+			// its public key in the report
+			void add_peer(std::string_view public_key, std::span<Cidr const> allowed_ips);
+
+			uint64_t n_conflicts() const noexcept {
+				return _n_conflicts;
+			}
+
+			// A description of each reported conflict, in the order found,
+			// followed by the number of others
+			std::vector<std::string> report() const;
+
+		private:
+
+			using Key = std::array<uint64_t, 2>;
+
+			static constexpr uint32_t NIL = UINT32_MAX;
+
+			struct Node {
+				// The prefix, with its host bits cleared
+				Key key;
+				uint32_t child[2];
+				// The last peer given this prefix, if owned
+				uint32_t peer;
+				// One of the peers owning this or a node below it
+				uint32_t subtree_peer;
+				uint8_t len;
+				// If a peer has this prefix, rather than it being a fork
+				bool owned;
+				// If more than one peer owns this or a node below it
+				bool mixed;
+			};
+
+			enum class ConflictKind : uint8_t {
+				DUPLICATE,
+				WITHIN,
+				CONTAINS,
+			};
+
+			struct Conflict {
+				ConflictKind kind;
+				Cidr prefix;
+				uint32_t peer;
+				Cidr other;
+				uint32_t other_peer;
+			};
+
+			void _insert(Cidr const & cidr, uint32_t peer);
+			uint32_t _new_node(Key const & key, uint8_t len, uint32_t peer, bool owned);
+			// Recompute the summaries of node from it and its children
+			void _summarize(uint32_t node);
+			// A node at or below node owned by a peer other than peer
+			uint32_t _find_other(uint32_t node, uint32_t peer) const;
+			void _record(ConflictKind kind, Cidr const & prefix, uint32_t peer, uint32_t other);
+			std::string_view _public_key(uint32_t peer) const;
+
+			std::vector<Node> _nodes;
+			// Of IPv4 and IPv6
+			uint32_t _roots[2];
+			uint32_t _n_peers;
+			uint64_t _n_conflicts;
+			std::vector<Conflict> _conflicts;
+			// The public keys of the peers, concatenated, and where each ends
+			std::string _public_keys;
+			std::vector<uint32_t> _public_key_ends;
 	};
 
 	std::string interface_name_from_filename(std::filesystem::path config_path);
 
 	Config parse_config(std::string const & interface_name, std::istream & stream);
 
+	enum class DiagnosticCode : uint8_t {
+		EXPECTED_KEY_VALUE,
+		UNKNOWN_SECTION,
+		DUPLICATE_INTERFACE,
+		KEY_OUTSIDE_SECTION,
+		INVALID_KEY,
+		INVALID_ADDRESS,
+		INVALID_ALLOWED_IP,
+		INVALID_TABLE,
+		INVALID_PORT,
+		INVALID_KEY_FORMAT,
+		MULTIPLE_DEFAULT_ROUTES,
+		MISSING_FIELD,
+	};
+
+	// An error found while checking a configuration
+	struct Diagnostic {
+		// One-based line, or the line of the section header for missing fields
+		uint64_t line;
+		// One-based column of the offending text, or zero if it concerns
+		// the whole section
+		uint32_t column;
+		DiagnosticCode code;
+		std::string message;
+	};
+
+	// Validate a configuration, recording every error rather than stopping
+	// at the first. Diagnostics are returned in order of appearance (except
+	// that missing fields are reported once their section is complete).
+	std::vector<Diagnostic> check_config(std::string const & interface_name, std::string_view input);
+
+	// Inputs smaller than this are never split between threads
+	constexpr size_t PARALLEL_MIN_CHUNK_SIZE = 256 * 1024;
+
+	struct ParseOptions {
+		// Threads which parse [Peer] sections concurrently
+		unsigned threads = 1;
+	};
+
+	Config parse_config(std::string const & interface_name, std::string_view input, ParseOptions const & options = {});
+
+	// Receives the sections of a configuration as soon as each is complete
+	struct ParseCallbacks {
+		// The [Interface] section, delivered before any peer
+		std::function<void(Interface &&)> on_interface;
+		// Each [Peer] section, in order of appearance
+		std::function<void(Peer &&)> on_peer;
+	};
+
+	// Parse a configuration without retaining its peers. Each peer is handed
+	// to the callbacks and discarded, except for peers which precede the
+	// [Interface] section; these are held until it is complete.
+	//
+	// Returns true if one of the peers has a default route.
+	//
+	// The strings and vectors of each section are allocated from resource.
+	bool parse_config_streaming(std::string const & interface_name, std::string_view input, ParseCallbacks const & callbacks,
+		std::pmr::memory_resource * resource = std::pmr::get_default_resource());
+
+	struct GenerateOptions {
+		// Emit the fewest [Route] sections which cover the allowed IPs (see
+		// coalesce_routes), rather than one for each. The netdev still lists
+		// every allowed IP of each peer.
+		bool coalesce_routes = false;
+		// Drop packets to each interface address with a rule of its own, as
+		// wg-quick(8) does, rather than matching a set of the addresses
+		bool nft_rule_per_address = false;
+		// Throw a ConfigurationException, before anything is written,
+		// rather than warn when the AllowedIPs of peers conflict (see
+		// AllowedIPsTrie)
+		bool strict_allowed_ips = false;
+		// Threads which parse the input and format [Peer] sections
+		// concurrently (see add_peers). Input which is streamed is then
+		// parsed in full before any output is written.
+		unsigned threads = 1;
+	};
+
+	// The names of the private keyfiles of several interfaces, as chosen by
+	// SystemdConfigBuilder when no keyfile is given. The public keys are
+	// derived together, which is cheaper than one at a time. An improperly
+	// formatted private key has no name.
+	std::vector<std::optional<std::string>> private_keyfile_names(std::span<std::string const> priv_keys);
+
+	enum class NftSyntax {
+		// The nft(8) scripting language, as read by nft -f
+		SCRIPT,
+		// libnftables-json(5), as read by nft -j -f
+		JSON,
+	};
+
+	// The firewalls of several interfaces as one nftables transaction. Each
+	// table is created if absent and flushed, along with its address set,
+	// before it is filled, so the transaction can be applied repeatedly.
+	std::string gen_nftables_transaction(std::vector<Interface> const & interfaces, NftSyntax syntax,
+		GenerateOptions const & options = {});
+
+	// Destinations of the artifacts which are written as they are generated
+	struct SystemdSinks {
+		OutputSink * netdev;
+		OutputSink * network;
+	};
+
+	// Generates the systemd-networkd configuration one peer at a time
+	//
+	// Peer sections are written as peers are added; the remainder of the
+	// output, which depends on whether any peer has a default route, is
+	// written by finish().
+	class SystemdConfigBuilder {
+
+		public:
+
+			SystemdConfigBuilder(
+				std::filesystem::path const & keyfile_or_output_path,
+				std::optional<std::string> const & filename,
+				ActivationPolicy activation_policy = ActivationPolicy::MANUAL,
+				GenerateOptions const & options = {}
+			);
+
+			// Write the netdev and network to sinks as they are generated,
+			// rather than returning them from finish(). Must be called before
+			// add_interface(), which must then be told of any default route.
+			void stream_to(SystemdSinks const & sinks);
+
+			// Must be called once, before any peer is added. If it is known
+			// that a peer has a default route, the routes are written for
+			// their final table from the start rather than rewritten.
+			void add_interface(Interface const & intf, bool has_default_route = false);
+
+			// Reserve the output for (an estimate of) the number of peers
+			// and allowed IPs which will be added, after add_interface
+			void reserve(size_t n_peers, size_t n_allowed_ips);
+
+			void add_peer(Peer const & peer);
+
+			// Add a peer whose sections were formatted by an earlier
+			// builder with the same interface, and for which it was
+			// equally known whether a default route exists. policy_route
+			// records the default routes of the peer.
+			void add_formatted_peer(std::string_view netdev, std::string_view routes, uint8_t policy_route);
+
+			// The bytes of the netdev and network written for a peer
+			struct PeerSize {
+				uint64_t netdev;
+				uint64_t network;
+			};
+
+			// Add peers in order, formatting contiguous ranges of them on
+			// up to threads threads. The output is that of add_peer(). If
+			// given, sizes (of one per peer) receives the size of each.
+			void add_peers(std::span<Peer const> peers, unsigned threads, std::span<PeerSize> sizes = {});
+
+			SystemdConfig finish();
+
+			// Positions of the output of the next peer, when streaming
+			uint64_t netdev_offset() const noexcept {
+				return _netdev_peers.offset();
+			}
+
+			uint64_t network_offset() const noexcept {
+				return _network_routes.offset();
+			}
+
+		private:
+
+			// Note the default routes of peer, which place every route in
+			// the forwarding table
+			void _add_default_routes(Peer const & peer);
+			// Write the sections of peer, which depend on no other peer
+			void _write_peer(Peer const & peer, OutputBuffer & netdev, OutputBuffer & routes,
+				std::vector<Cidr> & destinations, std::vector<SystemdFilespec> & symmetric_keyfiles) const;
+			void _write_route(OutputBuffer & routes, Cidr const & cidr) const;
+			// Rewrite the routes written so far for table
+			void _retable_routes(uint32_t table);
+
+			void _write_netdev_header(OutputBuffer & netdev);
+			void _write_network_header(OutputBuffer & network);
+
+			std::string _gen_netdev_cfg();
+			std::string _gen_network_cfg();
+			std::string _gen_firewall();
+
+			std::filesystem::path _keyfile_or_output_path;
+			std::optional<std::string> _filename;
+			ActivationPolicy _activation_policy;
+			GenerateOptions _options;
+
+			Interface _intf;
+			uint32_t _fwd_table;
+			std::filesystem::path _keyfile_path;
+			std::filesystem::path _output_path;
+
+			// Each artifact is written as the interface and peers are added,
+			// except for headers which depend on every peer
+
+			// [WireGuardPeer] sections of the netdev
+			OutputBuffer _netdev_peers;
+			// Address= entries of the network
+			OutputBuffer _network_addresses;
+			// [Route] sections of the network, in _route_table
+			OutputBuffer _network_routes;
+			uint32_t _route_table;
+			// Destinations of the routes, which are written by finish()
+			// once coalesced
+			std::vector<Cidr> _routes;
+			uint64_t _removed_routes;
+			// Elements of the nftables address sets (or the drop rules, if
+			// there is a rule per address)
+			OutputBuffer _firewall_addrs_v4;
+			OutputBuffer _firewall_addrs_v6;
+			bool _has_default_route;
+			uint8_t _policy_route;
+
+			std::vector<SystemdFilespec> _symmetric_keyfiles;
+			std::vector<std::string> _warnings;
+			AllowedIPsTrie _allowed_ips;
+	};
+
 	SystemdConfig gen_systemd_config(
 		Config const & cfg,
 		std::filesystem::path const & keyfile_or_output_path,
 		std::optional<std::string> const & filename,
-		ActivationPolicy activation_policy = ActivationPolicy::MANUAL
+		ActivationPolicy activation_policy = ActivationPolicy::MANUAL,
+		GenerateOptions const & options = {}
 	);
 
 	SystemdConfig wg2nd(std::string const & interface_name, std::istream & stream,
 		std::filesystem::path const & keyfile_or_output_path,
 		std::optional<std::string> const & filename,
-		ActivationPolicy activation_policy = ActivationPolicy::MANUAL
+		ActivationPolicy activation_policy = ActivationPolicy::MANUAL,
+		GenerateOptions const & options = {}
+	);
+
+	SystemdConfig wg2nd(std::string const & interface_name, std::string_view input,
+		std::filesystem::path const & keyfile_or_output_path,
+		std::optional<std::string> const & filename,
+		ActivationPolicy activation_policy = ActivationPolicy::MANUAL,
+		GenerateOptions const & options = {}
+	);
+
+	// Generate the configuration as above, but write the netdev and network
+	// to sinks as they are generated, so that neither is held in memory. The
+	// input is validated before anything is written.
+	SystemdConfig wg2nd(std::string const & interface_name, std::string_view input,
+		SystemdSinks const & sinks,
+		std::filesystem::path const & keyfile_or_output_path,
+		std::optional<std::string> const & filename,
+		ActivationPolicy activation_policy = ActivationPolicy::MANUAL,
+		GenerateOptions const & options = {}
+	);
+
+	// A peer of an installed configuration, as recorded in its index
+	struct IndexedPeer {
+		// Hash of the text of the [Peer] section
+		uint64_t hash = 0;
+		// Its [WireGuardPeer] section in the netdev
+		uint64_t netdev_offset = 0;
+		uint64_t netdev_size = 0;
+		// Its [Route] sections in the network
+		uint64_t network_offset = 0;
+		uint64_t network_size = 0;
+		// The default routes among its allowed IPs
+		uint8_t policy_route = 0;
+		// The name of its PresharedKeyFile, if any
+		std::string keyfile;
+	};
+
+	// Sidecar of an installed netdev and network which locates the output
+	// of each peer, so that it can be reused once the configuration changes
+	struct OutputIndex {
+		// Hash of the version of wg2nd, the interface and everything else
+		// the sections of a peer depend upon; zero if nothing can be reused
+		uint64_t settings_hash = 0;
+		bool has_default_route = false;
+		// The sizes of the netdev and network
+		uint64_t netdev_size = 0;
+		uint64_t network_size = 0;
+		std::vector<IndexedPeer> peers;
+
+		std::string serialize() const;
+
+		// Returns an empty optional if text is not an index of this version
+		static std::optional<OutputIndex> parse(std::string_view text);
+	};
+
+	// The output of an earlier installation of a configuration
+	struct PreviousOutput {
+		OutputIndex index;
+		std::string_view netdev;
+		std::string_view network;
+	};
+
+	// Generate the configuration as above, streaming the netdev and network,
+	// and index the output. The sections of peers whose text is unchanged
+	// since previous (if given) are copied rather than parsed and formatted,
+	// and their keyfiles are not returned again.
+	SystemdConfig wg2nd_incremental(std::string const & interface_name, std::string_view input,
+		SystemdSinks const & sinks,
+		PreviousOutput const * previous,
+		std::filesystem::path const & keyfile_or_output_path,
+		std::optional<std::string> const & filename,
+		ActivationPolicy activation_policy = ActivationPolicy::MANUAL,
+		GenerateOptions const & options = {}
 	);
 
 };
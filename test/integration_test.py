@@ -1,5 +1,6 @@
 from pathlib import Path
 from enum import Enum
+import json
 import subprocess
 import sys
 
@@ -20,11 +21,13 @@ class Wg2ndFileType( Enum ):
     KEYFILE = 'keyfile'
     NFT = 'nft'
 
-def wg2nd_generate(filetype: Wg2ndFileType, path: Path):
+def wg2nd_generate(filetype: Wg2ndFileType, path: Path | list[Path], *flags: str):
+
+    paths = path if isinstance(path, list) else [path]
 
     try:
         result = subprocess.run([
-            WG2ND_EXECUTABLE, 'generate', '-t', filetype.value, str(path)
+            WG2ND_EXECUTABLE, 'generate', *flags, '-t', filetype.value, *map(str, paths)
         ], capture_output=True, check=True)
     except FileNotFoundError:
         die(f'Failed to find executable "{WG2ND_EXECUTABLE}"')
@@ -47,15 +50,53 @@ for test in TESTS:
     expected_netdev = read_config(test_directory / f'{test}.netdev')
     expected_network = read_config(test_directory / f'{test}.network')
     expected_nftables = read_config(test_directory / 'nftables.conf')
+    expected_nftables_rules = read_config(test_directory / 'nftables-rules.conf')
 
     network = wg2nd_generate(Wg2ndFileType.NETWORK, wg_config)
     netdev = wg2nd_generate(Wg2ndFileType.NETDEV, wg_config)
     nftables = wg2nd_generate(Wg2ndFileType.NFT, wg_config)
+    nftables_rules = wg2nd_generate(Wg2ndFileType.NFT, wg_config, '-r')
 
     print(f'testing {test}')
 
     assert network == expected_network
     assert netdev == expected_netdev
     assert nftables == expected_nftables
+    assert nftables_rules == expected_nftables_rules
 
     print('pass')
+
+# One transaction for the firewalls of every interface, in both syntaxes
+batch_configs = [ Path(TEST_DIRECTORY) / test / f'{test}.conf' for test in TESTS ]
+
+expected_batch = read_config(Path(TEST_DIRECTORY) / 'nftables-batch.conf')
+expected_batch_json = read_config(Path(TEST_DIRECTORY) / 'nftables-batch.json')
+
+batch = wg2nd_generate(Wg2ndFileType.NFT, batch_configs)
+batch_json = wg2nd_generate(Wg2ndFileType.NFT, batch_configs, '-j')
+
+print('testing batch')
+
+assert batch == expected_batch
+assert batch_json == expected_batch_json
+
+# The JSON must survive a round trip, and hold only libnftables commands
+commands = json.loads(batch_json)['nftables']
+
+assert json.loads(json.dumps(commands)) == commands
+assert commands[0] == { 'metainfo': { 'json_schema_version': 1 } }
+
+for command in commands[1:]:
+    [(verb, obj)] = command.items()
+    [(kind, _)] = obj.items()
+
+    assert verb in ('add', 'flush')
+    assert kind in ('table', 'set', 'element', 'chain', 'rule')
+
+tables = [ cmd['add']['table'] for cmd in commands if 'table' in cmd.get('add', {}) ]
+
+assert tables == [
+    { 'family': family, 'name': test } for test in TESTS for family in ('ip', 'ip6')
+]
+
+print('pass')
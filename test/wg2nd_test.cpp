@@ -1,8 +1,19 @@
 #include "utest.h"
 
 #include "wg2nd.hpp"
+#include "tokenizer.hpp"
+#include "keys.hpp"
+#include "crypto/pubkey.hpp"
 #include <sstream>
+#include <vector>
 #include <array>
+#include <utility>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <cstdio>
+#include <unistd.h>
 
 namespace wg2nd {
 	extern bool _is_default_route(std::string const & cidr);
@@ -11,6 +22,52 @@ namespace wg2nd {
 
 using namespace wg2nd;
 
+// Allocations made through operator new, for measuring the parser
+static uint64_t allocations = 0;
+
+// The replacement operators are paired with malloc/free, which GCC
+// flags once they are inlined
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void * operator new(std::size_t size) {
+	allocations++;
+
+	if(void * p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept {
+	std::free(p);
+}
+
+// std::pmr::new_delete_resource() allocates through the aligned forms
+void * operator new(std::size_t size, std::align_val_t align) {
+	allocations++;
+
+	size_t alignment = size_t(align);
+
+	if(void * p = std::aligned_alloc(alignment, (size / alignment + 1) * alignment)) {
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t, std::align_val_t) noexcept {
+	std::free(p);
+}
+
 UTEST(wg2nd, ip_helpers) {
 
 	std::array<std::string, 8> default_routes = {
@@ -66,6 +123,208 @@ UTEST(wg2nd, ip_helpers) {
 	}
 }
 
+UTEST(wg2nd, cidr_parser) {
+
+	std::optional<Cidr> v4 = parse_cidr("192.168.7.1/24");
+	ASSERT_TRUE(v4.has_value());
+	ASSERT_TRUE(v4->is_ipv4());
+	ASSERT_EQ(v4->prefix_len, 24);
+	ASSERT_EQ(v4->addr[0], 192);
+	ASSERT_EQ(v4->addr[1], 168);
+	ASSERT_EQ(v4->addr[2], 7);
+	ASSERT_EQ(v4->addr[3], 1);
+
+	std::optional<Cidr> host = parse_cidr("10.0.0.1");
+	ASSERT_TRUE(host.has_value());
+	ASSERT_EQ(host->prefix_len, 32);
+
+	std::optional<Cidr> shorthand = parse_cidr("10.1/8");
+	ASSERT_TRUE(shorthand.has_value());
+	ASSERT_EQ(shorthand->addr[0], 10);
+	ASSERT_EQ(shorthand->addr[1], 0);
+	ASSERT_EQ(shorthand->addr[2], 0);
+	ASSERT_EQ(shorthand->addr[3], 1);
+
+	std::optional<Cidr> v6 = parse_cidr("2001:db8::ff00:42:8329/64");
+	ASSERT_TRUE(v6.has_value());
+	ASSERT_FALSE(v6->is_ipv4());
+	ASSERT_EQ(v6->prefix_len, 64);
+
+	std::array<uint8_t, 16> expected_v6 = {
+		0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0xff, 0x00, 0x00, 0x42, 0x83, 0x29,
+	};
+	ASSERT_TRUE(v6->addr == expected_v6);
+
+	std::optional<Cidr> mapped = parse_cidr("::ffff:10.0.0.1/128");
+	ASSERT_TRUE(mapped.has_value());
+	ASSERT_EQ(mapped->addr[10], 0xff);
+	ASSERT_EQ(mapped->addr[11], 0xff);
+	ASSERT_EQ(mapped->addr[12], 10);
+	ASSERT_EQ(mapped->addr[15], 1);
+
+	ASSERT_TRUE(parse_cidr("1:2:3:4:5:6:7::").has_value());
+	ASSERT_TRUE(parse_cidr("::").has_value());
+
+	std::array<std::string, 18> invalid = {
+		"",
+		"/24",
+		"10.55.127.342",
+		"10.55.127.342/32",
+		"256.0.0.1",
+		"10.0.0.1/33",
+		"10.0.0.1/",
+		"10.0.0.1/8/8",
+		"1.2.3.4.5",
+		"10..0.1",
+		"fe80::1/129",
+		"1::2::3",
+		"12345::",
+		":1::",
+		"1:2:3:4:5:6:7:8:9",
+		"1:2:3:4:5:6:7:8::",
+		"::ffff:10.0.0",
+		"example.com",
+	};
+
+	for(std::string const & s : invalid) {
+		ASSERT_FALSE(parse_cidr(s).has_value());
+	}
+}
+
+UTEST(wg2nd, cidr_format) {
+
+	std::array<std::pair<std::string, std::string>, 12> canonical = {{
+		{ "10.0.0.1/24", "10.0.0.1/24" },
+		{ "10.0.0.1", "10.0.0.1/32" },
+		{ "0/0", "0.0.0.0/0" },
+		{ "::0/0", "::/0" },
+		{ "0000:0000:0000:0000::/0", "::/0" },
+		{ "2001:0DB8:0000:0000::/64", "2001:db8::/64" },
+		{ "2001:db8:0:0:1:0:0:1/128", "2001:db8::1:0:0:1/128" },
+		{ "2001:db8:0:1:1:1:1:1/64", "2001:db8:0:1:1:1:1:1/64" },
+		{ "fe80::1/128", "fe80::1/128" },
+		{ "1:2:3:4:5:6:7::/128", "1:2:3:4:5:6:7:0/128" },
+		{ "::ffff:10.0.0.1/128", "::ffff:10.0.0.1/128" },
+		{ "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff/128", "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff/128" },
+	}};
+
+	for(auto const & [text, expected] : canonical) {
+		std::optional<Cidr> cidr = parse_cidr(text);
+		ASSERT_TRUE(cidr.has_value());
+		ASSERT_TRUE(cidr->to_string() == expected);
+	}
+
+	ASSERT_TRUE(parse_cidr("fc00::6:ad78/128")->to_string(false) == "fc00::6:ad78");
+	ASSERT_TRUE(parse_cidr("192.168.1.1/24")->to_string(false) == "192.168.1.1");
+
+	ASSERT_TRUE(*parse_cidr("10.0.0.1/32") == *parse_cidr("10.0.0.1"));
+	ASSERT_TRUE(*parse_cidr("10.0.0.1/24") < *parse_cidr("10.0.0.1/32"));
+	ASSERT_TRUE(*parse_cidr("255.0.0.0/8") < *parse_cidr("::/0"));
+}
+
+UTEST(wg2nd, key_lookup) {
+	for(KeyDef const & def : CONFIG_KEYS) {
+		KeyDef const * found = lookup_key(def.name);
+
+		ASSERT_TRUE(found == &def);
+	}
+
+	static_assert(lookup_key("AllowedIPs")->key == ConfigKey::ALLOWED_IPS);
+	static_assert(lookup_key("ListenPort")->section == KeySection::INTERFACE);
+
+	std::array<std::string_view, 8> unknown = {
+		"",
+		"A",
+		"FwMark",
+		"privatekey",
+		"PrivateKeys",
+		"PrivateKe",
+		"Allowedips",
+		"PersistentKeepAlive",
+	};
+
+	for(std::string_view key : unknown) {
+		ASSERT_TRUE(lookup_key(key) == nullptr);
+	}
+}
+
+UTEST(wg2nd, scanners_agree) {
+	std::vector<ScanBlocksFn> scanners = { scan_blocks_scalar };
+
+#if defined(__SSE2__)
+	scanners.push_back(scan_blocks_sse2);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_has_avx2()) {
+		scanners.push_back(scan_blocks_avx2);
+	}
+#endif
+
+	char block[SCAN_BLOCK_SIZE];
+	uint32_t state = 1;
+
+	for(int round = 0; round < 256; round++) {
+		for(char & c : block) {
+			state = state * 1103515245 + 12345;
+			c = " \t\r\n#=[]aZ0,"[(state >> 16) % 14];
+		}
+
+		ScanMasks expected;
+		scan_blocks_scalar(block, 1, &expected);
+
+		for(ScanBlocksFn scan : scanners) {
+			ScanMasks masks;
+			scan(block, 1, &masks);
+
+			ASSERT_EQ(masks.newline, expected.newline);
+			ASSERT_EQ(masks.comment, expected.comment);
+			ASSERT_EQ(masks.equals, expected.equals);
+			ASSERT_EQ(masks.bracket, expected.bracket);
+			ASSERT_EQ(masks.space, expected.space);
+		}
+	}
+
+	// Lines which straddle block boundaries, with CRLF line endings
+	std::string input;
+	for(int i = 0; i < 40; i++) {
+		input += std::string(i % 7, ' ') + "[Peer]\r\n";
+		input += std::string(i % 5, '\t') + "AllowedIPs" + std::string(i % 3, ' ')
+			+ "=  10.0.0." + std::to_string(i) + "/32 \t# comment =\r\n";
+		input += "\r\n" + std::string(i, ' ') + "# " + std::string(i, '=') + "\r\n";
+		input += "  [ Interface ]  \r\n";
+		input += std::string(70 + i, ' ') + "junk" + std::string(i, ' ') + "\r\n";
+	}
+
+	for(ScanBlocksFn scan : scanners) {
+		ConfigTokenizer tokenizer { input, scan };
+		ConfigTokenizer::Token token;
+
+		for(int i = 0; i < 40; i++) {
+			ASSERT_TRUE(tokenizer.next(token));
+			ASSERT_TRUE(token.type == ConfigTokenizer::TokenType::SECTION);
+			ASSERT_TRUE(token.key == "Peer");
+			ASSERT_EQ(token.line_no, uint64_t(6 * i + 1));
+
+			ASSERT_TRUE(tokenizer.next(token));
+			ASSERT_TRUE(token.type == ConfigTokenizer::TokenType::KEY_VALUE);
+			ASSERT_TRUE(token.key == "AllowedIPs");
+			ASSERT_TRUE(token.value == "10.0.0." + std::to_string(i) + "/32");
+
+			ASSERT_TRUE(tokenizer.next(token));
+			ASSERT_TRUE(token.type == ConfigTokenizer::TokenType::SECTION);
+			ASSERT_TRUE(token.key == "Interface");
+
+			ASSERT_TRUE(tokenizer.next(token));
+			ASSERT_TRUE(token.type == ConfigTokenizer::TokenType::INVALID);
+			ASSERT_TRUE(token.key == "junk");
+			ASSERT_EQ(token.line_no, uint64_t(6 * i + 6));
+		}
+
+		ASSERT_FALSE(tokenizer.next(token));
+	}
+}
+
 // Typical configuration, similar to that provided by mullvad.net
 char const * CONFIG1 = (
 	"[Interface]\n"
@@ -120,6 +379,21 @@ const char * INVALID_CONFIG = (
 	"[Interface]\n"
 );
 
+const char * INVALID_ADDRESS_CONFIG = (
+	"[Interface]\n"
+	"PrivateKey = kPvfTBQxgHpaXI9wVj6JrtYKIJLVXrf0zg6ON7qUxl8=\n"
+	"Address = 10.55.127.342/32\n"
+);
+
+const char * INVALID_ALLOWED_IPS_CONFIG = (
+	"[Interface]\n"
+	"PrivateKey = kPvfTBQxgHpaXI9wVj6JrtYKIJLVXrf0zg6ON7qUxl8=\n"
+	"Address = 10.55.127.1/32\n"
+	"[Peer]\n"
+	"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+	"AllowedIPs = 10.0.0.0/8, 2001:db8::/300\n"
+);
+
 
 UTEST(wg2nd, parses_config) {
 
@@ -139,12 +413,12 @@ UTEST(wg2nd, parses_config) {
 	const Peer & peer = cfg.peers[0];
 
 	ASSERT_STREQ(peer.endpoint.c_str(), "194.36.25.33:51820");
-	ASSERT_STREQ(peer.allowed_ips[0].route.c_str(), "0.0.0.0/0");
-	ASSERT_TRUE(peer.allowed_ips[0].is_ipv4);
-	ASSERT_TRUE(peer.allowed_ips[0].is_default_route);
-	ASSERT_STREQ(peer.allowed_ips[1].route.c_str(), "::0/0");
-	ASSERT_FALSE(peer.allowed_ips[1].is_ipv4);
-	ASSERT_TRUE(peer.allowed_ips[1].is_default_route);
+	ASSERT_TRUE(peer.allowed_ips[0].to_string() == "0.0.0.0/0");
+	ASSERT_TRUE(peer.allowed_ips[0].is_ipv4());
+	ASSERT_TRUE(peer.allowed_ips[0].is_default_route());
+	ASSERT_TRUE(peer.allowed_ips[1].to_string() == "::/0");
+	ASSERT_FALSE(peer.allowed_ips[1].is_ipv4());
+	ASSERT_TRUE(peer.allowed_ips[1].is_default_route());
 
 	ASSERT_STREQ(peer.public_key.c_str(), "kMIIVxitU3/1AnAGwdL5KazDQ97MnkuEVz2sWihALnQ=");
 	ASSERT_STREQ(peer.preshared_key.c_str(), "");
@@ -166,9 +440,9 @@ UTEST(wg2nd, parses_config) {
 	const Peer &peer2_1 = cfg2.peers[0];
 
 	ASSERT_STREQ(peer2_1.endpoint.c_str(), "203.0.113.1:51820");
-	ASSERT_STREQ(peer2_1.allowed_ips[0].route.c_str(), "192.168.1.2/32");
-	ASSERT_TRUE(peer2_1.allowed_ips[0].is_ipv4);
-	ASSERT_FALSE(peer2_1.allowed_ips[0].is_default_route);
+	ASSERT_TRUE(peer2_1.allowed_ips[0].to_string() == "192.168.1.2/32");
+	ASSERT_TRUE(peer2_1.allowed_ips[0].is_ipv4());
+	ASSERT_FALSE(peer2_1.allowed_ips[0].is_default_route());
 	ASSERT_STREQ(peer2_1.public_key.c_str(), "sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=");
 	ASSERT_STREQ(peer2_1.preshared_key.c_str(), "");
 	ASSERT_STREQ(peer2_1.persistent_keepalive.c_str(), "");
@@ -176,9 +450,9 @@ UTEST(wg2nd, parses_config) {
 	const Peer &peer2_2 = cfg2.peers[1];
 
 	ASSERT_STREQ(peer2_2.endpoint.c_str(), "203.0.113.2:51820");
-	ASSERT_STREQ(peer2_2.allowed_ips[0].route.c_str(), "192.168.1.3/32");
-	ASSERT_TRUE(peer2_2.allowed_ips[0].is_ipv4);
-	ASSERT_FALSE(peer2_2.allowed_ips[0].is_default_route);
+	ASSERT_TRUE(peer2_2.allowed_ips[0].to_string() == "192.168.1.3/32");
+	ASSERT_TRUE(peer2_2.allowed_ips[0].is_ipv4());
+	ASSERT_FALSE(peer2_2.allowed_ips[0].is_default_route());
 	ASSERT_STREQ(peer2_2.public_key.c_str(), "kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=");
 	ASSERT_STREQ(peer2_2.preshared_key.c_str(), "");
 	ASSERT_STREQ(peer2_2.persistent_keepalive.c_str(), "");
@@ -202,9 +476,9 @@ UTEST(wg2nd, parses_config) {
 	const Peer &peer3 = cfg3.peers[0];
 
 	ASSERT_STREQ(peer3.endpoint.c_str(), "203.0.113.1:51820");
-	ASSERT_STREQ(peer3.allowed_ips[0].route.c_str(), "192.168.1.2/32");
-	ASSERT_TRUE(peer3.allowed_ips[0].is_ipv4);
-	ASSERT_FALSE(peer3.allowed_ips[0].is_default_route);
+	ASSERT_TRUE(peer3.allowed_ips[0].to_string() == "192.168.1.2/32");
+	ASSERT_TRUE(peer3.allowed_ips[0].is_ipv4());
+	ASSERT_FALSE(peer3.allowed_ips[0].is_default_route());
 	ASSERT_STREQ(peer3.public_key.c_str(), "kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=");
 	ASSERT_STREQ(peer3.preshared_key.c_str(), "KIst3pK+YVHmM5k7NbNULKd2px9vaRsFi/y4E7NDWDQ=");
 	ASSERT_STREQ(peer3.persistent_keepalive.c_str(), "25");
@@ -214,6 +488,1017 @@ UTEST(wg2nd, parses_config) {
 	std::istringstream ss4 { INVALID_CONFIG };
 
 	ASSERT_EXCEPTION(parse_config("wg", ss4), ParsingException);
+
+	std::istringstream ss5 { INVALID_ADDRESS_CONFIG };
+
+	ASSERT_EXCEPTION(parse_config("wg", ss5), ParsingException);
+
+	std::istringstream ss6 { INVALID_ALLOWED_IPS_CONFIG };
+
+	ASSERT_EXCEPTION(parse_config("wg", ss6), ParsingException);
+}
+
+UTEST(wg2nd, parses_config_streaming) {
+	std::vector<std::string> events;
+
+	ParseCallbacks callbacks {
+		.on_interface = [&events](Interface && intf) {
+			events.push_back(std::string("interface ").append(intf.private_key));
+		},
+		.on_peer = [&events](Peer && peer) {
+			events.push_back(std::string("peer ").append(peer.public_key));
+		},
+	};
+
+	// Peers are delivered as they complete
+	ASSERT_TRUE(parse_config_streaming("wg", CONFIG1, callbacks));
+	ASSERT_EQ(events.size(), 2ull);
+	ASSERT_TRUE(events[0] == "interface APmSX97Yww7WyHrQGG3u7oUJAKRazSyXVu9lD+A3aW8=");
+	ASSERT_TRUE(events[1] == "peer kMIIVxitU3/1AnAGwdL5KazDQ97MnkuEVz2sWihALnQ=");
+
+	// Peers preceding the interface are held until it is complete
+	events.clear();
+	ASSERT_FALSE(parse_config_streaming("wg", CONFIG2, callbacks));
+	ASSERT_EQ(events.size(), 3ull);
+	ASSERT_TRUE(events[0] == "interface ED3TF8deMhmXHa7Jrp024uv5T7jKl7611vFV3C1P+EY=");
+	ASSERT_TRUE(events[1] == "peer sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=");
+	ASSERT_TRUE(events[2] == "peer kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=");
+
+	char const * missing_public_key = (
+		"[Interface]\n"
+		"PrivateKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"Address = 192.168.1.1/24\n"
+		"[Peer]\n"
+		"AllowedIPs = 192.168.1.2/32\n"
+	);
+
+	ASSERT_EXCEPTION(parse_config_streaming("wg", missing_public_key, callbacks), ConfigurationException);
+
+	char const * multiple_default_routes = (
+		"[Interface]\n"
+		"PrivateKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"Address = 192.168.1.1/24\n"
+		"[Peer]\n"
+		"PublicKey = sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=\n"
+		"AllowedIPs = 0.0.0.0/0\n"
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"AllowedIPs = ::/0\n"
+	);
+
+	ASSERT_EXCEPTION(parse_config_streaming("wg", multiple_default_routes, callbacks), ParsingException);
+
+	char const * duplicate_interface = (
+		"[Interface]\n"
+		"PrivateKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"Address = 192.168.1.1/24\n"
+		"[Peer]\n"
+		"PublicKey = sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=\n"
+		"AllowedIPs = 192.168.1.2/32\n"
+		"[Interface]\n"
+		"ListenPort = 4444\n"
+	);
+
+	ASSERT_EXCEPTION(parse_config_streaming("wg", duplicate_interface, callbacks), ParsingException);
+}
+
+UTEST(wg2nd, generates_routes_in_one_pass) {
+	// The default route follows a route in another table
+	char const * late_default_route = (
+		"[Interface]\n"
+		"PrivateKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"Address = 192.168.1.1/24\n"
+		"Table = 1234\n"
+		"[Peer]\n"
+		"PublicKey = sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=\n"
+		"AllowedIPs = 192.168.1.2/32\n"
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"AllowedIPs = 10.0.0.0/8, 0.0.0.0/0\n"
+	);
+
+	// Streamed without knowledge of the default route, the first route
+	// is rewritten; from a Config it is written for the final table
+	SystemdConfig streamed = wg2nd::wg2nd("wg", std::string_view { late_default_route }, "/etc/systemd/network/", {});
+	SystemdConfig generated = gen_systemd_config(parse_config("wg", std::string_view { late_default_route }), "/etc/systemd/network/", {});
+
+	ASSERT_TRUE(streamed.netdev.contents == generated.netdev.contents);
+	ASSERT_TRUE(streamed.network.contents == generated.network.contents);
+	ASSERT_TRUE(streamed.firewall == generated.firewall);
+
+	std::string_view network = streamed.network.contents;
+	ASSERT_EQ(network.find("Table = 1234"), std::string_view::npos);
+
+	size_t n_routes = 0;
+	for(size_t pos = network.find("[Route]\n"); pos != std::string_view::npos; pos = network.find("[Route]\n", pos + 1)) {
+		std::string_view route = network.substr(pos, network.find("\n\n", pos) - pos);
+		ASSERT_NE(route.find("\nTable = "), std::string_view::npos);
+		n_routes++;
+	}
+	ASSERT_EQ(n_routes, 3ull);
+}
+
+UTEST(wg2nd, check_config) {
+	char const * config = (
+		"[Interface]\n"
+		"PrivateKey = abc\n"
+		"Address = 10.0.0.1/33, 10.0.0.2/24\n"
+		"Foo = 1\n"
+		"[Peer]\n"
+		"AllowedIPs = 0.0.0.0/0\n"
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"AllowedIPs = 10.0.0.0/8, ::/0\n"
+		"junk\n"
+	);
+
+	std::vector<Diagnostic> diagnostics = check_config("wg", config);
+
+	ASSERT_EQ(diagnostics.size(), 6ull);
+
+	ASSERT_TRUE(diagnostics[0].code == DiagnosticCode::INVALID_KEY_FORMAT);
+	ASSERT_EQ(diagnostics[0].line, 2ull);
+	ASSERT_EQ(diagnostics[0].column, 14u);
+
+	ASSERT_TRUE(diagnostics[1].code == DiagnosticCode::INVALID_ADDRESS);
+	ASSERT_EQ(diagnostics[1].line, 3ull);
+	ASSERT_EQ(diagnostics[1].column, 11u);
+
+	ASSERT_TRUE(diagnostics[2].code == DiagnosticCode::INVALID_KEY);
+	ASSERT_EQ(diagnostics[2].line, 4ull);
+	ASSERT_EQ(diagnostics[2].column, 1u);
+
+	// Reported at the header, once the section is complete
+	ASSERT_TRUE(diagnostics[3].code == DiagnosticCode::MISSING_FIELD);
+	ASSERT_EQ(diagnostics[3].line, 5ull);
+	ASSERT_EQ(diagnostics[3].column, 0u);
+
+	ASSERT_TRUE(diagnostics[4].code == DiagnosticCode::MULTIPLE_DEFAULT_ROUTES);
+	ASSERT_EQ(diagnostics[4].line, 9ull);
+	ASSERT_EQ(diagnostics[4].column, 26u);
+
+	ASSERT_TRUE(diagnostics[5].code == DiagnosticCode::EXPECTED_KEY_VALUE);
+	ASSERT_EQ(diagnostics[5].line, 10ull);
+
+	// The messages match those of the exceptions
+	ASSERT_TRUE(diagnostics[1].message == "Invalid address: 10.0.0.1/33");
+
+	ASSERT_EQ(check_config("wg", CONFIG1).size(), 0ull);
+	ASSERT_EQ(check_config("wg", CONFIG3).size(), 0ull);
+}
+
+// A hub with n_peers spokes
+struct StringSink : public OutputSink {
+	std::string contents;
+
+	void write(std::string_view data) override {
+		contents.append(data);
+	}
+};
+
+static std::string hub_config(size_t n_peers) {
+	std::string cfg = (
+		"[Interface]\n"
+		"PrivateKey = APmSX97Yww7WyHrQGG3u7oUJAKRazSyXVu9lD+A3aW8=\n"
+		"Address = 10.0.0.1/8, fc00::1/64\n"
+		"DNS = 10.0.0.2, 10.0.0.3\n"
+	);
+
+	for(size_t i = 0; i < n_peers; i++) {
+		char buf[256];
+
+		snprintf(buf, sizeof(buf),
+			"[Peer]\n"
+			"PublicKey = kMIIVxitU3/1AnAGwdL5KazDQ9%016zxA=\n"
+			"AllowedIPs = 10.%zu.%zu.%zu/32, fc00::%zx/128\n"
+			"Endpoint = 203.0.%zu.%zu:51820\n"
+			"PersistentKeepalive = 25\n",
+			i, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, i, (i >> 8) & 0xff, i & 0xff);
+
+		cfg += buf;
+	}
+
+	return cfg;
+}
+
+UTEST(wg2nd, arena_allocations) {
+	std::string input = hub_config(10000);
+
+	// Each string and vector on the global heap
+	uint64_t before = allocations;
+
+	std::vector<Peer> heap_peers;
+	parse_config_streaming("wg", input, ParseCallbacks {
+		.on_interface = [](Interface &&) {},
+		.on_peer = [&heap_peers](Peer && peer) {
+			heap_peers.push_back(std::move(peer));
+		},
+	});
+
+	uint64_t heap_allocations = allocations - before;
+
+	// Everything but the array of peers in the arena of the Config
+	before = allocations;
+
+	Config cfg = parse_config("wg", input);
+
+	uint64_t arena_allocations = allocations - before;
+
+	ASSERT_EQ(cfg.peers.size(), 10000ull);
+	ASSERT_EQ(heap_peers.size(), 10000ull);
+	ASSERT_TRUE(cfg.peers.back().public_key == heap_peers.back().public_key);
+	ASSERT_TRUE(cfg.peers.back().allowed_ips == heap_peers.back().allowed_ips);
+
+	ASSERT_LT(arena_allocations * 100, heap_allocations);
+}
+
+UTEST(wg2nd, parses_config_parallel) {
+	std::string input = hub_config(10000);
+
+	Config sequential = parse_config("wg", input);
+	Config parallel = parse_config("wg", input, ParseOptions { .threads = 4 });
+
+	// The input is large enough to be split
+	ASSERT_GT(parallel.arenas.size(), 1ull);
+
+	ASSERT_TRUE(parallel.intf.private_key == sequential.intf.private_key);
+	ASSERT_TRUE(parallel.intf.addresses == sequential.intf.addresses);
+	ASSERT_EQ(parallel.peers.size(), sequential.peers.size());
+	ASSERT_FALSE(parallel.has_default_route);
+
+	for(size_t i = 0; i < parallel.peers.size(); i++) {
+		ASSERT_TRUE(parallel.peers[i].public_key == sequential.peers[i].public_key);
+		ASSERT_TRUE(parallel.peers[i].allowed_ips == sequential.peers[i].allowed_ips);
+		ASSERT_TRUE(parallel.peers[i].endpoint == sequential.peers[i].endpoint);
+	}
+
+	// Errors are reported on the same line
+	std::string invalid = input + (
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"AllowedIPs = 10.0.0.0/33\n"
+	);
+
+	uint64_t invalid_line = std::count(invalid.begin(), invalid.end(), '\n');
+
+	try {
+		parse_config("wg", invalid, ParseOptions { .threads = 4 });
+		ASSERT_TRUE(false);
+	} catch(ParsingException const & e) {
+		ASSERT_TRUE(e.line_no() == invalid_line);
+	}
+
+	// Default routes on peers in separate chunks
+	std::string default_routes = input + (
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"AllowedIPs = ::/0\n"
+	);
+
+	default_routes.insert(default_routes.find("AllowedIPs = ") + 13, "0.0.0.0/0, ");
+
+	ASSERT_EXCEPTION(parse_config("wg", default_routes, ParseOptions { .threads = 4 }), ParsingException);
+}
+
+UTEST(wg2nd, generates_peers_parallel) {
+	Config cfg = parse_config("wg", hub_config(20000));
+
+	// Keyfiles from every range, and a default route in the last, which
+	// is not announced by the Config
+	for(size_t i = 0; i < cfg.peers.size(); i += 997) {
+		cfg.peers[i].preshared_key = "Ao6ffStBC6ImBhUIvnzhrlZnn6F0Wc5fD4GS4fIeBBM=";
+	}
+
+	cfg.peers[19000].allowed_ips.push_back(*parse_cidr("0.0.0.0/0"));
+
+	for(bool coalesce : { false, true }) {
+		SystemdConfig sequential = gen_systemd_config(cfg, "/etc/systemd/network/", {}, ActivationPolicy::MANUAL,
+			GenerateOptions { .coalesce_routes = coalesce });
+		SystemdConfig parallel = gen_systemd_config(cfg, "/etc/systemd/network/", {}, ActivationPolicy::MANUAL,
+			GenerateOptions { .coalesce_routes = coalesce, .threads = 4 });
+
+		ASSERT_TRUE(parallel.netdev.contents == sequential.netdev.contents);
+		ASSERT_TRUE(parallel.network.contents == sequential.network.contents);
+		ASSERT_EQ(parallel.removed_routes, sequential.removed_routes);
+		ASSERT_EQ(parallel.symmetric_keyfiles.size(), 21ull);
+
+		for(size_t i = 0; i < parallel.symmetric_keyfiles.size(); i++) {
+			ASSERT_TRUE(parallel.symmetric_keyfiles[i].name == sequential.symmetric_keyfiles[i].name);
+		}
+	}
+
+	// A key which fails in a worker is thrown from the caller, and the
+	// first in peer order is the one reported
+	cfg.peers[15952].public_key = "second!!";
+	cfg.peers[5982].public_key = "first!!";
+
+	std::string message;
+	try {
+		gen_systemd_config(cfg, "/etc/systemd/network/", {}, ActivationPolicy::MANUAL, GenerateOptions { .threads = 4 });
+	} catch(ParsingException const & ex) {
+		message = ex.what();
+	}
+
+	ASSERT_TRUE(message.find("first!!") != std::string::npos);
+
+	// Streamed and indexed output, parsed and formatted on threads, is
+	// that of one thread
+	std::string input = hub_config(20000) + (
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"PresharedKey = Ao6ffStBC6ImBhUIvnzhrlZnn6F0Wc5fD4GS4fIeBBM=\n"
+		"AllowedIPs = 0.0.0.0/0\n"
+	);
+
+	auto install = [&input](unsigned threads, StringSink & netdev, StringSink & network) {
+		return wg2nd_incremental("wg", input, SystemdSinks { .netdev = &netdev, .network = &network },
+			nullptr, "/etc/systemd/network/", {}, ActivationPolicy::MANUAL, GenerateOptions { .threads = threads });
+	};
+
+	StringSink netdev, network, parallel_netdev, parallel_network;
+	SystemdConfig sequential = install(1, netdev, network);
+	SystemdConfig parallel = install(4, parallel_netdev, parallel_network);
+
+	ASSERT_TRUE(parallel_netdev.contents == netdev.contents);
+	ASSERT_TRUE(parallel_network.contents == network.contents);
+	ASSERT_TRUE(parallel.index.contents == sequential.index.contents);
+	ASSERT_EQ(parallel.symmetric_keyfiles.size(), 1ull);
+
+	StringSink streamed_netdev, streamed_network;
+	wg2nd::wg2nd("wg", std::string_view { input }, SystemdSinks { .netdev = &streamed_netdev, .network = &streamed_network },
+		"/etc/systemd/network/", {}, ActivationPolicy::MANUAL, GenerateOptions { .threads = 4 });
+
+	ASSERT_TRUE(streamed_netdev.contents == netdev.contents);
+	ASSERT_TRUE(streamed_network.contents == network.contents);
+
+	// Nor is anything streamed before a key fails
+	input.replace(input.find("kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs="), 44, "notbase64!!");
+
+	StringSink bad_netdev, bad_network;
+	ASSERT_EXCEPTION(install(4, bad_netdev, bad_network), ParsingException);
+	ASSERT_TRUE(bad_netdev.contents.empty());
+	ASSERT_TRUE(bad_network.contents.empty());
+}
+
+UTEST(wg2nd, coalesce_routes) {
+	auto coalesce = [](std::vector<std::string> const & texts) {
+		std::vector<Cidr> routes;
+		for(std::string const & text : texts) {
+			routes.push_back(*parse_cidr(text));
+		}
+
+		std::vector<std::string> coalesced;
+		for(Cidr const & cidr : coalesce_routes(routes)) {
+			coalesced.push_back(cidr.to_string());
+		}
+		return coalesced;
+	};
+
+	using Routes = std::vector<std::string>;
+
+	// Duplicates, containment, and host bits
+	ASSERT_TRUE(coalesce({ "10.0.0.1/32", "10.0.0.1" }) == Routes({ "10.0.0.1/32" }));
+	ASSERT_TRUE(coalesce({ "10.0.0.7/32", "10.0.0.0/24" }) == Routes({ "10.0.0.0/24" }));
+	ASSERT_TRUE(coalesce({ "10.0.0.1/24" }) == Routes({ "10.0.0.0/24" }));
+	ASSERT_TRUE(coalesce({ "10.1.2.3/32", "0.0.0.0/0", "fd00::1/128" }) == Routes({ "0.0.0.0/0", "fd00::1/128" }));
+
+	// Siblings merge repeatedly, but not across a boundary
+	ASSERT_TRUE(coalesce({ "10.0.0.3/32", "10.0.0.0/32", "10.0.0.2/32", "10.0.0.1/32" }) == Routes({ "10.0.0.0/30" }));
+	ASSERT_TRUE(coalesce({ "10.0.0.1/32", "10.0.0.2/32" }) == Routes({ "10.0.0.1/32", "10.0.0.2/32" }));
+	ASSERT_TRUE(coalesce({ "10.0.1.0/24", "10.0.0.0/25", "10.0.0.128/25" }) == Routes({ "10.0.0.0/23" }));
+	ASSERT_TRUE(coalesce({ "fd00::/128", "fd00::1/128", "192.168.0.0/17", "192.168.128.0/17" })
+		== Routes({ "192.168.0.0/16", "fd00::/127" }));
+
+	// Generated routes, with the count removed
+	SystemdConfig cfg = gen_systemd_config(parse_config("wg", hub_config(256)), "/etc/systemd/network/", {},
+		ActivationPolicy::MANUAL, GenerateOptions { .coalesce_routes = true });
+
+	std::string_view network = cfg.network.contents;
+
+	size_t n_routes = 0;
+	for(size_t pos = network.find("[Route]"); pos != std::string_view::npos; pos = network.find("[Route]", pos + 1)) {
+		n_routes++;
+	}
+
+	ASSERT_EQ(n_routes + cfg.removed_routes, 512ull);
+	ASSERT_LT(n_routes, 8ull);
+
+	// The netdev is unaffected
+	std::string_view netdev = cfg.netdev.contents;
+
+	size_t n_allowed_ips = 0;
+	for(size_t pos = netdev.find("AllowedIPs = "); pos != std::string_view::npos; pos = netdev.find("AllowedIPs = ", pos + 1)) {
+		n_allowed_ips++;
+	}
+
+	ASSERT_EQ(n_allowed_ips, 512ull);
+}
+
+UTEST(wg2nd, nft_address_sets) {
+	char const * addresses = (
+		"[Interface]\n"
+		"PrivateKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"Address = 192.168.1.1/24, 10.0.0.1/8, fc00::1/64, 192.168.1.1/32\n"
+	);
+
+	Config cfg = parse_config("wg", std::string_view { addresses });
+
+	std::string sets = gen_systemd_config(cfg, "/etc/systemd/network/", {}).firewall;
+
+	ASSERT_NE(sets.find("    elements = { 192.168.1.1, 10.0.0.1 }\n"), std::string::npos);
+	ASSERT_NE(sets.find("    elements = { fc00::1 }\n"), std::string::npos);
+	ASSERT_NE(sets.find("iifname != \"wg\" ip daddr @wg_addrs fib saddr type != local drop;\n"), std::string::npos);
+	ASSERT_NE(sets.find("iifname != \"wg\" ip6 daddr @wg_addrs fib saddr type != local drop;\n"), std::string::npos);
+
+	std::string rules = gen_systemd_config(cfg, "/etc/systemd/network/", {}, ActivationPolicy::MANUAL,
+		GenerateOptions { .nft_rule_per_address = true }).firewall;
+
+	ASSERT_EQ(rules.find("@wg_addrs"), std::string::npos);
+	ASSERT_NE(rules.find("iifname != \"wg\" ip daddr 10.0.0.1 fib saddr type != local drop;\n"), std::string::npos);
+}
+
+UTEST(wg2nd, output_templates) {
+	using Route = OutputTemplate<"[Route]\nDestination = {}\nTable = {}\n\n">;
+
+	static_assert(Route::N_FIELDS == 2);
+	static_assert(Route::PIECES[0] == "[Route]\nDestination = ");
+	static_assert(Route::PIECES[2] == "\n\n");
+
+	constexpr FixedString TABLE = FixedString("table ") + "ip6" + " {} {\n";
+	static_assert(TABLE.view() == "table ip6 {} {\n");
+
+	OutputBuffer out;
+	out.format<"[Route]\nDestination = {}\nTable = {}\n\n">(*parse_cidr("10.0.0.0/8"), 1234u);
+	out.format<"{}{}">('{', "}");
+	out.format<"no fields\n">();
+
+	ASSERT_TRUE(out.view() == "[Route]\nDestination = 10.0.0.0/8\nTable = 1234\n\n{}no fields\n");
+}
+
+UTEST(wg2nd, streams_to_sinks) {
+	std::string input = hub_config(5000);
+
+	SystemdConfig buffered = wg2nd::wg2nd("wg", std::string_view { input }, "/etc/systemd/network/", {});
+
+	// The netdev passes through the ring of an FdSink, followed by a
+	// write larger than a buffer
+	FILE * netdev_file = tmpfile();
+	ASSERT_TRUE(netdev_file != nullptr);
+
+	FdSink netdev_sink { fileno(netdev_file) };
+	StringSink network_sink;
+
+	SystemdConfig streamed = wg2nd::wg2nd("wg", std::string_view { input },
+		SystemdSinks { .netdev = &netdev_sink, .network = &network_sink }, "/etc/systemd/network/", {});
+
+	std::string large(3 * FdSink::BUFFER_SIZE / 2, '#');
+	netdev_sink.write(large);
+	netdev_sink.flush();
+
+	std::string netdev(buffered.netdev.contents.size() + large.size(), '\0');
+	ASSERT_EQ(pread(fileno(netdev_file), netdev.data(), netdev.size(), 0), ssize_t(netdev.size()));
+	fclose(netdev_file);
+
+	ASSERT_TRUE(streamed.netdev.contents.empty());
+	ASSERT_TRUE(streamed.network.contents.empty());
+	ASSERT_TRUE(netdev == buffered.netdev.contents + large);
+	ASSERT_TRUE(network_sink.contents == buffered.network.contents);
+	ASSERT_TRUE(streamed.firewall == buffered.firewall);
+
+	// Nothing is streamed when a key cannot name its keyfile
+	std::string bad_key = input + (
+		"[Peer]\n"
+		"PublicKey = notbase64!!\n"
+		"PresharedKey = Ao6ffStBC6ImBhUIvnzhrlZnn6F0Wc5fD4GS4fIeBBM=\n"
+		"AllowedIPs = 192.168.7.0/24\n"
+	);
+
+	StringSink bad_netdev, bad_network;
+	ASSERT_EXCEPTION(wg2nd::wg2nd("wg", std::string_view { bad_key },
+		SystemdSinks { .netdev = &bad_netdev, .network = &bad_network }, "/etc/systemd/network/", {}),
+		ParsingException);
+	ASSERT_EXCEPTION(wg2nd_incremental("wg", bad_key,
+		SystemdSinks { .netdev = &bad_netdev, .network = &bad_network }, nullptr, "/etc/systemd/network/", {}),
+		ParsingException);
+	ASSERT_TRUE(bad_netdev.contents.empty());
+	ASSERT_TRUE(bad_network.contents.empty());
+
+	// A default route must be known before streaming begins
+	char const * default_route = (
+		"[Interface]\n"
+		"PrivateKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"Address = 192.168.1.1/24\n"
+		"[Peer]\n"
+		"PublicKey = sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=\n"
+		"AllowedIPs = 0.0.0.0/0\n"
+	);
+
+	Config cfg = parse_config("wg", std::string_view { default_route });
+	NullSink discard;
+
+	SystemdConfigBuilder builder { "/etc/systemd/network/", {} };
+	builder.stream_to(SystemdSinks { .netdev = &discard, .network = &discard });
+	builder.add_interface(cfg.intf);
+
+	ASSERT_EXCEPTION(builder.add_peer(cfg.peers[0]), std::logic_error);
+}
+
+UTEST(wg2nd, reuses_unchanged_peers) {
+	std::string psk_peer = (
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"PresharedKey = Ao6ffStBC6ImBhUIvnzhrlZnn6F0Wc5fD4GS4fIeBBM=\n"
+		"AllowedIPs = 192.168.7.0/24\n"
+	);
+
+	std::string input = hub_config(3000) + psk_peer;
+
+	auto install = [](std::string const & input, PreviousOutput const * previous, StringSink & netdev, StringSink & network) {
+		return wg2nd_incremental("wg", input, SystemdSinks { .netdev = &netdev, .network = &network },
+			previous, "/etc/systemd/network/", {});
+	};
+
+	StringSink netdev, network;
+	SystemdConfig first = install(input, nullptr, netdev, network);
+
+	std::optional<OutputIndex> index = OutputIndex::parse(first.index.contents);
+	ASSERT_TRUE(index.has_value());
+	ASSERT_EQ(index->peers.size(), 3001ull);
+	ASSERT_TRUE(index->serialize() == first.index.contents);
+	ASSERT_EQ(first.symmetric_keyfiles.size(), 1ull);
+
+	// A keyfile outside of the output path is never named
+	std::string const & keyfile = first.symmetric_keyfiles[0].name;
+	for(std::string tampered : { std::string("/tmp/kt/victim"), "../" + keyfile.substr(3), keyfile.substr(1) + "A", "a" + keyfile.substr(1) }) {
+		std::string text = first.index.contents;
+		text.replace(text.find(keyfile), keyfile.size(), tampered);
+		ASSERT_FALSE(OutputIndex::parse(text).has_value());
+	}
+
+	// Nor is a section beyond the end of the output
+	PreviousOutput overflowing {
+		.index = *index,
+		.netdev = netdev.contents,
+		.network = network.contents,
+	};
+	for(IndexedPeer & peer : overflowing.index.peers) {
+		peer.netdev_offset = UINT64_MAX - peer.netdev_size / 2;
+	}
+
+	StringSink overflowing_netdev, overflowing_network;
+	ASSERT_EQ(install(input, &overflowing, overflowing_netdev, overflowing_network).reused_peers, 0ull);
+
+	// Change one peer, remove the one with a keyfile, and add another
+	std::string changed = input.substr(0, input.size() - psk_peer.size());
+	changed.replace(changed.find("Endpoint = 203.0.0.7:"), 21, "Endpoint = 198.51.100.7:");
+	changed += (
+		"[Peer]\n"
+		"PublicKey = sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=\n"
+		"AllowedIPs = 192.168.8.0/24\n"
+	);
+
+	PreviousOutput previous {
+		.index = std::move(*index),
+		.netdev = netdev.contents,
+		.network = network.contents,
+	};
+
+	StringSink reused_netdev, reused_network;
+	SystemdConfig second = install(changed, &previous, reused_netdev, reused_network);
+
+	StringSink full_netdev, full_network;
+	install(changed, nullptr, full_netdev, full_network);
+
+	ASSERT_EQ(second.reused_peers, 2999ull);
+	ASSERT_TRUE(reused_netdev.contents == full_netdev.contents);
+	ASSERT_TRUE(reused_network.contents == full_network.contents);
+	ASSERT_TRUE(second.symmetric_keyfiles.empty());
+	ASSERT_EQ(second.removed_keyfiles.size(), 1ull);
+	ASSERT_TRUE(second.removed_keyfiles[0] == first.symmetric_keyfiles[0].name);
+
+	// Nor are the unchanged peers streamed before a changed key fails
+	std::string bad_key = changed + (
+		"[Peer]\n"
+		"PublicKey = notbase64!!\n"
+		"PresharedKey = Ao6ffStBC6ImBhUIvnzhrlZnn6F0Wc5fD4GS4fIeBBM=\n"
+		"AllowedIPs = 192.168.9.0/24\n"
+	);
+
+	StringSink bad_netdev, bad_network;
+	ASSERT_EXCEPTION(install(bad_key, &previous, bad_netdev, bad_network), ParsingException);
+	ASSERT_TRUE(bad_netdev.contents.empty());
+
+	// The keyfile of a reused peer is written again, should another
+	// interface sharing the peer have removed it
+	StringSink same_netdev, same_network;
+	SystemdConfig same = install(input, &previous, same_netdev, same_network);
+
+	ASSERT_EQ(same.reused_peers, 3001ull);
+	ASSERT_EQ(same.symmetric_keyfiles.size(), 1ull);
+	ASSERT_TRUE(same.symmetric_keyfiles[0].name == first.symmetric_keyfiles[0].name);
+	ASSERT_TRUE(same.symmetric_keyfiles[0].contents == first.symmetric_keyfiles[0].contents);
+
+	// Nor when two changed peers have default routes
+	std::string two_defaults = changed + (
+		"[Peer]\n"
+		"PublicKey = kB9CSPsPS5irR0ZpVAHZKPNHLQKjIFjmgc6MSCAiWUs=\n"
+		"AllowedIPs = 0.0.0.0/0\n"
+		"[Peer]\n"
+		"PublicKey = cJgeEfHUay0aKpV+k1lFK9nq9JJcqzKm8+Wh3EGtg1c=\n"
+		"AllowedIPs = 0.0.0.0/0\n"
+	);
+
+	ASSERT_EXCEPTION(install(two_defaults, &previous, bad_netdev, bad_network), ParsingException);
+	ASSERT_TRUE(bad_netdev.contents.empty());
+
+	// Coalesced output is not indexed, yet it still names the keyfile
+	StringSink coalesced_netdev, coalesced_network;
+	SystemdConfig coalesced = wg2nd_incremental("wg", input,
+		SystemdSinks { .netdev = &coalesced_netdev, .network = &coalesced_network },
+		&previous, "/etc/systemd/network/", {}, ActivationPolicy::MANUAL, GenerateOptions { .coalesce_routes = true });
+
+	ASSERT_EQ(coalesced.symmetric_keyfiles.size(), 1ull);
+	ASSERT_TRUE(coalesced.removed_keyfiles.empty());
+
+	// Nothing is reused once the interface changes
+	std::string retabled = changed;
+	retabled.insert(retabled.find("DNS"), "Table = 1234\n");
+
+	StringSink retabled_netdev, retabled_network;
+	ASSERT_EQ(install(retabled, &previous, retabled_netdev, retabled_network).reused_peers, 0ull);
+	ASSERT_TRUE(retabled_network.contents.find("Table = 1234") != std::string::npos);
+}
+
+UTEST(wg2nd, allowed_ips_conflicts) {
+	auto cidrs = [](std::vector<std::string> const & texts) {
+		std::vector<Cidr> allowed_ips;
+		for(std::string const & text : texts) {
+			allowed_ips.push_back(*parse_cidr(text));
+		}
+		return allowed_ips;
+	};
+
+	AllowedIPsTrie trie;
+	trie.add_peer("A", cidrs({ "10.0.0.0/16", "fc00::/64", "0.0.0.0/0", "10.0.0.0/16" }));
+	trie.add_peer("B", cidrs({ "10.0.0.0/16", "10.0.8.0/24", "fc00:1::/64", "0.0.0.0/0" }));
+	trie.add_peer("C", cidrs({ "10.0.7.0/24", "fc00::/48", "192.168.0.1/32" }));
+	trie.add_peer("D", cidrs({ "10.2.0.0/16" }));
+
+	// The prefixes of one peer, and default routes, do not conflict. A
+	// duplicated prefix belongs to the last peer.
+	std::vector<std::string> expected = {
+		"AllowedIPs 10.0.0.0/16 of [Peer] B duplicates that of [Peer] A",
+		"AllowedIPs 10.0.7.0/24 of [Peer] C is within 10.0.0.0/16 of [Peer] B",
+		"AllowedIPs fc00::/48 of [Peer] C contains fc00::/64 of [Peer] A",
+	};
+
+	ASSERT_EQ(trie.n_conflicts(), 3ull);
+	ASSERT_TRUE(trie.report() == expected);
+
+	// A duplicated prefix leaves no trace of its previous peer
+	AllowedIPsTrie taken;
+	taken.add_peer("A", cidrs({ "10.0.0.0/24" }));
+	taken.add_peer("B", cidrs({ "10.0.0.0/24", "10.0.0.0/16", "10.0.0.0/8" }));
+	taken.add_peer("C", cidrs({ "10.0.0.0/25" }));
+
+	std::vector<std::string> expected_taken = {
+		"AllowedIPs 10.0.0.0/24 of [Peer] B duplicates that of [Peer] A",
+		"AllowedIPs 10.0.0.0/25 of [Peer] C is within 10.0.0.0/24 of [Peer] B",
+	};
+
+	ASSERT_EQ(taken.n_conflicts(), 2ull);
+	ASSERT_TRUE(taken.report() == expected_taken);
+
+	// Every prefix which overlaps an earlier one of another peer, for
+	// random prefixes of which each peer has distinct ones
+	srand(7);
+
+	AllowedIPsTrie random;
+	std::vector<std::pair<size_t, Cidr>> inserted;
+	uint64_t n_overlapping = 0;
+
+	for(size_t peer = 0; peer < 200; peer++) {
+		std::vector<Cidr> allowed_ips;
+
+		for(size_t i = 0; i < 3; i++) {
+			Cidr cidr = *parse_cidr("10.0.0.0/8");
+			cidr.addr[2] = uint8_t(rand());
+			cidr.addr[3] = uint8_t(rand());
+			cidr.prefix_len = uint8_t(16 + rand() % 17);
+			cidr = coalesce_routes({ cidr })[0];
+
+			if(std::find(allowed_ips.begin(), allowed_ips.end(), cidr) != allowed_ips.end()) {
+				continue;
+			}
+
+			bool overlaps = false;
+			for(auto const & [other, earlier] : inserted) {
+				std::vector<Cidr> both = coalesce_routes({ earlier, cidr });
+				overlaps = overlaps or (other != peer and both.size() == 1 and (both[0] == earlier or both[0] == cidr));
+			}
+
+			n_overlapping += overlaps;
+			inserted.emplace_back(peer, cidr);
+			allowed_ips.push_back(cidr);
+		}
+
+		random.add_peer(std::to_string(peer), allowed_ips);
+	}
+
+	ASSERT_GT(n_overlapping, 10ull);
+	ASSERT_EQ(random.n_conflicts(), n_overlapping);
+	ASSERT_EQ(random.report().size(), AllowedIPsTrie::MAX_REPORTED + 1);
+
+	// Conflicts are warnings, or errors when strict
+	std::string input = hub_config(10) + (
+		"[Peer]\n"
+		"PublicKey = sMYYPASxJslAuszh5PgUPysrzZHHBOzawJ8PFbRQrHI=\n"
+		"AllowedIPs = 10.0.0.0/24\n"
+	);
+
+	SystemdConfig cfg = wg2nd::wg2nd("wg", std::string_view { input }, "/etc/systemd/network/", {});
+	ASSERT_EQ(cfg.warnings.size(), 1ull);
+	ASSERT_TRUE(cfg.warnings[0].find("AllowedIPs 10.0.0.0/24 of [Peer] sMYY") == 0);
+	ASSERT_TRUE(cfg.warnings[0].find("contains 10.0.0.0/32 of [Peer] kMIIVx") != std::string::npos);
+
+	StringSink netdev, network;
+	ASSERT_EXCEPTION(wg2nd::wg2nd("wg", std::string_view { input }, SystemdSinks { .netdev = &netdev, .network = &network },
+		"/etc/systemd/network/", {}, ActivationPolicy::MANUAL, GenerateOptions { .strict_allowed_ips = true }),
+		ConfigurationException);
+	ASSERT_TRUE(netdev.contents.empty());
+}
+
+UTEST(wg2nd, fixed_base_public_keys) {
+	auto from_hex = [](char const * hex) {
+		std::array<uint8_t, 32> key;
+		for(size_t i = 0; i < key.size(); i++) {
+			key[i] = uint8_t(std::stoul(std::string(hex + 2 * i, 2), nullptr, 16));
+		}
+		return key;
+	};
+
+	// RFC 7748, section 6.1
+	std::array<std::pair<char const *, char const *>, 2> vectors = {{
+		{
+			"77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+			"8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a",
+		},
+		{
+			"5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb",
+			"de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f",
+		},
+	}};
+
+	for(auto const & [secret, expected] : vectors) {
+		std::array<uint8_t, 32> pub;
+		curve25519_generate_public(pub.data(), from_hex(secret).data());
+		ASSERT_TRUE(pub == from_hex(expected));
+	}
+
+	// The table agrees with the ladder, including for the extreme scalars
+	uint8_t const basepoint[32] = { 9 };
+	srand(25519);
+
+	for(int i = 0; i < 1000; i++) {
+		std::array<uint8_t, 32> secret;
+		for(uint8_t & byte : secret) {
+			byte = i == 0 ? 0x00 : i == 1 ? 0xff : uint8_t(rand());
+		}
+
+		std::array<uint8_t, 32> fixed_base, ladder;
+		curve25519_generate_public(fixed_base.data(), secret.data());
+		curve25519(ladder.data(), secret.data(), basepoint);
+		ASSERT_TRUE(fixed_base == ladder);
+	}
+}
+
+UTEST(wg2nd, batch_public_keys) {
+	// Two full blocks of the shared inversion and part of a third
+	constexpr size_t N = 150;
+
+	std::vector<std::array<uint8_t, 32>> secrets(N), pubs(N);
+	srand(22);
+
+	for(std::array<uint8_t, 32> & secret : secrets) {
+		for(uint8_t & byte : secret) {
+			byte = uint8_t(rand());
+		}
+	}
+
+	curve25519_generate_public_batch(
+		reinterpret_cast<uint8_t (*)[32]>(pubs.data()),
+		reinterpret_cast<uint8_t const (*)[32]>(secrets.data()),
+		N
+	);
+
+	for(size_t i = 0; i < N; i++) {
+		std::array<uint8_t, 32> pub;
+		curve25519_generate_public(pub.data(), secrets[i].data());
+		ASSERT_TRUE(pubs[i] == pub);
+	}
+
+	// Keyfile names, with improperly formatted keys among them
+	constexpr char const * BASE64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::vector<std::string> priv_keys;
+
+	for(std::array<uint8_t, 32> const & secret : secrets) {
+		std::string key;
+		for(size_t i = 0; i < 32; i += 3) {
+			uint32_t v = secret[i] << 16 | (i + 1 < 32 ? secret[i + 1] << 8 : 0) | (i + 2 < 32 ? secret[i + 2] : 0);
+			for(size_t j = 0; j < 4; j++) {
+				key.push_back(BASE64[(v >> (18 - 6 * j)) & 63]);
+			}
+		}
+		key.back() = '=';
+		priv_keys.push_back(std::move(key));
+	}
+
+	priv_keys[3].pop_back();
+	priv_keys[64] = "";
+	priv_keys[149][0] = '!';
+
+	std::vector<std::optional<std::string>> names = wg2nd::private_keyfile_names(priv_keys);
+	ASSERT_EQ(names.size(), N);
+
+	for(size_t i = 0; i < N; i++) {
+		char pub_key[WG_KEY_LEN_BASE32];
+
+		if(wg_pubkey_base32(priv_keys[i].c_str(), pub_key)) {
+			ASSERT_FALSE(names[i].has_value());
+		} else {
+			std::string expected = std::string(pub_key) + ".privkey";
+			ASSERT_TRUE(names[i].has_value());
+			ASSERT_STREQ(names[i]->c_str(), expected.c_str());
+		}
+	}
+
+	ASSERT_FALSE(names[3].has_value());
+	ASSERT_FALSE(names[64].has_value());
+	ASSERT_FALSE(names[149].has_value());
+	ASSERT_TRUE(names[0].has_value());
+}
+
+UTEST(wg2nd, base64_keys) {
+	constexpr char const * ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	srand(24);
+
+	for(int n = 0; n < 100; n++) {
+		std::array<uint8_t, 32> key, decoded;
+		for(uint8_t & byte : key) {
+			byte = uint8_t(rand());
+		}
+
+		char base64[WG_KEY_LEN_BASE64];
+		key_to_base64(base64, key.data());
+
+		ASSERT_TRUE(key_from_base64(decoded.data(), base64));
+		ASSERT_TRUE(decoded == key);
+
+		if(n != 0) {
+			continue;
+		}
+
+		// Every substitution of every character, against the rules of the
+		// format: 43 characters of the alphabet, of which the last has its
+		// two low bits (past the key) clear, followed by '=', through each
+		// decoder the CPU has
+		for(base64_backend backend : { BASE64_BACKEND_SCALAR, BASE64_BACKEND_SSSE3 }) {
+			if(key_from_base64_backend(backend, decoded.data(), base64) < 0) {
+				ASSERT_NE(backend, BASE64_BACKEND_SCALAR);
+				continue;
+			}
+			ASSERT_TRUE(decoded == key);
+
+			for(int pos = 0; pos < 44; pos++) {
+				for(int c = 1; c < 256; c++) {
+					char corrupted[WG_KEY_LEN_BASE64];
+					memcpy(corrupted, base64, sizeof(corrupted));
+					corrupted[pos] = char(c);
+
+					char const * digit = strchr(ALPHABET, c);
+					bool expected = pos == 43 ? c == '=' : digit != nullptr and (pos != 42 or (digit - ALPHABET) % 4 == 0);
+
+					ASSERT_EQ(key_from_base64_backend(backend, decoded.data(), corrupted), int(expected));
+
+					if(expected) {
+						char reencoded[WG_KEY_LEN_BASE64];
+						key_to_base64(reencoded, decoded.data());
+						ASSERT_STREQ(reencoded, corrupted);
+					}
+				}
+			}
+
+			ASSERT_EQ(key_from_base64_backend(backend, decoded.data(), std::string(base64, 43).c_str()), 0);
+			ASSERT_EQ(key_from_base64_backend(backend, decoded.data(), (std::string(base64) + "=").c_str()), 0);
+			ASSERT_EQ(key_from_base64_backend(backend, decoded.data(), ""), 0);
+		}
+	}
+
+	// The batch agrees with each key alone
+	std::vector<std::string> encoded = {
+		"YAnz5TF+lXXJte14tji3zlMNq+hd2rYUIgJBgB3fBmk=",
+		"YAnz5TF+lXXJte14tji3zlMNq+hd2rYUIgJBgB3fBmn=",
+		"",
+		"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=",
+		"////////////////////////////////////////+/8=",
+	};
+	std::vector<char const *> pointers;
+	for(std::string const & s : encoded) {
+		pointers.push_back(s.c_str());
+	}
+
+	std::vector<std::array<uint8_t, 32>> keys(encoded.size());
+	bool valid[5];
+
+	ASSERT_EQ(keys_from_base64(reinterpret_cast<uint8_t (*)[32]>(keys.data()), pointers.data(), valid, encoded.size()), size_t(2));
+
+	for(size_t i = 0; i < encoded.size(); i++) {
+		std::array<uint8_t, 32> key;
+		ASSERT_TRUE(valid[i] == key_from_base64(key.data(), pointers[i]));
+		if(valid[i]) {
+			ASSERT_TRUE(key == keys[i]);
+		}
+	}
+}
+
+UTEST(wg2nd, public_key_backends) {
+	// Not a multiple of the lanes of any backend
+	constexpr size_t N = 203;
+
+	std::vector<std::array<uint8_t, 32>> secrets(N), expected(N);
+	srand(23);
+
+	for(size_t i = 0; i < N; i++) {
+		for(uint8_t & byte : secrets[i]) {
+			byte = i == 0 ? 0x00 : i == 1 ? 0xff : uint8_t(rand());
+		}
+		curve25519_generate_public(expected[i].data(), secrets[i].data());
+	}
+
+	for(curve25519_backend backend : {
+		CURVE25519_BACKEND_AUTO,
+		CURVE25519_BACKEND_SCALAR,
+		CURVE25519_BACKEND_AVX512IFMA,
+	}) {
+		std::vector<std::array<uint8_t, 32>> pubs(N);
+
+		int ret = curve25519_generate_public_batch_backend(backend,
+			reinterpret_cast<uint8_t (*)[32]>(pubs.data()),
+			reinterpret_cast<uint8_t const (*)[32]>(secrets.data()), N);
+
+		// Backends the CPU lacks are only checked where they exist
+		if(ret != 0) {
+			ASSERT_NE(backend, CURVE25519_BACKEND_AUTO);
+			ASSERT_NE(backend, CURVE25519_BACKEND_SCALAR);
+			continue;
+		}
+
+		for(size_t i = 0; i < N; i++) {
+			ASSERT_TRUE(pubs[i] == expected[i]);
+		}
+
+		// The keys may be derived in place
+		pubs = secrets;
+		curve25519_generate_public_batch_backend(backend,
+			reinterpret_cast<uint8_t (*)[32]>(pubs.data()),
+			reinterpret_cast<uint8_t const (*)[32]>(pubs.data()), N);
+
+		for(size_t i = 0; i < N; i++) {
+			ASSERT_TRUE(pubs[i] == expected[i]);
+		}
+	}
+}
+
+UTEST(wg2nd, base32_keys) {
+	constexpr char const * ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+	constexpr size_t N = 131;
+
+	std::vector<std::array<uint8_t, 32>> keys(N);
+	srand(25);
+
+	for(size_t i = 0; i < N; i++) {
+		for(uint8_t & byte : keys[i]) {
+			byte = i == 0 ? 0x00 : i == 1 ? 0xff : uint8_t(rand());
+		}
+	}
+
+	for(size_t i = 0; i < N; i++) {
+		// RFC 4648, five bits at a time from the most significant
+		std::string expected;
+		for(size_t bit = 0; bit < 32 * 8; bit += 5) {
+			unsigned digit = 0;
+			for(size_t j = bit; j < bit + 5; j++) {
+				digit = digit << 1 | (j < 32 * 8 ? keys[i][j / 8] >> (7 - j % 8) & 1 : 0);
+			}
+			expected += ALPHABET[digit];
+		}
+		expected += "====";
+
+		char base32[WG_KEY_LEN_BASE32];
+		key_to_base32(base32, keys[i].data());
+
+		ASSERT_STREQ(base32, expected.c_str());
+	}
 }
 
 UTEST_MAIN()